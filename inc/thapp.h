@@ -27,6 +27,7 @@
 #define THAPP_DISP_VAL_LEAD_BYTES 4
 
 #define THAPP_DISP_BUFF_SZ 256
+#define THAPP_CMD_PENDING 16							/* outstanding commands tracked */
 #define THAPP_SEC_DIV(obj_ptr)			\
     1000000 / (obj_ptr)->var_sleep_time
 #define THAPP_POST_INC_MSGCOUNT(obj_ptr)	\
@@ -64,6 +65,24 @@ typedef enum {
     thapp_master
 } thapp_opmode;
 
+/*
+ * Command statistics. Latencies are in micro seconds, actuation latency is
+ * the time from sending a command to the server applying it, round trip is
+ * the time to recieving the acknowledgement.
+ */
+struct thapp_cmd_stats
+{
+    unsigned long var_sent;							/* commands sent */
+    unsigned long var_acked;							/* commands acknowledged */
+    unsigned long var_failed;							/* commands the server failed to apply */
+    unsigned long var_superseded;						/* output writes replaced by newer ones */
+    unsigned long var_lost;							/* commands not acknowledged */
+    double var_act_lat;								/* actuation latency of the last command */
+    double var_act_lat_max;
+    double var_rtt;								/* round trip of the last command */
+    double var_rtt_max;
+};
+
 /*
  * Table of function pointers.
  * All child classes inherits this class
@@ -89,6 +108,7 @@ struct _thapp
     unsigned int var_sleep_time;						/* sleep time (miliseconds) */
     unsigned int var_max_opt_rows;						/* Maximum optional rows */
     unsigned int var_queue_limit;
+    unsigned int var_sub_mask;							/* channels used by the child, 0 for all */
 
     volatile sig_atomic_t _var_con_sec_flg;					/* Flag to indicate the secondary connection was established */
 
@@ -103,6 +123,27 @@ struct _thapp
     thapp_opmode var_op_mode;							/* operation mode */
     config_t var_config;							/* configuration pointer */
     struct thor_msg _msg_buff;							/* message buffer */
+
+    /* Outstanding commands indexed by request id and their send time (ns) */
+    unsigned int _var_cmd_id;
+    unsigned int _var_cmd_ids[THAPP_CMD_PENDING];
+    unsigned long long _var_cmd_sent[THAPP_CMD_PENDING];
+    struct thapp_cmd_stats var_cmd_stats;
+
+    /*
+     * Sample statistics. Gaps in the sequence numbers count samples
+     * missed, including the ones dropped when the queue was full. Only
+     * samples sent at the sample rate are counted, not decimated ones of
+     * a subscription or the latest sample of shared memory. Sequence is
+     * restarted after reconnecting. Age is the time since the sample was
+     * acquired (micro seconds).
+     */
+    unsigned long long _var_last_seq;
+    int _var_seq_reset;								/* set on reconnect */
+    unsigned long var_seq_gaps;
+    unsigned long var_queue_drops;
+    double var_sample_age;
+    struct thornifix_delta _var_delta;						/* state of the delta protocol stream */
     thcon _var_con;								/* connection object */
     thcon _var_con_sec;								/* secondary connection to the log server */
 
@@ -163,6 +204,21 @@ extern "C" {
     int thapp_start(thapp* obj);
     int thapp_stop(thapp* obj);
 
+    /*
+     * Send typed command to the server. Commands are not waited on, the
+     * acknowledgements update the command statistics. Returns the request
+     * id or -1 on error.
+     */
+    int thapp_send_cmd(thapp* obj, thor_cmd_type type, double arg0, double arg1);
+
+    /* Set analogue outputs */
+#define thapp_set_ao(obj_ptr, ao0, ao1)				\
+    thapp_send_cmd((obj_ptr), thor_cmd_set_ao, (ao0), (ao1))
+
+    /* Get command statistics */
+#define thapp_get_cmd_stats(obj_ptr)		\
+    (&(obj_ptr)->var_cmd_stats)
+
     /*
      * Message retrieves the value from the message queue
      * in a thread safe manor. The method is wrapped in
@@ -16,12 +16,12 @@
 
 /* STL queue for storing the messages */
 #include <queue>
+#include <string>
 
 struct _thasg_msg_wrap
 {
     int _fd;						/* File descriptor */
-    char _msg[THORNIFIX_MSG_BUFF_SZ];			/* message buffer */
-    size_t _msg_sz;
+    std::string _msg;					/* record with the line terminator */
 };
 
 class _thasg_websock
@@ -7,10 +7,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <string.h>
 #include <pthread.h>
 #include <semaphore.h>
-#include <gqueue.h>
 #include "thornifix.h"
 
 #define THCON_URL_BUFF_SZ 2048
@@ -31,6 +31,9 @@
 
 
 typedef struct _thcon thcon;
+struct _thcon_msg;
+struct _thcon_ring;
+struct _thcon_shm;
 struct thcon_buff
 {
     char* memory;
@@ -53,7 +56,8 @@ struct thcon_host_info
 typedef enum {
     thcon_disconnected,
     thcon_connected,
-    thcon_idle
+    thcon_idle,
+    thcon_connecting
 } thcon_stat;
 
 /*
@@ -71,6 +75,164 @@ typedef enum {
     thcon_mode_server
 } thcon_mode;
 
+/*
+ * Wire protocol of messages multicast by the server.
+ * Legacy clients receive the text encoding. Clients requesting
+ * the binary format or message framing send a hello packet after
+ * connecting, which is consumed by the server and not passed to the
+ * recv callback. The server replies with the same packet to
+ * acknowledge the protocol. Delta protocol is the binary format with
+ * samples sent as keyframes and delta records, servers not serving it
+ * acknowledge the binary format.
+ */
+typedef enum {
+    thcon_proto_text,
+    thcon_proto_bin,
+    thcon_proto_delta
+} thcon_proto;
+
+/* protocol uses the binary format */
+#define THCON_PROTO_BIN(proto)					\
+    ((proto) == thcon_proto_bin || (proto) == thcon_proto_delta)
+
+/* Hello packet - 'T','H','C','N', version, protocol, flags, reserved */
+#define THCON_HELLO_SZ 8
+#define THCON_HELLO_VERSION 1
+#define THCON_HELLO_MAGIC "THCN"
+#define THCON_HELLO_MAGIC_SZ 4
+#define THCON_HELLO_FLG_FRAMED 0x01				/* messages are length prefixed */
+#define THCON_HELLO_FLG_RESUME 0x02				/* hello is followed by the last sequence number */
+#define THCON_HELLO_FLG_NODATA 0x04				/* samples are recieved from multicast or shared memory */
+#define THCON_HELLO_RESUME_SZ 8
+
+/*
+ * Subscription - 'T','H','S','B', channel mask, minimum interval between
+ * samples in micro seconds, both little endian. Sent by framed binary
+ * clients at any time after the hello, the server sends those clients
+ * subset records of the channels in the mask, decimated to the interval.
+ * A mask of zero restores all channels.
+ */
+#define THCON_SUB_SZ 12
+#define THCON_SUB_MAGIC "THSB"
+#define THCON_SUB_MAGIC_SZ 4
+
+/*
+ * Framing. When negotiated, every message in both directions is
+ * prefixed by its length as a four byte little endian integer. The
+ * receiving side reassembles the frames and calls the recv callback
+ * once for each complete message.
+ */
+#define THCON_FRAME_HDR_SZ 4
+#define THCON_MAX_FRAME_SZ 1048576
+
+#define THCON_DEF_RBUFF_SZ 4096						/* default size of connection receive buffers */
+#define THCON_MIN_RBUFF_SZ 512
+#define THCON_DEF_SEND_QUEUE_LEN 64					/* default length of connection send queues */
+#define THCON_MAX_REACTORS 16						/* maximum number of server reactors */
+#define THCON_DEF_HISTORY_LEN 64					/* default number of messages kept for resuming clients */
+#define THCON_MAX_BURST 256						/* messages multicast at once, taken from the pool without dropping */
+#define THCON_UNIX_PATH_SZ 108						/* size of unix domain socket paths */
+#define THCON_SHM_NAME_SZ 64						/* size of shared memory object names */
+
+/*
+ * Policy for a connection whose send queue is full.
+ * Drop oldest and drop newest discard one message, coalesce
+ * discards all queued messages keeping only the latest and
+ * disconnect closes the connection.
+ */
+typedef enum {
+    thcon_bp_drop_oldest,
+    thcon_bp_drop_newest,
+    thcon_bp_coalesce,
+    thcon_bp_disconnect
+} thcon_bp_policy;
+
+/*
+ * State of a connection. In server mode one is kept for each
+ * accepted socket, in client mode for the server.
+ */
+struct thcon_peer
+{
+    int _fd;							/* socket descriptor */
+    int _hs_flg;						/* flag to indicate hello was handled */
+    int _frm_flg;						/* flag to indicate messages are framed */
+    int _nodata_flg;						/* flag to indicate samples are not sent on the socket */
+    thcon_proto _proto;						/* negotiated protocol */
+
+    /*
+     * Receive buffer, allocated on the first read and kept for
+     * the life of the socket. Pending bytes start at the offset.
+     */
+    char* _rbuff;
+    size_t _rbuff_off;
+    size_t _rbuff_len;
+    size_t _rbuff_cap;
+
+    /*
+     * Message being written. Its held until the socket
+     * accepted all bytes, offset is the number of bytes written.
+     */
+    struct _thcon_msg* _out_msg;
+    size_t _out_off;
+    int _out_arm;						/* flag to indicate write notification is enabled */
+
+    /*
+     * Protocol and framing negotiated by the hello. They apply to
+     * received messages at once, the server switches the sent ones
+     * once the acknowledgement written ahead of the send queue is out.
+     */
+    struct _thcon_msg* _hs_ack;
+    thcon_proto _hs_proto;
+    int _hs_frm_flg;
+
+    /* Send queue of messages waiting to be written */
+    struct _thcon_msg** _outq;
+    unsigned int _outq_head;
+    unsigned int _outq_cnt;
+    unsigned int _outq_cap;
+
+    unsigned long long _sent_cnt;				/* number of messages written */
+    unsigned long long _drop_cnt;				/* number of messages dropped */
+
+    /* Subscription, samples are filtered and decimated for the client */
+    unsigned int _sub_mask;					/* channels sent, 0 for all */
+    unsigned int _sub_ival;					/* minimum interval between samples (us) */
+    unsigned long long _sub_last;				/* time the last sample was sent (us) */
+
+    /* Position in the connection table */
+    int _slot_next;						/* next free slot, when the slot is free */
+    unsigned int _live_pos;					/* position in the live list */
+    int _reactor;						/* reactor handling the connection */
+};
+
+/*
+ * Server reactor. Each reactor runs its own thread with a
+ * listening socket bound to the same port and an epoll instance.
+ * The kernel distributes incoming connections between the
+ * listening sockets, connections stay with the reactor which
+ * accepted them.
+ */
+struct thcon_reactor
+{
+    thcon* _obj;						/* connection object */
+    int _idx;							/* index of the reactor */
+    int _list_sock;						/* listening socket */
+    int _unix_sock;						/* listening unix domain socket, first reactor only */
+    int _epoll;							/* epoll instance */
+    int _wake_fd;						/* event descriptor to wake the reactor */
+    pthread_t _thread;						/* reactor thread */
+    void* _events;						/* event collection */
+};
+
+/* Statistics of a connection */
+struct thcon_peer_stats
+{
+    int _fd;
+    unsigned long long _sent_cnt;
+    unsigned long long _drop_cnt;
+    unsigned int _queued;
+};
+
 
 struct _thcon
 {
@@ -93,27 +255,25 @@ struct _thcon
     unsigned int var_num_conns;
     unsigned int var_geo_flg;				/* indicate geo location is obtained */
     unsigned int var_ip_flg;				/* indicate ip flag was obtained */
-    unsigned int _var_bf_sz;				/* dynamic buffer size holding */
+    unsigned int _var_bf_sz;				/* number of slots in the connection table */
     unsigned int _var_curl_timeout;			/* default time out mode */
 
-	unsigned int var_inbuff_sz;				/* size of the inbound buffer */
-	unsigned int var_outbuff_sz;			/* size of of the outbound buffer */
+	unsigned int var_rbuff_sz;				/* initial size of connection receive buffers */
+	unsigned int var_outq_len;				/* length of connection send queues */
+	thcon_bp_policy var_bp_policy;			/* policy on send queue overflow */
+	unsigned int var_num_reactors;			/* number of server reactors */
+	unsigned int var_hist_len;				/* number of messages kept for resuming clients */
+	int var_reconn_flg;						/* reconnect when the connection is lost in client mode */
+	unsigned int var_batch_cnt;				/* maximum messages written in a batch, 1 disables batching */
+	unsigned int var_batch_time;			/* batch window in micro seconds */
 
 	unsigned char var_mac_addr[THCON_MAC_ADDR_BUFF];
 	char var_subnet_addr[THCON_SUBNET_NAME_SZ];
 	char var_mac_addr_str[THCON_MAC_ADDR_STR_BUFF];
 
-    /*-----------------------------------------*/
-    /*
-     * Memory buffer to be used between read
-     * and write to the main programm.
-     */
-    char* var_membuff_in;
-    char* var_membuff_out;
-    /*-----------------------------------------*/
-
     char var_port_name[THCON_PORT_NAME_SZ];
     char var_svr_name[THCON_SERVER_NAME_SZ];
+    char var_unix_path[THCON_UNIX_PATH_SZ];			/* unix domain socket, empty if not used */
 
     char var_ip_addr_url[THCON_URL_BUFF_SZ];		/* url for the ip address locator */
     char var_geo_addr_url[THCON_URL_BUFF_SZ];		/* url for the geo information */
@@ -122,17 +282,77 @@ struct _thcon
     struct thcon_buff _var_url_buff;				/* buffer to hold external url */
     struct thcon_host_info var_my_info;				/* information about the location */
 
-    int* _var_cons_fds;								/* connection sockets */
-    int* _var_epol_inst;							/* epoll instance */
-    void* _var_event_col;							/* event collection */
+    thcon_proto var_proto;							/* protocol requested in client mode */
+    int var_frm_flg;								/* request message framing in client mode */
+    unsigned int var_sub_mask;						/* channels subscribed in client mode, 0 for all */
+    unsigned int var_sub_ival;						/* minimum interval between samples (us) */
+    struct thcon_peer _var_svr_peer;				/* server connection state in client mode */
+    unsigned long long _var_last_seq;				/* last sequence number recieved in client mode */
+
+    /*
+     * Multicast data plane. In server mode sequenced messages are
+     * additionally sent as one datagram to the group, in client mode
+     * the group is joined and the datagrams are delivered to the recv
+     * callback. Gaps are the number of messages missed by the client.
+     */
+    char var_mc_group[THCON_SERVER_NAME_SZ];
+    char var_mc_port[THCON_PORT_NAME_SZ];
+    int _var_mc_sock;
+    struct sockaddr_in _var_mc_addr;
+    unsigned long long _var_mc_gaps;
+
+    /*
+     * Shared memory transport for clients on the same host. Server
+     * writes sequenced messages to a ring of slots in the shared memory
+     * object, clients map it read only and read the latest message
+     * without a system call.
+     */
+    char var_shm_name[THCON_SHM_NAME_SZ];
+    struct _thcon_shm* _var_shm;
+    size_t _var_shm_sz;
+
+    /*
+     * Delta encoding of samples in server mode. Samples are encoded once
+     * for all clients of the delta protocol, a keyframe is sent after a
+     * client connects.
+     */
+    int var_delta_flg;
+    int _var_delta_key;
+    struct thornifix_delta var_delta;
+
+    /* History of sequenced messages sent in server mode */
+    struct _thcon_msg** _var_hist;
+    unsigned int _var_hist_head;
+    unsigned int _var_hist_cnt;
+    unsigned int _var_hist_cap;
+    /*
+     * Connection table. Slots are reused through the free list,
+     * the live list holds slots of open connections and the map
+     * gives the slot of a socket descriptor. Connections are
+     * allocated once for each slot and do not move when the table grows.
+     */
+    struct thcon_peer** _var_cons;					/* connection slots */
+    unsigned int* _var_live;						/* slots of open connections */
+    int* _var_fd_map;								/* slot of each descriptor, -1 if none */
+    unsigned int _var_fd_map_sz;
+    int _var_free_slot;								/* head of the free list */
+    struct thcon_reactor* _var_reactors;			/* server reactors */
 
     pthread_t _var_run_thread;						/* internal running thread */
+    int _var_wake_fd;								/* event descriptor to stop the client thread */
     pthread_t _var_svr_write_thread;				/* server writing thread */
     pthread_mutex_t _var_mutex;						/* mutex for controlling file descriptor array */
-    pthread_mutex_t _var_mutex_q;					/* mutex for protecting the queue */
-    sem_t _var_sem;									/* semaphore for controlling the delete method */
+    pthread_mutex_t _var_mutex_cb;					/* mutex serialising callbacks of the reactors */
     void* _ext_obj;									/* external object pointer */
-    gqueue _msg_queue;								/* message queue */
+
+    /*
+     * Outbound messages waiting for the writer thread. Writer
+     * is woken through the descriptor only when its idle.
+     */
+    struct _thcon_ring* _var_ring;
+    struct _thcon_ring* _var_pool;					/* messages kept for reuse */
+    int _var_ring_fd;
+    int _var_ring_idle;
 
     /* set callback function to get a callback when data is recieve or write on the socket */
     /*
@@ -157,6 +377,12 @@ struct _thcon
      * Third argument is the closed socket.
      */
     int (*_thcon_conn_closed)(void*, void*, int);
+
+    /*
+     * Callback method to indicate the connection status changed
+     * in client mode. Third argument is the new status.
+     */
+    int (*_thcon_state_callback)(void*, void*, thcon_stat);
 };
 
 #ifdef __cplusplus
@@ -193,12 +419,66 @@ extern "C" {
     /* In the server mode, message is sent to all sockets */
     int thcon_send_info(thcon* obj, void* data, size_t sz);
 
+    /*
+     * Send to the connection of the socket in server mode, used for
+     * replies to a single client. Sent to the server in client mode.
+     */
+    int thcon_send_to(thcon* obj, int fd, void* data, size_t sz);
+
+    /*
+     * Post a reply to the connection of the socket in server mode from
+     * a thread which shall not block, such as the acquisition thread.
+     * The reply is taken from the message pool and written by the writer
+     * thread. Replies are limited to the size of a text message.
+     */
+    int thcon_post_to(thcon* obj, int fd, const void* data, size_t sz);
+
+    /* Set subscription of the connection of the socket in server mode */
+    int thcon_set_peer_sub(thcon* obj, int fd, unsigned int mask, unsigned int ival);
+
+    /*
+     * Subscribe to the channels in mask (THORNIFIX_CH_*) at a maximum rate
+     * in Hz, a rate of zero is not limited. Only framed binary clients may
+     * subscribe, the subscription is sent again after reconnecting.
+     */
+    int thcon_subscribe(thcon* obj, unsigned int mask, double rate);
+
     /*
      * Multicast message to all connected sockets.
      * Only works on the server mode.
      */
     int thcon_multicast(thcon* obj, void* data, size_t sz);
 
+    /*
+     * Multicast message struct to all connected sockets. The message is
+     * encoded once in each wire format and every connection is sent the
+     * encoding it negotiated. Sequence number and acquisition time stamp
+     * of the message are carried in the binary header, messages with a
+     * sequence number of zero are not kept for resuming clients.
+     */
+    int thcon_multicast_msg(thcon* obj, const struct thor_msg* msg);
+
+    /*
+     * Read the latest message of the shared memory transport to the buffer
+     * in client mode. Sequence number of the message is set if the pointer
+     * is not NULL. Returns the size of the message, 0 if there was no message
+     * or -1 if the shared memory is not mapped or the buffer is too small.
+     */
+    int thcon_shm_latest(thcon* obj, void* buff, size_t sz, unsigned long long* seq);
+
+    /*
+     * Read the message with sequence number seq of the shared memory
+     * transport. Returns the size of the message, 0 if its not written yet
+     * or -1 if it was overwritten.
+     */
+    int thcon_shm_read(thcon* obj, unsigned long long seq, void* buff, size_t sz);
+
+    /*
+     * Copy statistics of up to num connections to the stats array.
+     * Returns the number of connections copied.
+     */
+    int thcon_get_peer_stats(thcon* obj, struct thcon_peer_stats* stats, unsigned int num);
+
 	/*
 	 * Wake on lan device from mac address
 	 */
@@ -243,6 +523,114 @@ extern "C" {
 #define thcon_set_conmade_callback(obj, fptr)	\
     (obj)->_thcon_conn_made = fptr
 
+    /* Set callback to indicate the connection status changed */
+#define thcon_set_state_callback(obj, fptr)	\
+    (obj)->_thcon_state_callback = fptr
+
+    /* Reconnect with a back off when the connection is lost in client mode */
+#define thcon_set_reconnect(obj, flg)		\
+    (obj)->var_reconn_flg = (flg)
+
+    /*
+     * Batch messages in server mode. Messages are written to framed
+     * connections together once cnt messages were queued or usec micro
+     * seconds passed since the first, whichever is earlier. If usec is
+     * zero, messages waiting when the writer catches up are batched.
+     */
+#define thcon_set_batch(obj, cnt, usec)		\
+    do {					\
+	(obj)->var_batch_cnt = (cnt);		\
+	(obj)->var_batch_time = (usec);		\
+    } while(0)
+
+    /*
+     * Publish samples to a UDP multicast group or broadcast address in
+     * server mode. In client mode the group is joined and the server is
+     * asked not to send samples on the connection, commands and replies
+     * stay on the connection. Clients only join using the binary protocol.
+     */
+#define thcon_set_mcast(obj, group, port)					\
+    do {									\
+	memset((void*) (obj)->var_mc_group, 0, THCON_SERVER_NAME_SZ);		\
+	strncpy((obj)->var_mc_group, group, THCON_SERVER_NAME_SZ-1);		\
+	memset((void*) (obj)->var_mc_port, 0, THCON_PORT_NAME_SZ);		\
+	strncpy((obj)->var_mc_port, port, THCON_PORT_NAME_SZ-1);		\
+    } while(0)
+
+    /*
+     * Set unix domain socket path. Server listens on the path in addition
+     * to the port, clients connect to the path instead of the server name.
+     */
+#define thcon_set_unix_path(obj, path)					\
+    do {								\
+	memset((void*) (obj)->var_unix_path, 0, THCON_UNIX_PATH_SZ);	\
+	strncpy((obj)->var_unix_path, path, THCON_UNIX_PATH_SZ-1);	\
+    } while(0)
+
+    /*
+     * Set name of the shared memory object. Server creates it and writes
+     * samples to it, clients map it and are no longer sent samples on
+     * the connection.
+     */
+#define thcon_set_shm_name(obj, name)					\
+    do {								\
+	memset((void*) (obj)->var_shm_name, 0, THCON_SHM_NAME_SZ);	\
+	strncpy((obj)->var_shm_name, name, THCON_SHM_NAME_SZ-1);	\
+    } while(0)
+
+    /* Check shared memory transport is mapped */
+#define thcon_shm_mapped(obj)			\
+    ((obj)->_var_shm != NULL)
+
+    /* Get number of multicast messages missed in client mode */
+#define thcon_get_mcast_gaps(obj)		\
+    (obj)->_var_mc_gaps
+
+    /* Set number of messages kept for resuming clients in server mode */
+#define thcon_set_history_len(obj, len)		\
+    (obj)->var_hist_len = (len)
+
+    /*
+     * Serve the delta protocol in server mode with a keyframe every
+     * ival samples. Channel deadbands and resolutions are set on the
+     * stream state returned by thcon_get_delta.
+     */
+#define thcon_set_delta(obj, ival)				\
+    do {							\
+	(obj)->var_delta_flg = 1;				\
+	thornifix_delta_init(&(obj)->var_delta, (ival));	\
+    } while(0)
+
+#define thcon_get_delta(obj)			\
+    (&(obj)->var_delta)
+
+    /* Set protocol to request from the server in client mode */
+#define thcon_set_proto(obj, proto)		\
+    (obj)->var_proto = (proto)
+
+    /* Set initial size of the receive buffer of each connection */
+#define thcon_set_recv_buff_sz(obj, sz)		\
+    (obj)->var_rbuff_sz = (sz)
+
+    /* Set length of the send queue of each connection */
+#define thcon_set_send_queue_len(obj, len)	\
+    (obj)->var_outq_len = (len)
+
+    /* Set policy when a send queue is full */
+#define thcon_set_bp_policy(obj, policy)	\
+    (obj)->var_bp_policy = (policy)
+
+    /*
+     * Set number of reactor threads in server mode. With more than one,
+     * each reactor listens on the port using SO_REUSEPORT.
+     */
+#define thcon_set_reactors(obj, num)		\
+    (obj)->var_num_reactors = (num)
+
+    /* Request length prefixed messages in client mode */
+#define thcon_set_framing(obj, flg)		\
+    (obj)->var_frm_flg = (flg)
+
     /* Set timeout method */
 #define thcon_set_timeout(obj, time)		\
     (obj)->_var_curl_timeout = time
@@ -0,0 +1,144 @@
+/*
+ * Data acquisition device interface. The system object reads and writes
+ * the device through the function table only, backends are the NI driver,
+ * a simulated device for running the server without hardware and the
+ * replay of a captured session.
+ */
+#ifndef __THDAQ_H__
+#define __THDAQ_H__
+
+#include <stdlib.h>
+#include <libconfig.h>
+#include "thornifix.h"
+
+typedef struct _thdaq thdaq;
+
+/* Function pointer table */
+struct thdaq_vftpr
+{
+    void (*var_del_fptr)(void*);					/* Delete function pointer */
+    int (*var_set_config_fptr)(void*, const config_setting_t*);		/* Backend settings */
+    int (*var_create_fptr)(void*);					/* Create tasks and channels */
+    int (*var_clear_fptr)(void*);					/* Clear tasks */
+    int (*var_cfg_clock_fptr)(void*, float64, unsigned int);		/* Sample rate and buffer size in scans */
+    int (*var_start_fptr)(void*);					/* Start tasks */
+    int (*var_stop_fptr)(void*);					/* Stop tasks */
+
+    /* Read scans grouped by scan, number of scans, time out, buffer, buffer size, scans read */
+    int (*var_read_fptr)(void*, unsigned int, float64, float64*, unsigned int, int32*);
+
+    /* Write one scan to the output channels */
+    int (*var_write_fptr)(void*, const float64*, unsigned int);
+};
+
+struct _thdaq
+{
+    const char* var_ai_chan;						/* physical input channels */
+    const char* var_ao_chan;						/* physical output channels */
+    unsigned int var_num_ai;						/* number of input channels */
+    unsigned int var_num_ao;						/* number of output channels */
+    float64 var_min_val;						/* channel range */
+    float64 var_max_val;
+
+    /*
+     * Reads wait for the source, such as a replay, and return scans at
+     * its timing. Scans read one at a time are all passed on without
+     * pacing the reads.
+     */
+    unsigned int var_paced;
+
+    /* Function pointers set by the backend */
+    struct thdaq_vftpr var_fptr;
+
+    void* var_child;							/* pointer to the backend object */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * Backends, objects are allocated and freed with thdaq_delete.
+     * The NI backend returns NULL if the driver was not included.
+     */
+    thdaq* thdaq_ni_new(void);
+    thdaq* thdaq_sim_new(void);
+    thdaq* thdaq_replay_new(void);
+
+    /* Set channels, shall be set before the tasks are created */
+#define thdaq_set_channels(obj_ptr, ai, num_ai, ao, num_ao, min, max)	\
+    do {								\
+	(obj_ptr)->var_ai_chan = (ai);					\
+	(obj_ptr)->var_num_ai = (num_ai);				\
+	(obj_ptr)->var_ao_chan = (ao);					\
+	(obj_ptr)->var_num_ao = (num_ao);				\
+	(obj_ptr)->var_min_val = (min);					\
+	(obj_ptr)->var_max_val = (max);					\
+    } while(0)
+
+    /* Delete the backend */
+    inline __attribute__ ((always_inline)) static void thdaq_delete(thdaq* obj)
+    {
+	if(obj && obj->var_fptr.var_del_fptr)
+	    obj->var_fptr.var_del_fptr(obj->var_child);
+	return;
+    }
+
+    /* Set backend settings, backends without settings ignore them */
+    inline __attribute__ ((always_inline)) static int thdaq_set_config(thdaq* obj, const config_setting_t* setting)
+    {
+	if(obj == NULL)
+	    return -1;
+
+	if(setting && obj->var_fptr.var_set_config_fptr)
+	    return obj->var_fptr.var_set_config_fptr(obj->var_child, setting);
+	return 0;
+    }
+
+    /*
+     * Device methods, all return 0 on success and -1 if the call
+     * failed or the backend does not support it. Errors are logged
+     * by the backend.
+     */
+    inline __attribute__ ((always_inline)) static int thdaq_create(thdaq* obj)
+    {
+	return (obj && obj->var_fptr.var_create_fptr)? obj->var_fptr.var_create_fptr(obj->var_child) : -1;
+    }
+
+    inline __attribute__ ((always_inline)) static int thdaq_clear(thdaq* obj)
+    {
+	return (obj && obj->var_fptr.var_clear_fptr)? obj->var_fptr.var_clear_fptr(obj->var_child) : -1;
+    }
+
+    inline __attribute__ ((always_inline)) static int thdaq_cfg_clock(thdaq* obj, float64 rate, unsigned int buff_sz)
+    {
+	return (obj && obj->var_fptr.var_cfg_clock_fptr)? obj->var_fptr.var_cfg_clock_fptr(obj->var_child, rate, buff_sz) : -1;
+    }
+
+    inline __attribute__ ((always_inline)) static int thdaq_start(thdaq* obj)
+    {
+	return (obj && obj->var_fptr.var_start_fptr)? obj->var_fptr.var_start_fptr(obj->var_child) : -1;
+    }
+
+    inline __attribute__ ((always_inline)) static int thdaq_stop(thdaq* obj)
+    {
+	return (obj && obj->var_fptr.var_stop_fptr)? obj->var_fptr.var_stop_fptr(obj->var_child) : -1;
+    }
+
+    inline __attribute__ ((always_inline)) static int thdaq_read(thdaq* obj, unsigned int scans, float64 time_out, float64* buff, unsigned int sz, int32* read)
+    {
+	if(read)
+	    *read = 0;
+	return (obj && obj->var_fptr.var_read_fptr)? obj->var_fptr.var_read_fptr(obj->var_child, scans, time_out, buff, sz, read) : -1;
+    }
+
+    inline __attribute__ ((always_inline)) static int thdaq_write(thdaq* obj, const float64* buff, unsigned int sz)
+    {
+	return (obj && obj->var_fptr.var_write_fptr)? obj->var_fptr.var_write_fptr(obj->var_child, buff, sz) : -1;
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __THDAQ_H__ */
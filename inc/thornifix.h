@@ -57,6 +57,22 @@
 #define CVICALLBACK __cdecl
 #endif
 #endif
+
+/* Types of the NI driver for builds without it, using the same guards */
+#if !defined THOR_INC_NI && (defined EXCLUDE_NI || !(defined (WIN32) || defined (_WIN32)))
+#ifndef _NI_int32_DEFINED_
+#define _NI_int32_DEFINED_
+typedef signed long int32;
+#endif
+#ifndef _NI_uInt32_DEFINED_
+#define _NI_uInt32_DEFINED_
+typedef unsigned long uInt32;
+#endif
+#ifndef _NI_float64_DEFINED_
+#define _NI_float64_DEFINED_
+typedef double float64;
+#endif
+#endif
 #define THOR_BUFF_SZ 2048
 
 /* pressure sensor calibration factors */
@@ -143,6 +159,10 @@ struct thor_msg
     double _di0_val __attribute__ ((aligned (THORNIFIX_MSG_BUFF_ELM_SZ)));
     double _di1_val __attribute__ ((aligned (THORNIFIX_MSG_BUFF_ELM_SZ)));
     /*--------------------------------------------*/
+
+    /* sequence number and acquisition time stamp (ns, monotonic clock) of the scan */
+    unsigned long long _seq __attribute__ ((aligned (THORNIFIX_MSG_BUFF_ELM_SZ)));
+    unsigned long long _tstamp __attribute__ ((aligned (THORNIFIX_MSG_BUFF_ELM_SZ)));
 };
 
 /* size of the message struct */
@@ -152,55 +172,212 @@ struct thor_msg
 
 /* initialise message struct */
 #define thorinifix_init_msg(t_obj)		\
-    memset((void*) (t_obj), 0, THORINIFIX_MSG_SZ)
-
-#define thornifix_encode_msg(t_obj, buff, size)	\
-    memset((void*) (buff), 0, (size));		\
-    sprintf((buff),				\
-	    "%i|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|"				\
-	    "%.2f|",				\
-	    (t_obj)->_cmd,			\
-	    (t_obj)->_ao0_val,			\
-	    (t_obj)->_ao1_val,			\
-	    (t_obj)->_ai0_val,			\
-	    (t_obj)->_ai1_val,			\
-	    (t_obj)->_ai2_val,			\
-	    (t_obj)->_ai3_val,			\
-	    (t_obj)->_ai4_val,			\
-	    (t_obj)->_ai5_val,			\
-	    (t_obj)->_ai6_val,			\
-	    (t_obj)->_ai7_val,			\
-	    (t_obj)->_ai8_val,			\
-	    (t_obj)->_ai9_val,			\
-	    (t_obj)->_ai10_val,			\
-	    (t_obj)->_ai11_val,			\
-	    (t_obj)->_ai12_val,			\
-	    (t_obj)->_ai13_val,			\
-	    (t_obj)->_di0_val,			\
-	    (t_obj)->_di1_val)
+    memset((void*) (t_obj), 0, sizeof(struct thor_msg))
+
+/*
+ * Binary wire format.
+ * Fixed layout record of little endian values. Header carries magic bytes,
+ * format version, record type, command, sequence number and acquisition
+ * time stamp of the message. Header is followed by the analogue output, analogue input
+ * and digital input values in the order they appear in the message struct.
+ *
+ *  0       2     3      4       8       16        24
+ *  | magic | ver | type | cmd   | seq   | tstamp  | values (18 x 8) |
+ *
+ * Subset records carry a channel mask after the header and only the
+ * values of the channels set in the mask, in the same order.
+ *
+ *  0       24     28
+ *  | header | mask | values (n x 8) |
+ *
+ * Delta records carry the channels which changed beyond their deadband
+ * since the previous record of the stream. Values are quantised to the
+ * resolution of the channel and sent as counts of ten to the power of
+ * minus its decimal places, the decimal places follow the counts.
+ * Reference is the sequence number of the previous record, a stream of
+ * delta records starts from a sample record (keyframe).
+ *
+ *  0        24    32     36
+ *  | header | ref | mask | counts (n x 4) | decimals (n x 1, padded to 4) |
+ */
+#define THORNIFIX_BIN_MAGIC0 'T'
+#define THORNIFIX_BIN_MAGIC1 'B'
+#define THORNIFIX_BIN_VERSION 1
+#define THORNIFIX_BIN_TYPE_SAMPLE 0
+#define THORNIFIX_BIN_TYPE_SUBSET 1
+#define THORNIFIX_BIN_HDR_SZ 24
+#define THORNIFIX_BIN_VAL_NUM (THORNIFIX_MSG_ELM_NUM-1)
+#define THORNIFIX_BIN_MSG_SZ (THORNIFIX_BIN_HDR_SZ+THORNIFIX_BIN_VAL_NUM*THORNIFIX_MSG_BUFF_ELM_SZ)
+#define THORNIFIX_BIN_MASK_SZ 4
+#define THORNIFIX_BIN_TYPE_DELTA 2
+#define THORNIFIX_DELTA_HDR_SZ (THORNIFIX_BIN_HDR_SZ+8+THORNIFIX_BIN_MASK_SZ)
+#define THORNIFIX_DELTA_DEC_MAX 9
+#define THORNIFIX_DELTA_DEC_DEF 2
+
+/* Channel mask bits, in the order of the values */
+#define THORNIFIX_CH_AO(n) (1u << (n))
+#define THORNIFIX_CH_AI(n) (1u << (2+(n)))
+#define THORNIFIX_CH_DI(n) (1u << (16+(n)))
+#define THORNIFIX_CH_ALL ((1u << THORNIFIX_BIN_VAL_NUM) - 1)
+
+/*
+ * State of a delta encoded stream. Encoder and decoder both keep the
+ * values known to the reciever, a delta is only applied to the record it
+ * references. Encoder sends a keyframe every key interval records or when
+ * requested, decoder waits for one after a missing record.
+ */
+struct thornifix_delta
+{
+    unsigned int _key_ival;							/* records between keyframes, 0 for keyframes on request */
+    unsigned int _key_cnt;							/* records since the keyframe */
+    int _key_flg;								/* keyframe is required */
+    unsigned long long _ref;							/* sequence number of the previous record */
+    double _band[THORNIFIX_BIN_VAL_NUM];					/* deadband of the channels */
+    unsigned char _dec[THORNIFIX_BIN_VAL_NUM];					/* decimal places of the channels */
+    struct thor_msg _last;							/* values known to the reciever */
+};
+
+/* set deadband and decimal places of a channel */
+#define thornifix_delta_set_chan(obj, ch, band, dec)			\
+    do {								\
+	(obj)->_band[(ch)] = (band);					\
+	(obj)->_dec[(ch)] = (dec) > THORNIFIX_DELTA_DEC_MAX?		\
+	    THORNIFIX_DELTA_DEC_MAX : (unsigned char) (dec);		\
+    } while(0)
+
+/* request a keyframe as the next record */
+#define thornifix_delta_set_key(obj)		\
+    (obj)->_key_flg = 1
+
+/*
+ * Command records.
+ * Clients send typed commands with a request id, the server answers each
+ * with an acknowledgement carrying the same id, the status and the time
+ * stamp (nano seconds, monotonic clock) when the command was applied.
+ * Output writes are acknowledged once written to the device, a set AO
+ * replaced by a newer one before it was written is acknowledged with
+ * THORNIFIX_CMD_SUPERSEDED. Queue AO values are written one per scan in
+ * order for ramps, until a set AO replaces them. Arguments are the output
+ * values for set and queue AO, rate in Hz for set rate and the channel
+ * mask and rate in Hz for subscribe.
+ *
+ *  0       2     3      4    8        12         16       24
+ *  | magic | ver | type | id | status | reserved | tstamp | args (2 x 8) |
+ */
+#define THORNIFIX_CMD_MAGIC0 'T'
+#define THORNIFIX_CMD_MAGIC1 'C'
+#define THORNIFIX_CMD_VERSION 1
+#define THORNIFIX_CMD_ACK 0x80
+#define THORNIFIX_CMD_SUPERSEDED 1					/* status of writes replaced before applied */
+#define THORNIFIX_CMD_ARG_NUM 2
+#define THORNIFIX_CMD_SZ (24+THORNIFIX_CMD_ARG_NUM*THORNIFIX_MSG_BUFF_ELM_SZ)
+
+typedef enum {
+    thor_cmd_set_ao = 1,
+    thor_cmd_set_rate = 2,
+    thor_cmd_ping = 3,
+    thor_cmd_subscribe = 4,
+    thor_cmd_queue_ao = 5
+} thor_cmd_type;
+
+struct thor_cmd
+{
+    int _type;									/* command type, acknowledgements have THORNIFIX_CMD_ACK set */
+    unsigned int _id;								/* request id */
+    int _status;								/* zero if the command was applied, -1 if failed */
+    unsigned long long _tstamp;							/* time the command was applied (ns) */
+    double _args[THORNIFIX_CMD_ARG_NUM];					/* command arguments */
+};
+
+/* check if the buffer holds a command record */
+#define thornifix_is_cmd(buff, size)					\
+    ((size) >= THORNIFIX_CMD_SZ &&					\
+     ((const char*) (buff))[0] == THORNIFIX_CMD_MAGIC0 &&		\
+     ((const char*) (buff))[1] == THORNIFIX_CMD_MAGIC1)
+
+/* check if the buffer holds a binary encoded message */
+#define thornifix_is_bin_msg(buff, size)				\
+    ((size) >= THORNIFIX_BIN_HDR_SZ &&					\
+     ((const char*) (buff))[0] == THORNIFIX_BIN_MAGIC0 &&		\
+     ((const char*) (buff))[1] == THORNIFIX_BIN_MAGIC1)
+
+/* Error codes of the decode methods */
+#define THORNIFIX_ERR_ARGS -1
+#define THORNIFIX_ERR_FIELD -2							/* field is not a number */
+#define THORNIFIX_ERR_COUNT -3							/* message has too few fields */
+#define THORNIFIX_ERR_REF -4							/* delta record without the record it references */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
-    /* decode message */
+    /*
+     * Decode text message. All fields are required, returns zero or
+     * one of the error codes if the message is malformed.
+     */
     int thornifix_decode_msg(const char* buff, size_t size, struct thor_msg* msg);
+
+    /*
+     * Encode message to the text format. Values are written with two
+     * decimal places independent of the locale. Returns the length of
+     * the message excluding the terminating null character or -1 if
+     * the buffer was too small.
+     */
+    int thornifix_encode_msg(const struct thor_msg* msg, char* buff, size_t size);
+
+    /*
+     * Encode message to the binary format. Returns number of bytes
+     * written to the buffer or -1 if the buffer was too small.
+     */
+    int thornifix_encode_msg_bin(const struct thor_msg* msg, char* buff, size_t size);
+
+    /*
+     * Copy the channels in mask of the binary message to a subset record.
+     * Returns number of bytes written to the buffer or -1 on error.
+     */
+    int thornifix_subset_msg_bin(const char* buff,
+				 size_t size,
+				 unsigned int mask,
+				 char* out,
+				 size_t out_size);
+
+    /* Length of the binary record at the start of the buffer, -1 if its invalid */
+    int thornifix_bin_msg_len(const char* buff, size_t size);
+
+    /*
+     * Encode command record. Returns number of bytes written to the buffer
+     * or -1 if the buffer was too small.
+     */
+    int thornifix_encode_cmd(const struct thor_cmd* cmd, char* buff, size_t size);
+
+    /* Decode command record, returns -1 if its not a valid record */
+    int thornifix_decode_cmd(const char* buff, size_t size, struct thor_cmd* cmd);
+
+    /*
+     * Decode binary message. Values of channels not in a subset record
+     * are left unchanged. Delta records require the stream state and
+     * are rejected.
+     */
+    int thornifix_decode_msg_bin(const char* buff, size_t size, struct thor_msg* msg);
+
+    /*
+     * Initialise delta stream state. Channels are sent on any change of
+     * their value at the default decimal places, keyframe is required first.
+     */
+    void thornifix_delta_init(struct thornifix_delta* obj, unsigned int key_ival);
+
+    /*
+     * Encode message to the next record of the delta stream, a keyframe
+     * or a delta record. Returns number of bytes written to the buffer
+     * or -1 if the buffer was too small.
+     */
+    int thornifix_encode_msg_delta(struct thornifix_delta* obj, const struct thor_msg* msg, char* buff, size_t size);
+
+    /*
+     * Decode record of a delta stream to the full message. Keyframes and
+     * other binary records are accepted, returns THORNIFIX_ERR_REF for
+     * delta records until the next keyframe if a record was missed.
+     */
+    int thornifix_decode_msg_delta(struct thornifix_delta* obj, const char* buff, size_t size, struct thor_msg* msg);
 #ifdef __cplusplus
 }
 #endif
@@ -21,6 +21,7 @@ struct _thsvr
     const config_t* _var_config;
     thcon _var_con;
     thsys _var_sys;
+    FILE* _var_capture;					/* capture of the samples, binary records */
 };
 
 
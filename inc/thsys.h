@@ -5,14 +5,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
-#include <gqueue.h>
 #include "thornifix.h"
+#include "thdaq.h"
 
 #define THSYS_AI_CHANNELS "Dev1/ai0:13"
 #define THSYS_A0_CHANNELS "Dev1/ao0:1"
-#define THSYS_EMPTY_STR ""
-#define THSYS_CLOCK_SOURCE "OnboardClock"
 #define THSYS_NUM_AI_CHANNELS 14
 #define THSYS_NUM_AO_CHANNELS 2
 #define THSYS_MIN_VAL 0.0
@@ -20,9 +19,38 @@
 #define THSYS_DEFAULT_SAMPLE_RATE 4.0
 #define THSYS_READ_WRITE_FACTOR 1.5
 #define THSYS_DEF_TIMEOUT 10.0
+#define THSYS_BLOCK_BUFF_NUM 8				/* blocks held by the device buffer in block mode */
+#define THSYS_JITTER_REPORT 60				/* seconds between jitter reports */
+#define THSYS_OUT_FIFO_LEN 64				/* output writes queued for ramps */
+#define THSYS_OUT_POOL_SZ 128				/* preallocated output writes */
 
 typedef struct _thsys thsys;
 
+/* Requests acknowledged by the write callback */
+typedef enum {
+    thsys_req_set,					/* setpoint of the outputs */
+    thsys_req_queue,					/* output write queued for a ramp */
+    thsys_req_rate					/* sample rate */
+} thsys_req;
+
+struct _thsys_out;
+struct _thsys_ring;
+
+/*
+ * Timing error of the acquisition (ns), the deviation of the time
+ * between reads from the time the scans read were acquired in. Overruns
+ * count loops in single scan mode which missed their deadline.
+ */
+struct thsys_jitter
+{
+    unsigned long long var_cnt;
+    unsigned long long var_overrun;			/* deadlines missed */
+    long long var_min;
+    long long var_max;
+    double var_mean;
+    double _var_m2;					/* sum of squared deviations from the mean */
+};
+
 struct _thsys
 {
     int var_flg;
@@ -30,34 +58,79 @@ struct _thsys
     int var_run_flg;					/* flag to indicate system is running */
     unsigned int var_g_panic_flg;			/* Flag to indicate major errors occured */
     
-    /* Analog tasks */
-    TaskHandle var_a_outask;				/* analog output task */
-    TaskHandle var_a_intask;				/* analog input task */
-
-    /* Digital tasks */
-    TaskHandle var_d_outask;				/* analog output task */    
-    TaskHandle var_d_intask;				/* analog input task */
+    /*
+     * Device the channels are read from and written to. Defaults to
+     * the NI driver if included, otherwise the simulated device.
+     */
+    thdaq* var_daq;
 
     float64 var_sample_rate;				/* sample rate */
+    float64 _var_clock_rate;				/* rate the sample clock was configured with */
     float64 var_inbuff[THSYS_NUM_AI_CHANNELS];
     float64 var_outbuff[THSYS_NUM_AO_CHANNELS];
 
     /*
-     * A message queue is used to buffer the output writes.
-     * All output values from clients are pushed in to the
-     * queue. The internal scan loop shall pop from the
-     * queue as requed.
+     * Block acquisition. If the block size is more than one, blocks of
+     * scans are read from the sample clock and passed to the update
+     * callback together, reads wait for the device and pace the loop.
      */
-    gqueue _var_out_queue;
-    
+    unsigned int var_block_sz;				/* scans per block, 0 or 1 reads single scans */
+    float64* _var_block;				/* scans of the block, grouped by scan */
+
+    /*
+     * Scans passed to the update callback are stamped with a sequence
+     * number starting at one and the time the scan was read (ns,
+     * monotonic clock). In block mode they are of the first scan of the
+     * block, the following scans are a scan period apart.
+     */
+    unsigned long long var_scan_seq;
+    unsigned long long var_scan_tstamp;
+    unsigned long long var_scan_period;			/* time between scans of a block (ns) */
+
+    /*
+     * Real time settings of the acquisition thread, applied on start.
+     * Policy is SCHED_OTHER, SCHED_FIFO or SCHED_RR, cpu of -1 does not
+     * pin the thread. If locked, all memory of the process is locked.
+     */
+    int var_rt_policy;
+    int var_rt_prio;
+    int var_rt_cpu;
+    unsigned int var_rt_mem_lock;
+
+    struct thsys_jitter var_jitter;
+    unsigned long long _var_jitter_last;		/* time the last scans were read (ns) */
+
+    /*
+     * Output writes are taken from a pool of preallocated entries and
+     * passed to the scan loop without locking. The mailbox holds the
+     * newest setpoint, a write replaces the setpoint if it was not
+     * applied yet, so each loop applies the latest value. Writes queued
+     * for ramps are applied one per loop in order, unless a setpoint is
+     * written to the mailbox which replaces them. Sample rate requests
+     * have their own mailbox, the clock is reconfigured before a read.
+     */
+    struct _thsys_out* _var_out_pool;			/* entries of output writes */
+    struct _thsys_ring* _var_out_free;			/* entries not in use */
+    struct _thsys_ring* _var_out_fifo;			/* queued writes */
+    struct _thsys_out* _var_out_mbox;			/* newest setpoint, NULL if applied */
+    struct _thsys_out* _var_rate_mbox;			/* newest sample rate, NULL if applied */
+
     pthread_t var_thread;				/* thread id */
-    pthread_mutex_t _var_mutex;
     sem_t var_sem;
     void* var_ext_obj;					/* external object */
 
     /* function pointers for  */
     int (*var_callback_intrupt)(thsys*, void*);		/* interupt callback */
     int (*var_callback_update)(thsys*, void*, const float64*, const int);
+
+    /*
+     * Called after a request with an id was applied, with the kind of
+     * request, request id, tag, status and time stamp (ns, monotonic
+     * clock). Requests replaced by a newer one before they were applied
+     * have status THORNIFIX_CMD_SUPERSEDED and may be acknowledged
+     * on the thread of the newer request.
+     */
+    int (*var_callback_write)(thsys*, void*, thsys_req, unsigned int, int, int, unsigned long long);
 };
 
 #ifdef __cplusplus
@@ -73,16 +146,69 @@ extern "C" {
     int thsys_stop(thsys* obj);
     int thsys_e_stop(thsys* obj);
 
+    /*
+     * Replace the device while the system is stopped, the system
+     * takes ownership of the device and deletes it.
+     */
+    int thsys_set_daq(thsys* obj, thdaq* daq);
+
     /* set write buffer value */
     /* the buffer shall be THSYS_NUM_AO_CHANNELS */
     int thsys_set_write_buff(thsys* obj, float64* buff, size_t sz);
 
+    /*
+     * Set write buffer with a request id and tag of the requester,
+     * write callback is called when the values were written. The
+     * values replace the setpoint if it was not written yet.
+     */
+    int thsys_set_write_cmd(thsys* obj, float64* buff, size_t sz, unsigned int id, int tag);
+
+    /*
+     * Queue write buffer of a ramp, queued values are written one per
+     * scan in order. Returns -1 if THSYS_OUT_FIFO_LEN writes are queued.
+     */
+    int thsys_queue_write_cmd(thsys* obj, float64* buff, size_t sz, unsigned int id, int tag);
+
+    /*
+     * Change the sample rate with a request id and tag of the requester,
+     * write callback is called once the clock was reconfigured. While
+     * stopped the rate is applied on start and acknowledged at once.
+     */
+    int thsys_set_rate_cmd(thsys* obj, float64 rate, unsigned int id, int tag);
+
     /* set sampling rate */
 #define thsys_set_sample_rate(obj, val)		\
     (obj)->var_sample_rate = (val>0.0? val : THSYS_DEFAULT_SAMPLE_RATE)
 #define thsys_set_external_obj(obj, val)	\
     (obj)->var_ext_obj = (val)
 
+    /* set number of scans read in a block, takes effect on start */
+#define thsys_set_block_size(obj, val)		\
+    (obj)->var_block_sz = (val)
+
+    /* set real time scheduling, cpu and memory locking, take effect on start */
+#define thsys_set_rt_sched(obj, policy, prio)	\
+    do {					\
+	(obj)->var_rt_policy = (policy);	\
+	(obj)->var_rt_prio = (prio);		\
+    } while(0)
+#define thsys_set_rt_cpu(obj, val)		\
+    (obj)->var_rt_cpu = (val)
+#define thsys_set_rt_mem_lock(obj, val)		\
+    (obj)->var_rt_mem_lock = (val)
+
+    /* Get jitter statistics of the acquisition loop */
+#define thsys_get_jitter(obj_ptr)		\
+    (&(obj_ptr)->var_jitter)
+
+    /* Get sequence number and time stamp of the last scan */
+#define thsys_get_scan_seq(obj_ptr)		\
+    (obj_ptr)->var_scan_seq
+#define thsys_get_scan_tstamp(obj_ptr)		\
+    (obj_ptr)->var_scan_tstamp
+#define thsys_get_scan_period(obj_ptr)		\
+    (obj_ptr)->var_scan_period
+
     /* Get output buffer value */
 #define thsys_get_out_buff_val(obj_ptr, ix)	\
     (ix >= THSYS_NUM_AO_CHANNELS?		\
@@ -1,8 +1,8 @@
 #!/bin/bash
 #
-g++ -g -Wall -O0 -o asgard thasgard.cc thasg_websock.cc thcon.c \
+g++ -g -Wall -O0 -o asgard thasgard.cc thasg_websock.cc thcon.c thornifix.c \
 	-I/home/pyrus/Prog/C++/libwebsockets/lib/ -I/usr/include/libxml2/ -I/home/pyrus/Prog/C++/thor/inc/ \
-	-lstdc++ -lpthread -lxml2 -lz -lm -lssl -lcrypto\
+	-lstdc++ -lpthread -lrt -lxml2 -lz -lm -lssl -lcrypto\
 	-L/usr/lib/x86_64-linux-gnu/imlib2/loaders/ -lconfig -lcurl \
 	/home/pyrus/Prog/C++/libwebsockets/lib/lib/libwebsockets.a -lalist
 #
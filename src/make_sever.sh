@@ -1,17 +1,17 @@
 #!/bin/bash
 #
 # Test program
-gcc -g -Wall -O0 -o ../bin/test -DTHOR_INC_NI main.c thsys.c \
+gcc -g -Wall -O0 -o ../bin/test -DTHOR_INC_NI main.c thsys.c thdaq_ni.c thdaq_sim.c thdaq_replay.c thornifix.c \
 	-I/usr/local/natinst/nidaqmxbase/include/ \
-	/usr/local/natinst/nidaqmxbase/lib/libnidaqmxbase.so.3.7.0 -lm -lalist -lpthread
+	/usr/local/natinst/nidaqmxbase/lib/libnidaqmxbase.so.3.7.0 -lm -lconfig -lalist -lpthread -lrt
 
-gcc -g -Wall -O0 -o thclient -DTHOR_INC_NI thtest.c thcon.c \
+gcc -g -Wall -O0 -o thclient -DTHOR_INC_NI thtest.c thcon.c thornifix.c \
 	-I/usr/local/natinst/nidaqmxbase/include/ -I/usr/include/libxml2/ \
-	/usr/local/natinst/nidaqmxbase/lib/libnidaqmxbase.so.3.7.0 -lalist -lxml2 -lcurl -lconfig -lm -lalist -lpthread
+	/usr/local/natinst/nidaqmxbase/lib/libnidaqmxbase.so.3.7.0 -lalist -lxml2 -lcurl -lconfig -lm -lalist -lpthread -lrt
 
 # Server component
-gcc -g -Wall -O0 -o thsvr -DTHOR_INC_NI thsvre.c thsvr.c thsys.c thcon.c thornifix.c \
+gcc -g -Wall -O0 -o thsvr -DTHOR_INC_NI thsvre.c thsvr.c thsys.c thdaq_ni.c thdaq_sim.c thdaq_replay.c thcon.c thornifix.c \
 	-I/usr/local/natinst/nidaqmxbase/include/ -I/usr/include/libxml2/ \
-	/usr/local/natinst/nidaqmxbase/lib/libnidaqmxbase.so.3.7.0 -lm -lalist -lxml2 -lcurl -lconfig -lpthread
+	/usr/local/natinst/nidaqmxbase/lib/libnidaqmxbase.so.3.7.0 -lm -lalist -lxml2 -lcurl -lconfig -lpthread -lrt
 
 exit 0
@@ -21,6 +21,14 @@
 #define THAPP_QUEUE_LIMIT_KEY "app_queue_limit"
 #define THAPP_LOG_URL_KEY "main_log_url"
 #define THAPP_LOG_URL_PORT_KEY "sec_con_port"
+#define THAPP_PROTO_KEY "main_con_proto"
+#define THAPP_RECV_BUFF_KEY "con_recv_buff_sz"
+#define THAPP_MCAST_GROUP_KEY "multic_con_group"
+#define THAPP_MCAST_PORT_KEY "multic_con_port"
+#define THAPP_UNIX_PATH_KEY "con_unix_path"
+#define THAPP_SHM_NAME_KEY "con_shm_name"
+#define THAPP_PROTO_BIN "binary"
+#define THAPP_PROTO_DELTA "delta"
 
 #define THAPP_DEFAULT_PORT "11000"
 #define THAPP_DEFAULT_SLEEP 100000
@@ -96,6 +104,9 @@ static void* _thapp_start_secon(void* obj);
 /*---------------------------------------------------------------------------*/
 /* Callback methods for handling connection related messages */
 static int _thapp_con_recv_callback(void* obj, void* msg, size_t sz);
+static void _thapp_cmd_ack(thapp* obj, const char* msg, size_t sz);
+static void _thapp_sample_stats(thapp* obj, int gap_flg);
+static int _thapp_con_state_callback(void* obj, void* con, thcon_stat stat);
 static int _thapp_con_recv_url_callback(void* obj, void* msg, size_t sz);
 
 static void _thapp_queue_del_helper(void* data);
@@ -127,6 +138,13 @@ int thapp_init(thapp* obj)
      */
     thcon_set_ext_obj(&obj->_var_con, ((void*) obj));
     thcon_set_recv_callback(&obj->_var_con, _thapp_con_recv_callback);
+    thcon_set_state_callback(&obj->_var_con, _thapp_con_state_callback);
+
+    /* request length prefixed messages, recv callback is called once per message */
+    thcon_set_framing(&obj->_var_con, 1);
+
+    /* reconnect and resume if the server is restarted during a test */
+    thcon_set_reconnect(&obj->_var_con, 1);
 
     /*
      * Initialise the url logging connection. All test data
@@ -140,6 +158,7 @@ int thapp_init(thapp* obj)
 	    /* Set external object and callback pointer */
 	    thcon_set_ext_obj(&obj->_var_con_sec, ((void*) obj));
 	    thcon_set_recv_callback(&obj->_var_con_sec, _thapp_con_recv_url_callback);
+	    thcon_set_framing(&obj->_var_con_sec, 1);
 	    obj->var_sec_con_init_flg = 1;
 
 	    /* Port number and server address are set in the config read method */
@@ -155,6 +174,18 @@ int thapp_init(thapp* obj)
     obj->var_queue_limit = THAPP_DEFAULT_QUEUE_LIMIT;
     obj->var_child = NULL;
     obj->var_def_log = NULL;
+    obj->var_sub_mask = 0;
+
+    obj->_var_cmd_id = 0;
+    memset(obj->_var_cmd_ids, 0, sizeof(unsigned int) * THAPP_CMD_PENDING);
+    memset(&obj->var_cmd_stats, 0, sizeof(struct thapp_cmd_stats));
+
+    obj->_var_last_seq = 0;
+    obj->_var_seq_reset = 0;
+    obj->var_seq_gaps = 0;
+    obj->var_queue_drops = 0;
+    obj->var_sample_age = 0.0;
+    thornifix_delta_init(&obj->_var_delta, 0);
 
     obj->_var_con_sec_flg = 0;
     obj->var_sec_con_start_flg = 0;
@@ -290,6 +321,56 @@ int thapp_stop(thapp* obj)
     return 0;
 }
 
+/*
+ * Send command to the server. The send time is recorded against the
+ * request id, several commands may be outstanding.
+ */
+int thapp_send_cmd(thapp* obj, thor_cmd_type type, double arg0, double arg1)
+{
+    char _buff[THORNIFIX_CMD_SZ];
+    struct thor_cmd _cmd;
+    struct timespec _tm;
+    unsigned int _ix;
+
+    if(obj == NULL)
+	return -1;
+
+    memset(&_cmd, 0, sizeof(struct thor_cmd));
+    _cmd._type = (int) type;
+    _cmd._args[0] = arg0;
+    _cmd._args[1] = arg1;
+
+    pthread_mutex_lock(&obj->_var_mutex);
+
+    /* request ids start at one, zero is not acknowledged */
+    if(++obj->_var_cmd_id == 0)
+	obj->_var_cmd_id = 1;
+    _cmd._id = obj->_var_cmd_id;
+    _ix = _cmd._id % THAPP_CMD_PENDING;
+
+    /* slot still holds a command which was not acknowledged */
+    if(obj->_var_cmd_ids[_ix] != 0)
+	obj->var_cmd_stats.var_lost++;
+
+    clock_gettime(CLOCK_MONOTONIC, &_tm);
+    obj->_var_cmd_ids[_ix] = _cmd._id;
+    obj->_var_cmd_sent[_ix] = (unsigned long long) _tm.tv_sec * 1000000000ULL + _tm.tv_nsec;
+    obj->var_cmd_stats.var_sent++;
+    pthread_mutex_unlock(&obj->_var_mutex);
+
+    thornifix_encode_cmd(&_cmd, _buff, THORNIFIX_CMD_SZ);
+    if(thcon_send_info(&obj->_var_con, (void*) _buff, THORNIFIX_CMD_SZ))
+	{
+	    pthread_mutex_lock(&obj->_var_mutex);
+	    if(obj->_var_cmd_ids[_ix] == _cmd._id)
+		obj->_var_cmd_ids[_ix] = 0;
+	    pthread_mutex_unlock(&obj->_var_mutex);
+	    return -1;
+	}
+
+    return (int) _cmd._id;
+}
+
 /*===========================================================================*/
 /**************************** Private Methods ********************************/
 
@@ -306,6 +387,10 @@ static void* _thapp_start_handler(void* obj)
     int _sec_cnt = 0, _msg_cnt_max = 0;
     unsigned int _p_flg = 0;						/* pause flag */
     size_t _sz;
+    unsigned long long _shm_seq = 0, _seq = 0;
+    char _shm_buff[THORNIFIX_BIN_MSG_SZ];
+    char _log_buff[THAPP_DISP_BUFF_SZ];
+    int _log_len;
 
     
     struct thor_msg* _msg = NULL;
@@ -377,6 +462,13 @@ static void* _thapp_start_handler(void* obj)
 
 		    /* Start logging server */
 		    THAPP_START_LOG_SVR(_obj);
+
+		    /*
+		     * Only the channels used by the child are sent, at the display
+		     * rate. Subset records are only served with the binary protocol.
+		     */
+		    if(_obj->var_sub_mask && _obj->_var_con.var_proto == thcon_proto_bin)
+			thcon_subscribe(&_obj->_var_con, _obj->var_sub_mask, 1000000.0 / (double) _obj->var_sleep_time);
 		    
 		    /*
 		     * Start connection object in a loop.
@@ -507,9 +599,26 @@ static void* _thapp_start_handler(void* obj)
 
 	    /* Free message element */
 	    if(_msg != NULL)
-		free(_msg);
+		{
+		    /* subscriptions are decimated to the display rate, gaps are expected */
+		    _thapp_sample_stats(_obj, _obj->_var_con.var_sub_ival == 0);
+		    free(_msg);
+		}
 	    _msg = NULL;
 
+	    /*
+	     * If the server shares samples through shared memory, the latest
+	     * sample is read from it. Server only sends replies on the connection.
+	     */
+	    if(_obj->_var_con.var_shm_name[0] != '\0' &&
+	       thcon_shm_latest(&_obj->_var_con, _shm_buff, THORNIFIX_BIN_MSG_SZ, &_seq) > 0 &&
+	       _seq != _shm_seq)
+		{
+		    _shm_seq = _seq;
+		    thornifix_decode_msg_bin(_shm_buff, THORNIFIX_BIN_MSG_SZ, &_obj->_msg_buff);
+		    _thapp_sample_stats(_obj, 0);
+		}
+
 	    /*
 	     * Passed Command handling to the child class.
 	     * Check if the return value is true. By using the return
@@ -560,8 +669,16 @@ static void* _thapp_start_handler(void* obj)
 	    /* Print the result  values */
 	    mvprintw(_t_msg_pos+THAPP_VAL_LINE, 0,"%s", _obj->var_disp_vals);
 
-	    /* Send message to the loging server */
-	    THAPP_SEND_MSG(_obj, _obj->var_disp_vals, THAPP_DISP_BUFF_SZ);
+	    /*
+	     * Send message to the loging server, led by the sequence number
+	     * and acquisition time of the sample displayed.
+	     */
+	    _log_len = snprintf(_log_buff, THAPP_DISP_BUFF_SZ, "%llu\t%llu\t%s",
+				_obj->_msg_buff._seq, _obj->_msg_buff._tstamp, _obj->var_disp_vals);
+	    if(_log_len >= THAPP_DISP_BUFF_SZ)
+		_log_len = THAPP_DISP_BUFF_SZ - 1;
+	    if(_log_len > 0)
+		THAPP_SEND_MSG(_obj, _log_buff, (size_t) _log_len);
 
 	    refresh();
 
@@ -638,6 +755,17 @@ static int _thapp_init_helper(thapp* obj)
 		}
 	}
 
+    /* Get wire protocol, default is the text format */
+    _setting = config_lookup(&obj->var_config, THAPP_PROTO_KEY);
+    if(_setting != NULL)
+	{
+	    _t_buff = config_setting_get_string(_setting);
+	    if(_t_buff && strcmp(_t_buff, THAPP_PROTO_BIN) == 0)
+		thcon_set_proto(&obj->_var_con, thcon_proto_bin);
+	    else if(_t_buff && strcmp(_t_buff, THAPP_PROTO_DELTA) == 0)
+		thcon_set_proto(&obj->_var_con, thcon_proto_delta);
+	}
+
     /* Get server name */
     _setting = config_lookup(&obj->var_config, THAPP_SERVER_NAME_KEY);
     if(_setting != NULL)
@@ -656,6 +784,37 @@ static int _thapp_init_helper(thapp* obj)
 		thcon_set_geo_ip(&obj->_var_con, _t_buff);
 	}
 
+    /* Get size of the connection receive buffer */
+    _setting = config_lookup(&obj->var_config, THAPP_RECV_BUFF_KEY);
+    if(_setting != NULL)
+      thcon_set_recv_buff_sz(&obj->_var_con, (unsigned int) config_setting_get_int(_setting));
+
+    /* Get multicast group samples are recieved from, commands stay on the connection */
+    _setting = config_lookup(&obj->var_config, THAPP_MCAST_GROUP_KEY);
+    _t_buff = _setting? config_setting_get_string(_setting) : NULL;
+    _setting = config_lookup(&obj->var_config, THAPP_MCAST_PORT_KEY);
+    if(_t_buff && _t_buff[0] != '\0' && _setting && config_setting_get_string(_setting))
+	{
+	    thcon_set_mcast(&obj->_var_con, _t_buff, config_setting_get_string(_setting));
+	}
+
+    /* Get unix domain socket and shared memory of a server on the same host */
+    _setting = config_lookup(&obj->var_config, THAPP_UNIX_PATH_KEY);
+    if(_setting != NULL)
+	{
+	    _t_buff = config_setting_get_string(_setting);
+	    if(_t_buff)
+		thcon_set_unix_path(&obj->_var_con, _t_buff);
+	}
+
+    _setting = config_lookup(&obj->var_config, THAPP_SHM_NAME_KEY);
+    if(_setting != NULL)
+	{
+	    _t_buff = config_setting_get_string(_setting);
+	    if(_t_buff)
+		thcon_set_shm_name(&obj->_var_con, _t_buff);
+	}
+
     /* Get queue limit */
     _setting = config_lookup(&obj->var_config, THAPP_QUEUE_LIMIT_KEY);
     if(_setting != NULL)
@@ -704,6 +863,8 @@ static int _thapp_con_recv_callback(void* obj, void* msg, size_t sz)
 {
     struct thor_msg* _msg;
     thapp* _obj;
+    size_t _pos;
+    int _len, _rt;
 
     /* Check for arguments */
     if(obj == NULL || msg == NULL || sz <= 0)
@@ -712,14 +873,67 @@ static int _thapp_con_recv_callback(void* obj, void* msg, size_t sz)
     /* Cast object to the correct pointer */
     _obj = (thapp*) obj;
 
+    /* acknowledgements of commands are not queued */
+    if(thornifix_is_cmd(msg, sz))
+	{
+	    _thapp_cmd_ack(_obj, (const char*) msg, sz);
+	    return 0;
+	}
+
+    /*
+     * Binary records are full or subset records of the subscribed
+     * channels or records of the delta stream, all records in the
+     * buffer are decoded and added to the queue. Channels not subscribed
+     * are left zero, deltas are skipped until the next keyframe if a
+     * record was missed.
+     */
+    if(thornifix_is_bin_msg(msg, sz))
+	{
+	    for(_pos = 0; (_len = thornifix_bin_msg_len((char*) msg + _pos, sz - _pos)) > 0; _pos += (size_t) _len)
+		{
+		    _msg = (struct thor_msg*) malloc(sizeof(struct thor_msg));
+		    if(_msg == NULL)
+			break;
+		    thorinifix_init_msg(_msg);
+		    _rt = thornifix_decode_msg_delta(&_obj->_var_delta, (char*) msg + _pos, sz - _pos, _msg);
+		    if(_rt == THORNIFIX_ERR_REF)
+			{
+			    free(_msg);
+			    continue;
+			}
+		    if(_rt)
+			{
+			    free(_msg);
+			    break;
+			}
+
+		    pthread_mutex_lock(&_obj->_var_mutex);
+		    if(gqueue_count(&_obj->_var_msg_queue) < _obj->var_queue_limit)
+			gqueue_in(&_obj->_var_msg_queue, (void*) _msg);
+		    else
+			{
+			    free(_msg);
+			    _obj->var_queue_drops++;
+			}
+		    pthread_mutex_unlock(&_obj->_var_mutex);
+		}
+	    return 0;
+	}
+
     if(strlen((char*) msg) <= 1)
 	return 0;
 
     /* Create memory */
     _msg = (struct thor_msg*) malloc(sizeof(struct thor_msg));
 
-    /* decode message */
-    thornifix_decode_msg((char*) msg, sz, _msg);
+    /* decode message, malformed messages are discarded */
+    if(_msg == NULL)
+	return -1;
+    if(thornifix_decode_msg((char*) msg, sz, _msg))
+	{
+	    free(_msg);
+	    return -1;
+	}
 
     /*
      * Lock mutex and add to the queue if the queue
@@ -728,6 +942,11 @@ static int _thapp_con_recv_callback(void* obj, void* msg, size_t sz)
     pthread_mutex_lock(&_obj->_var_mutex);
     if(gqueue_count(&_obj->_var_msg_queue) < _obj->var_queue_limit)
       gqueue_in(&_obj->_var_msg_queue, (void*) _msg);
+    else
+	{
+	    free(_msg);
+	    _obj->var_queue_drops++;
+	}
     pthread_mutex_unlock(&_obj->_var_mutex);
 
     return 0;
@@ -802,3 +1021,102 @@ static int _thapp_con_recv_url_callback(void* obj, void* msg, size_t sz)
 {
     return 0;
 }
+
+/*
+ * Acknowledgement of a command. Latencies are measured from the send time
+ * of the request, server time stamp is on the same monotonic clock.
+ */
+static void _thapp_cmd_ack(thapp* obj, const char* msg, size_t sz)
+{
+    struct thor_cmd _cmd;
+    struct timespec _tm;
+    unsigned long long _now, _sent;
+    unsigned int _ix;
+    struct thapp_cmd_stats* _stats = &obj->var_cmd_stats;
+
+    if(thornifix_decode_cmd(msg, sz, &_cmd) || !(_cmd._type & THORNIFIX_CMD_ACK))
+	return;
+
+    clock_gettime(CLOCK_MONOTONIC, &_tm);
+    _now = (unsigned long long) _tm.tv_sec * 1000000000ULL + _tm.tv_nsec;
+    _ix = _cmd._id % THAPP_CMD_PENDING;
+
+    pthread_mutex_lock(&obj->_var_mutex);
+
+    /* acknowledgements of commands no longer tracked are ignored */
+    if(_cmd._id == 0 || obj->_var_cmd_ids[_ix] != _cmd._id)
+	{
+	    pthread_mutex_unlock(&obj->_var_mutex);
+	    return;
+	}
+
+    _sent = obj->_var_cmd_sent[_ix];
+    obj->_var_cmd_ids[_ix] = 0;
+
+    _stats->var_acked++;
+    if(_cmd._status == THORNIFIX_CMD_SUPERSEDED)
+	_stats->var_superseded++;
+    else if(_cmd._status != 0)
+	_stats->var_failed++;
+
+    _stats->var_rtt = (double) (_now - _sent) / 1000.0;
+    if(_stats->var_rtt > _stats->var_rtt_max)
+	_stats->var_rtt_max = _stats->var_rtt;
+
+    if(_cmd._status == 0 && _cmd._tstamp >= _sent)
+	{
+	    _stats->var_act_lat = (double) (_cmd._tstamp - _sent) / 1000.0;
+	    if(_stats->var_act_lat > _stats->var_act_lat_max)
+		_stats->var_act_lat_max = _stats->var_act_lat;
+	}
+    pthread_mutex_unlock(&obj->_var_mutex);
+
+    if(_cmd._status != 0 && _cmd._status != THORNIFIX_CMD_SUPERSEDED)
+	THOR_LOG_ERROR("server failed to apply command");
+    return;
+}
+
+/*
+ * Update sample statistics with the message in the buffer. Text messages
+ * and older samples have no sequence number and are not counted. Gaps
+ * are only counted if the flag is set, samples skipped by decimation
+ * are not missed. A sequence going backwards restarts the count.
+ */
+static void _thapp_sample_stats(thapp* obj, int gap_flg)
+{
+    struct timespec _tm;
+    unsigned long long _now;
+
+    if(obj->_msg_buff._seq == 0)
+	return;
+
+    if(__atomic_exchange_n(&obj->_var_seq_reset, 0, __ATOMIC_ACQ_REL) ||
+       obj->_msg_buff._seq < obj->_var_last_seq)
+	obj->_var_last_seq = 0;
+    if(obj->_msg_buff._seq == obj->_var_last_seq)
+	return;
+
+    if(gap_flg && obj->_var_last_seq > 0)
+	obj->var_seq_gaps += (unsigned long) (obj->_msg_buff._seq - obj->_var_last_seq - 1);
+    obj->_var_last_seq = obj->_msg_buff._seq;
+
+    clock_gettime(CLOCK_MONOTONIC, &_tm);
+    _now = (unsigned long long) _tm.tv_sec * 1000000000ULL + _tm.tv_nsec;
+    if(obj->_msg_buff._tstamp > 0 && _now >= obj->_msg_buff._tstamp)
+	obj->var_sample_age = (double) (_now - obj->_msg_buff._tstamp) / 1000.0;
+    return;
+}
+
+/* Connection status changed, samples after reconnecting restart the sequence */
+static int _thapp_con_state_callback(void* obj, void* con, thcon_stat stat)
+{
+    thapp* _obj;
+
+    if(obj == NULL)
+	return -1;
+
+    _obj = (thapp*) obj;
+    if(stat == thcon_connected)
+	__atomic_store_n(&_obj->_var_seq_reset, 1, __ATOMIC_RELEASE);
+    return 0;
+}
@@ -141,6 +141,10 @@ thapp* thapp_lkg_new(void)
     /* Set child pointer of the parent object */
     _obj->_var_parent.var_child = (void*) _obj;
 
+    /* Subscribe to the relay, temperature, static and differential pressure channels */
+    _obj->_var_parent.var_sub_mask = THORNIFIX_CH_AO(0) | THORNIFIX_CH_AI(0) | THORNIFIX_CH_AI(3) |
+	THORNIFIX_CH_AI(8) | THORNIFIX_CH_AI(9) | THORNIFIX_CH_AI(10) | THORNIFIX_CH_AI(11);
+
     /* Initialise function pointer array */
     THAPP_INIT_FPTR(_obj);
 
@@ -819,8 +823,6 @@ static int _thapp_lkg_cmd(thapp* obj, void* self, char cmd)
  */
 static int _thapp_fan_ctrl(thapp_lkg* obj, double incr, double* incr_val, int* per, int flg)
 {
-    struct thor_msg _msg;						/* message */
-    char _msg_buff[THORNIFIX_MSG_BUFF_SZ];
     double _val;
 
     /* Increment the value temporarily. */
@@ -852,16 +854,9 @@ static int _thapp_fan_ctrl(thapp_lkg* obj, double incr, double* incr_val, int* p
 	}
 
     _val = obj->var_fan_pct;
-    /* memset buffer */
-    thorinifix_init_msg(&_msg);
-    thorinifix_init_msg(&_msg_buff);
-
-    _msg._ao0_val = obj->_var_parent._msg_buff._ao0_val;
-    _msg._ao1_val = 9.95 * _val / 100;
 
-    /* Encode the message and send to the server */
-    thornifix_encode_msg(&_msg, _msg_buff, THORNIFIX_MSG_BUFF_SZ);
-    thcon_send_info(thapp_get_con_obj_ptr(&obj->_var_parent), (void*) &_msg_buff, THORNIFIX_MSG_BUFF_SZ);
+    /* Send the outputs to the server, acknowledged when applied */
+    thapp_set_ao(&obj->_var_parent, obj->_var_parent._msg_buff._ao0_val, 9.95 * _val / 100);
     return 0;
 }
 
@@ -1,5 +1,6 @@
 /* Implementation of the websocket server wrap */
 #include <cstring>
+#include <vector>
 #include "thasg_websock.h"
 
 #define THASG_QUEUE_LIMIT 20
@@ -117,11 +118,8 @@ int _thasg_websock::service_server(const char* msg, size_t sz)
        _num_cons > 0 &&
        _msg_queue.size() < THASG_QUEUE_LIMIT)
 	{
-	    memset(reinterpret_cast<void*>(&_msg_wrap), 0, sizeof(struct _thasg_msg_wrap));
 	    _msg_wrap._fd = 0;
-	    strncpy(_msg_wrap._msg, msg, (sz > (THORNIFIX_MSG_BUFF_SZ-1)? THORNIFIX_MSG_BUFF_SZ-1 : sz));
-	    _msg_wrap._msg[THORNIFIX_MSG_BUFF_SZ-1] = '\0';
-	    _msg_wrap._msg_sz = strlen(_msg_wrap._msg);
+	    _msg_wrap._msg.assign(msg, sz);
 
 	    pthread_mutex_lock(&var_mutex);
 	    _msg_queue.push(_msg_wrap);
@@ -184,10 +182,10 @@ static int _thasg_websock_callback(struct libwebsocket_context* context,
 				   void* in,
 				   size_t len)
 {
-    char* _f_pos;
+    size_t _f_pos;
     struct _thasg_msg_wrap* _msg_ptr;
     void* _t_ptr;
-    unsigned char _t_buff[LWS_SEND_BUFFER_PRE_PADDING+THORNIFIX_MSG_BUFF_SZ+LWS_SEND_BUFFER_POST_PADDING];
+    std::vector<unsigned char> _t_buff;
     _thasg_websock* _websock_obj;
 
     
@@ -200,7 +198,6 @@ static int _thasg_websock_callback(struct libwebsocket_context* context,
 	return 0;
 
     _websock_obj = reinterpret_cast<_thasg_websock*>(_t_ptr);
-    memset(reinterpret_cast<void*>(_t_buff), 0, sizeof(LWS_SEND_BUFFER_PRE_PADDING+THORNIFIX_MSG_BUFF_SZ+LWS_SEND_BUFFER_POST_PADDING));
     
     switch(reason)
 	{
@@ -219,17 +216,18 @@ static int _thasg_websock_callback(struct libwebsocket_context* context,
 		break;
 
 	    /* Replace new line character with carraige return */
-	    _f_pos = strchr(_msg_ptr->_msg, THASG_NEWLINE_CODE);
-	    if(_f_pos)
-		*_f_pos = '\r';
+	    _f_pos = _msg_ptr->_msg.find(THASG_NEWLINE_CODE);
+	    if(_f_pos != std::string::npos)
+		_msg_ptr->_msg[_f_pos] = '\r';
 
-	    /* Write to the websocket */
-	    memcpy(_t_buff+LWS_SEND_BUFFER_PRE_PADDING, reinterpret_cast<void*>(_msg_ptr->_msg), _msg_ptr->_msg_sz);
+	    /* Buffer is sized to the record with the padding required */
+	    _t_buff.resize(LWS_SEND_BUFFER_PRE_PADDING+_msg_ptr->_msg.size()+LWS_SEND_BUFFER_POST_PADDING);
+	    memcpy(&_t_buff[LWS_SEND_BUFFER_PRE_PADDING], _msg_ptr->_msg.data(), _msg_ptr->_msg.size());
 
 	    /* Write to the websocket */
 	    libwebsocket_write(wsi,
-			       _t_buff+LWS_SEND_BUFFER_PRE_PADDING,
-			       _msg_ptr->_msg_sz,
+			       &_t_buff[LWS_SEND_BUFFER_PRE_PADDING],
+			       _msg_ptr->_msg.size(),
 			       LWS_WRITE_TEXT);
 
 	    /* Remove message from queue */
@@ -273,26 +273,32 @@ _thasg::~_thasg()
 
 }
 
-/* Add message to the queue */
+/*
+ * Add message to the queue. Records are of the length recieved, a null
+ * character ends the record for clients sending padded buffers.
+ */
 int _thasg::add_msg(void* msg_ptr, size_t sz)
 {
+    const char* _end;
     struct _thasg_msg_wrap _msg_obj;
 
     /* Check for arguments */
     if(msg_ptr == NULL || sz <= 0)
 		return 0;
 
-    /* Initialise message object */
-    memset((void*) &_msg_obj, 0, sizeof(struct _thasg_msg_wrap));
-
     /* Get active socket descriptor */
     _msg_obj._fd = THCON_GET_ACTIVE_SOCK(&var_con);
 
-    /* Copy message to the internal buffer */
-    memcpy((void*) _msg_obj._msg, msg_ptr, THORNIFIX_MSG_BUFF_SZ);
-    _msg_obj._msg[THORNIFIX_MSG_BUFF_SZ-1] = '\0';
+    /* Copy record and append return character */
+    _end = (const char*) memchr(msg_ptr, '\0', sz);
+    if(_end != NULL)
+		sz = (size_t) (_end - (const char*) msg_ptr);
+    if(sz == 0)
+		return 0;
 
-    _msg_obj._msg_sz = THORNIFIX_MSG_BUFF_SZ;
+    _msg_obj._msg.reserve(sz + 1);
+    _msg_obj._msg.assign((const char*) msg_ptr, sz);
+    _msg_obj._msg.push_back('\n');
 
     /* Insert to queue */
     pthread_mutex_lock(&var_mutex);
@@ -355,13 +361,11 @@ int _thasg::write_file(void)
 
 
 	    /* Write to file */
-	    /* Append return character */
-	    strcat(_t_msg->_msg, "\n");
-	    write(_file_des, _t_msg->_msg, strlen(_t_msg->_msg));
+	    write(_file_des, _t_msg->_msg.data(), _t_msg->_msg.size());
 
 	    /* If the web socket server was created, call to service sockets */
 	    if(var_websock)
-			var_websock->service_server(_t_msg->_msg, _t_msg->_msg_sz);
+			var_websock->service_server(_t_msg->_msg.data(), _t_msg->_msg.size());
 
 	exit_loop:
 	    pthread_mutex_lock(&var_mutex);
@@ -8,17 +8,45 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
 #include <libxml/HTMLparser.h>
 
-#define THCON_CLIENT_RECV_SLEEP_TIME 100000			/* wait time for receiving */
 #define THCON_MAX_CLIENTS 10 						/* maximum connections */
 #define THCON_MAX_EVENTS 64							/* maximum events */
+#define THCON_DEF_FD_MAP_SZ 64						/* initial size of the descriptor map */
+
+/* Connection of the live list at position i */
+#define _thcon_live_peer(obj, i)							\
+    ((obj)->_var_cons[(obj)->_var_live[(i)]])
 #define HTML_STACK_SZ 16
 #define THCON_DEF_TIMEOUT 5							/* Default time out for geolocation */
+#define THCON_SEND_TIMEOUT 1000						/* Time to wait on a full socket buffer (ms) */
+#define THCON_RECONN_MIN_TIME 100					/* initial reconnect delay (ms) */
+#define THCON_RECONN_MAX_TIME 10000					/* maximum reconnect delay (ms) */
+#define THCON_MSG_RING_SZ (4 * THCON_MAX_BURST)			/* outbound messages waiting for the writer */
+#define THCON_MSG_POOL_SZ THCON_MAX_BURST				/* messages kept for reuse */
+#define THCON_SUB_CACHE 4							/* subset records encoded in one fan out */
+#define THCON_MAX_IOV 64							/* maximum buffers gathered in a write */
+#define THCON_MCAST_TTL 1							/* multicast datagrams stay on the local network */
+#define THCON_MCAST_BUFF_SZ 2048					/* receive buffer of multicast datagrams */
+#define THCON_MCAST_REORDER_WIN 1024				/* older sequence numbers indicate a server restart */
+#define THCON_SHM_MAGIC 0x4d534854					/* 'THSM' */
+#define THCON_SHM_VERSION 1
+#define THCON_SHM_READ_TRIES 64						/* attempts to read a slot being written */
 
 #define THCON_DEFAULT_WOL_PORT 9
 
@@ -96,6 +124,82 @@ struct _curl_mem
     size_t size;
 };
 
+/*
+ * Outbound message queued for the writer thread.
+ * Raw messages only have the memory buffer set. Messages
+ * multicast from the message struct additionally carry the
+ * binary encoding for connections which negotiated it.
+ * Messages are encoded once and not modified afterwards, each
+ * connection writing the message holds a reference. Frame headers
+ * are stored with the message so that they can be written from
+ * the same io vector.
+ */
+struct _thcon_msg
+{
+    int _ref;									/* reference count */
+    unsigned long long _seq;					/* sequence number, 0 if not kept in the history */
+    int _fd;									/* socket of the connection its sent to, -1 for all */
+    struct _thcon_ring* _pool;					/* pool the message is returned to, NULL if none */
+    uint32_t hdr;								/* frame header of the text encoding */
+    uint32_t bin_hdr;							/* frame header of the binary encoding */
+    uint32_t delta_hdr;							/* frame header of the delta encoding */
+    char* memory;
+    size_t size;
+    char* bin_memory;
+    size_t bin_size;
+    char* delta_memory;							/* delta encoding, NULL if not served */
+    size_t delta_size;
+};
+
+/*
+ * Shared memory transport. Header is followed by a ring of slots,
+ * message with sequence number n is written to slot n modulo the
+ * number of slots. Each slot is guarded by a sequence lock, which is
+ * odd while the server writes the slot. Readers copy the slot and
+ * retry if the lock was odd or changed during the copy. Head is the
+ * sequence number of the latest message, its set after the slot.
+ */
+struct _thcon_shm_slot
+{
+    uint32_t _lock;								/* sequence lock */
+    uint32_t _size;								/* size of the message */
+    uint64_t _seq;								/* sequence number of the message */
+    char _data[THORNIFIX_BIN_MSG_SZ];
+};
+
+struct _thcon_shm
+{
+    uint32_t _magic;							/* set once the header is initialised */
+    uint32_t _version;
+    uint32_t _slot_cnt;							/* number of slots */
+    uint32_t _slot_sz;							/* size of a slot */
+    uint64_t _head;								/* sequence number of the latest message */
+    char _pad[40];
+    struct _thcon_shm_slot _slots[];
+};
+
+/*
+ * Bounded ring of message pointers. Producers and the consumer do not
+ * lock, slots are claimed with compare and swap on the positions and
+ * the sequence number of each slot publishes the message. Used for
+ * the outbound queue of the writer thread and the pool of messages.
+ */
+struct _thcon_ring_slot
+{
+    unsigned long _seq;
+    struct _thcon_msg* _msg;
+};
+
+struct _thcon_ring
+{
+    unsigned long _enq;							/* enqueue position */
+    char _pad0[64 - sizeof(unsigned long)];
+    unsigned long _deq;							/* dequeue position */
+    char _pad1[64 - sizeof(unsigned long)];
+    unsigned long _mask;
+    struct _thcon_ring_slot _slots[];
+};
+
 /* helper methods for sending magic packet to wake on lan device */
 static int _thcon_conv_mac_addr_to_base16(thcon* obj);
 static int _thcon_create_udp_socket(thcon* obj);
@@ -112,51 +216,139 @@ static void* _thcon_thread_function_write_server(void* obj);
 
 static void _thcon_thread_cleanup_server(void* obj);
 
+/* client connection handling and reconnecting */
+static int _thcon_client_session(thcon* obj);
+static int _thcon_client_wait(thcon* obj, unsigned int ms);
+static void _thcon_set_conn_stat(thcon* obj, thcon_stat stat);
+
 
 /* create socket and for server mode bind to it */
 static int _thcon_create_connection(thcon* obj, int _con_mode);
+static int _thcon_create_listener(thcon* obj);
+static int _thcon_unix_addr(thcon* obj, struct sockaddr_un* addr);
+static int _thcon_create_unix_listener(thcon* obj);
+static int _thcon_connect_unix(thcon* obj);
 static int _thcon_make_socket_nonblocking(int sock_id);
 
 /* send message (msg) of size (sz) to the socket pointed by fd */
+static int _thcon_send_iov(int fd, struct iovec* iov, int cnt);
 static int _thcon_send_info(int fd, void* msg, size_t sz);
+static int _thcon_send_frame(int fd, void* msg, size_t sz);
+static int _thcon_send_peer(struct thcon_peer* peer, void* msg, size_t sz);
 
-static int _thcon_get_url_content(const char* ip_addr, struct _curl_mem* mem);
+/* send hello packet requesting the protocol in client mode */
+static int _thcon_send_hello(thcon* obj);
 
-static int _parse_html_geo(const struct _curl_mem* _mem, struct thcon_host_info* info);
-static xmlNodePtr _get_html_tag_names(xmlNodePtr ptr, struct _html_parser_stack* stack);
+/* send subscription in client mode and record it on the server side */
+static int _thcon_send_sub(thcon* obj);
+static void _thcon_peer_sub(thcon* obj, struct thcon_peer* peer, const char* msg);
+
+/* encode subset record of the channels in the mask */
+static struct _thcon_msg* _thcon_msg_subset(struct _thcon_msg* msg, unsigned int mask);
 
 /*
- * Accept connection on listening socket and add to the epoll instance.
- * connection socket will be created non blocking.
+ * Connection state handling. Bytes read from a socket are passed through
+ * the peer, which handles the hello packet and reassembles frames before
+ * calling the recv callback.
  */
-static int _thcon_accept_conn(thcon* obj, int list_sock, int epoll_inst, struct epoll_event* event);
+static struct thcon_peer* _thcon_find_peer(thcon* obj, int fd);
+static void _thcon_peer_free(struct thcon_peer* peer);
+static int _thcon_peer_reserve(thcon* obj, struct thcon_peer* peer, size_t sz);
+static int _thcon_peer_read(thcon* obj, struct thcon_peer* peer);
+static void _thcon_peer_deliver(thcon* obj, struct thcon_peer* peer, char* msg, size_t sz);
+static int _thcon_peer_hello_svr(thcon* obj, struct thcon_peer* peer);
+static int _thcon_peer_hello_cli(thcon* obj, struct thcon_peer* peer);
+static int _thcon_peer_recv(thcon* obj, struct thcon_peer* peer);
+
+/*
+ * Outbound message handling. Messages are reference counted and
+ * queued on each connection, the queue is written without blocking.
+ * If a socket buffer is full, the remainder is written when epoll
+ * reports the socket writable.
+ */
+static struct _thcon_msg* _thcon_msg_new(size_t size, size_t bin_size, size_t delta_size);
+static void _thcon_msg_unref(struct _thcon_msg* msg);
+static char* _thcon_peer_enc(struct thcon_peer* peer, struct _thcon_msg* msg, size_t* sz, uint32_t** hdr);
+static int _thcon_peer_iov(struct thcon_peer* peer, struct iovec* iov);
+static void _thcon_peer_arm(thcon* obj, struct thcon_peer* peer, int flg);
+static int _thcon_peer_write(thcon* obj, struct thcon_peer* peer);
+static size_t _thcon_peer_out_len(struct thcon_peer* peer);
+static int _thcon_peer_push(thcon* obj, struct thcon_peer* peer, struct _thcon_msg* msg);
+static int _thcon_peer_next(struct thcon_peer* peer);
+static void _thcon_peer_done(struct thcon_peer* peer);
+static void _thcon_fanout(thcon* obj, struct _thcon_msg* msg, int flush);
+static void _thcon_peer_flush(thcon* obj, int fd);
+static void _thcon_reactor_write(thcon* obj, struct thcon_reactor* rct);
+
+/* Outbound ring of the writer thread and the message pool */
+static struct _thcon_ring* _thcon_ring_new(unsigned long sz);
+static int _thcon_ring_push(struct _thcon_ring* ring, struct _thcon_msg* msg);
+static struct _thcon_msg* _thcon_ring_pop(struct _thcon_ring* ring);
+static void _thcon_ring_free(struct _thcon_ring* ring, int pool_flg);
+static int _thcon_enqueue(thcon* obj, struct _thcon_msg* msg);
+static struct _thcon_msg* _thcon_msg_get(thcon* obj);
+static void _thcon_ring_wait(thcon* obj, long usec);
+static long _thcon_elapsed_us(const struct timespec* t0);
 
-/*---------------------------------------------------------------------------*/
 /*
- * Functions for reading and writing to the common buffer between test program and
- * clients.
+ * History of sequenced messages in server mode. Reconnecting clients
+ * send the last sequence number recieved and are replayed the messages
+ * they missed.
  */
-static int _thcon_write_to_int_buff(thcon* obj, int socket_fd);
-static int _thcon_write_to_ext_buff(thcon* obj, int socket_fd);
-/* static int _thcon_read_from_int_buff(thcon* obj, int socket_fd); */
+static void _thcon_hist_add(thcon* obj, struct _thcon_msg* msg);
+static void _thcon_hist_replay(thcon* obj, struct thcon_peer* peer, unsigned long long seq);
+static void _thcon_hist_free(thcon* obj);
 
+/*
+ * Multicast data plane. Server sends the binary encoding of sequenced
+ * messages to the group, clients deliver datagrams newer than the last
+ * sequence number and count the ones missed.
+ */
+static int _thcon_mcast_open(thcon* obj);
+static void _thcon_mcast_close(thcon* obj);
+static void _thcon_mcast_send(thcon* obj, struct _thcon_msg* msg);
+static void _thcon_mcast_recv(thcon* obj);
 
+/*
+ * Shared memory transport. Server creates the object and writes
+ * sequenced messages, clients map it read only.
+ */
+static int _thcon_shm_open(thcon* obj);
+static void _thcon_shm_close(thcon* obj);
+static void _thcon_shm_write(thcon* obj, struct _thcon_msg* msg);
+static int _thcon_shm_copy(const struct _thcon_shm_slot* slot, void* buff, size_t sz, unsigned long long* seq);
 
+static int _thcon_get_url_content(const char* ip_addr, struct _curl_mem* mem);
 
-/*---------------------------------------------------------------------------*/
+static int _parse_html_geo(const struct _curl_mem* _mem, struct thcon_host_info* info);
+static xmlNodePtr _get_html_tag_names(xmlNodePtr ptr, struct _html_parser_stack* stack);
 
 /*
- * Internal file descriptor handling methods.
+ * Accept connection on a listening socket of the reactor and add to its epoll
+ * instance. connection socket will be created non blocking.
  */
-inline __attribute__ ((always_inline)) static int _thcon_alloc_fds(thcon* obj);
-inline __attribute__ ((always_inline)) static int _thcon_adjust_fds(thcon* obj, int fd);
+static int _thcon_accept_conn(thcon* obj, struct thcon_reactor* rct, int sock);
+
+/*---------------------------------------------------------------------------*/
+
+
+
 
 /*---------------------------------------------------------------------------*/
 
 /*
- * Callback method for queue destroy.
+ * Internal file descriptor handling methods. Connections are kept in a
+ * table of slots with a free list and a map from descriptor to slot,
+ * adding and removing connections takes constant time.
  */
-static void _thcon_queue_del_helper(void* data);
+static int _thcon_table_grow(thcon* obj, unsigned int sz);
+static int _thcon_fd_map_grow(thcon* obj, int fd);
+static struct thcon_peer* _thcon_alloc_fds(thcon* obj, int fd);
+static void _thcon_table_remove(thcon* obj, int fd);
+static int _thcon_adjust_fds(thcon* obj, int fd);
+static void _thcon_table_free(thcon* obj);
+
+/*---------------------------------------------------------------------------*/
 
 
 /*===========================================================================*/
@@ -190,14 +382,37 @@ int thcon_init(thcon* obj, thcon_mode mode)
     obj->var_geo_flg = 0;
     obj->var_ip_flg = 0;
 
-	obj->var_inbuff_sz = 0;
-	obj->var_outbuff_sz = 0;
-
-	obj->var_membuff_in = NULL;
-	obj->var_membuff_out = NULL;
-    obj->_var_cons_fds = NULL;
-    obj->_var_epol_inst = NULL;
-    obj->_var_event_col = NULL;
+	obj->var_rbuff_sz = THCON_DEF_RBUFF_SZ;
+    obj->var_proto = thcon_proto_text;
+    obj->var_frm_flg = 0;
+    obj->var_outq_len = THCON_DEF_SEND_QUEUE_LEN;
+    obj->var_bp_policy = thcon_bp_drop_oldest;
+    obj->_var_cons = NULL;
+    obj->_var_live = NULL;
+    obj->_var_fd_map = NULL;
+    obj->_var_fd_map_sz = 0;
+    obj->_var_bf_sz = 0;
+    obj->_var_free_slot = -1;
+    obj->var_num_reactors = 1;
+    obj->_var_reactors = NULL;
+    obj->_var_wake_fd = -1;
+    obj->var_reconn_flg = 0;
+    obj->_var_last_seq = 0;
+    obj->var_hist_len = THCON_DEF_HISTORY_LEN;
+    obj->var_batch_cnt = 1;
+    obj->var_batch_time = 0;
+    obj->_var_hist = NULL;
+    obj->_var_hist_head = 0;
+    obj->_var_hist_cnt = 0;
+    obj->_var_mc_sock = -1;
+    obj->_var_mc_gaps = 0;
+    obj->_var_shm = NULL;
+    obj->_var_shm_sz = 0;
+    obj->var_sub_mask = 0;
+    obj->var_sub_ival = 0;
+    obj->var_delta_flg = 0;
+    obj->_var_delta_key = 0;
+    thornifix_delta_init(&obj->var_delta, 0);
 
     obj->var_my_info._init_flg = 0;
     obj->_ext_obj = NULL;
@@ -205,12 +420,17 @@ int thcon_init(thcon* obj, thcon_mode mode)
     obj->_thcon_write_callback = NULL;
     obj->_thcon_conn_made = NULL;
     obj->_thcon_conn_closed = NULL;
+    obj->_thcon_state_callback = NULL;
+
+    /* outbound ring and pool are created when the server starts */
+    obj->_var_ring = NULL;
+    obj->_var_pool = NULL;
+    obj->_var_ring_fd = -1;
+    obj->_var_ring_idle = 0;
 
-    /* initialise queue and locks */
-    gqueue_new(&obj->_msg_queue, _thcon_queue_del_helper);
-    sem_init(&obj->_var_sem, 0, 0);
+    /* initialise locks */
     pthread_mutex_init(&obj->_var_mutex, NULL);
-    pthread_mutex_init(&obj->_var_mutex_q, NULL);
+    pthread_mutex_init(&obj->_var_mutex_cb, NULL);
 
     return 0;
 }
@@ -223,34 +443,37 @@ void thcon_delete(thcon* obj)
     obj->_thcon_write_callback = NULL;
     obj->_thcon_conn_made = NULL;
     obj->_thcon_conn_closed = NULL;
+    obj->_thcon_state_callback = NULL;
 
-	if(obj->var_membuff_in)
-		free(obj->var_membuff_in);
-
-	if(obj->var_membuff_out)
-		free(obj->var_membuff_out);
-
-	obj->var_membuff_in = NULL;
-	obj->var_membuff_out = NULL;
+	/* free server connection state of the client mode */
+	_thcon_peer_free(&obj->_var_svr_peer);
 
     /* check scope */
-    sem_destroy(&obj->_var_sem);
     pthread_mutex_destroy(&obj->_var_mutex);
-    pthread_mutex_destroy(&obj->_var_mutex_q);
+    pthread_mutex_destroy(&obj->_var_mutex_cb);
 
 	/* if wake on lan socket was created close it */
 	if(obj->var_wol_sock > 0)
 		close(obj->var_wol_sock);
 
-    /* delete socket fd array */
-    if(obj->var_num_conns && obj->_var_cons_fds)
-		free(obj->_var_cons_fds);
-    obj->_var_cons_fds = NULL;
-    obj->_var_epol_inst = NULL;
-    obj->_var_event_col = NULL;
-
-    /* delete queue */
-    gqueue_delete(&obj->_msg_queue);
+	/* close wake descriptor of the client thread */
+	if(obj->_var_wake_fd != -1)
+		close(obj->_var_wake_fd);
+	obj->_var_wake_fd = -1;
+
+	_thcon_mcast_close(obj);
+	_thcon_shm_close(obj);
+
+    /* delete connection table, the message history and the outbound ring */
+    _thcon_table_free(obj);
+    _thcon_hist_free(obj);
+    _thcon_ring_free(obj->_var_ring, 0);
+    _thcon_ring_free(obj->_var_pool, 1);
+    obj->_var_ring = NULL;
+    obj->_var_pool = NULL;
+    if(obj->_var_ring_fd != -1)
+		close(obj->_var_ring_fd);
+    obj->_var_ring_fd = -1;
 
     return;
 }
@@ -414,32 +637,111 @@ contact_admin_cleanup:
 /* Start program */
 int thcon_start(thcon* obj)
 {
+    unsigned int i;
+    struct _thcon_msg* _msg;
+
     if(obj == NULL)
 		return -1;
 
+    /* start client */
+    if(obj->_var_con_mode == thcon_mode_client)
+	{
+	    /* event descriptor to wake the client thread on stop */
+	    if(obj->_var_wake_fd == -1)
+			obj->_var_wake_fd = eventfd(0, EFD_NONBLOCK);
+
+	    /* join the multicast group, samples are recieved on the connection if it fails */
+	    if(obj->var_mc_group[0] != '\0' && THCON_PROTO_BIN(obj->var_proto))
+			_thcon_mcast_open(obj);
+
+	    /* map shared memory of the server, it may be created later */
+	    if(obj->var_shm_name[0] != '\0')
+			_thcon_shm_open(obj);
+
+	    pthread_create(&obj->_var_run_thread,
+					   NULL,
+					   _thcon_thread_function_client,
+					   (void*) obj);
+	    return 0;
+	}
+
     /*
-     * If it runs in the server mode
+     * If it runs in the server mode, each reactor
      * 1. Create listening socket,
      * 2. make it non blocking,
      * 3. start epoll instance and listen for connections.
      */
+    if(obj->var_num_reactors < 1)
+		obj->var_num_reactors = 1;
+    if(obj->var_num_reactors > THCON_MAX_REACTORS)
+		obj->var_num_reactors = THCON_MAX_REACTORS;
 
-    /* start server */
-    pthread_create(&obj->_var_run_thread,
-				   NULL,
-				   (obj->_var_con_mode == thcon_mode_server? _thcon_thread_function_server : _thcon_thread_function_client),
-				   (void*) obj);
+    obj->_var_reactors = (struct thcon_reactor*) calloc(obj->var_num_reactors, sizeof(struct thcon_reactor));
+    if(obj->_var_reactors == NULL)
+	{
+	    THOR_LOG_ERROR("unable to allocate server reactors");
+	    return -1;
+	}
 
-    /*
-     * If we are running in the server mode, call the write methods.
-     */
-    if(obj->_var_con_mode == thcon_mode_server)
+    /* outbound ring of the writer thread, wake descriptor and the message pool */
+    obj->_var_ring = _thcon_ring_new(THCON_MSG_RING_SZ);
+    obj->_var_pool = _thcon_ring_new(THCON_MSG_POOL_SZ);
+    obj->_var_ring_fd = eventfd(0, 0);
+    obj->_var_ring_idle = 0;
+    if(obj->_var_ring == NULL || obj->_var_pool == NULL || obj->_var_ring_fd == -1)
+	{
+	    THOR_LOG_ERROR("unable to create outbound message ring");
+	    return -1;
+	}
+
+    /* fill the pool so that the acquisition thread does not allocate */
+    for(i = 0; i < THCON_MSG_POOL_SZ; i++)
+	{
+	    _msg = _thcon_msg_new(THORINIFIX_MSG_SZ, THORNIFIX_BIN_MSG_SZ, THORNIFIX_BIN_MSG_SZ);
+	    if(_msg == NULL || _thcon_ring_push(obj->_var_pool, _msg))
+		{
+		    free(_msg);
+		    break;
+		}
+	}
+
+    /* socket publishing samples to the multicast group */
+    if(obj->var_mc_group[0] != '\0')
+		_thcon_mcast_open(obj);
+
+    /* shared memory for clients on the same host */
+    if(obj->var_shm_name[0] != '\0')
+		_thcon_shm_open(obj);
+
+    /* allocate the connection table */
+    pthread_mutex_lock(&obj->_var_mutex);
+    _thcon_table_grow(obj, THCON_MAX_CLIENTS);
+    pthread_mutex_unlock(&obj->_var_mutex);
+
+    /* start reactors */
+    for(i = 0; i < obj->var_num_reactors; i++)
 	{
-	    pthread_create(&obj->_var_svr_write_thread,
+	    obj->_var_reactors[i]._obj = obj;
+	    obj->_var_reactors[i]._idx = (int) i;
+	    obj->_var_reactors[i]._list_sock = -1;
+	    obj->_var_reactors[i]._unix_sock = -1;
+	    obj->_var_reactors[i]._epoll = -1;
+	    obj->_var_reactors[i]._wake_fd = -1;
+	    obj->_var_reactors[i]._events = NULL;
+	    pthread_create(&obj->_var_reactors[i]._thread,
 					   NULL,
-					   _thcon_thread_function_write_server,
-					   (void*) obj);
+					   _thcon_thread_function_server,
+					   (void*) &obj->_var_reactors[i]);
 	}
+
+    /*
+     * If we are running in the server mode, call the write methods.
+     */
+    pthread_create(&obj->_var_svr_write_thread,
+				   NULL,
+				   _thcon_thread_function_write_server,
+				   (void*) obj);
+
 	return 0;
 }
 
@@ -452,34 +754,78 @@ int thcon_start(thcon* obj)
  */
 int thcon_stop(thcon* obj)
 {
+    unsigned int i;
+    uint64_t _one = 1;
+
     if(obj == NULL)
 		return -1;
 
-    /* If there is not server running, exit method */
-    if(obj->_var_con_stat == thcon_disconnected)
+    /*
+     * If there is not server running, exit method. Client thread runs
+     * while its reconnecting, its running if the wake descriptor exists.
+     */
+    if(obj->_var_con_mode == thcon_mode_client)
+	{
+	    if(obj->_var_wake_fd == -1)
+			return -1;
+	}
+    else if(obj->_var_con_stat == thcon_disconnected)
 		return -1;
 
     /* indicate server is stopped */
     obj->_var_con_stat = thcon_disconnected;
 
-
-    /* post sem to proceed with quit */
-    sem_post(&obj->_var_sem);
-
     /*
      * In the server mode, first stop and join the write operations.
+     * Subsequently reactors are stopped, each closing its connections.
      */
     if(obj->_var_con_mode != thcon_mode_client)
 	{
 	    pthread_cancel(obj->_var_svr_write_thread);
 	    pthread_join(obj->_var_svr_write_thread, NULL);
-	}
 
-    /*
-     * Stop connection handling mode and join to the main thread.
-     */
-    pthread_cancel(obj->_var_run_thread);
-    pthread_join(obj->_var_run_thread, NULL);
+	    for(i = 0; i < obj->var_num_reactors; i++)
+		{
+		    pthread_cancel(obj->_var_reactors[i]._thread);
+		    pthread_join(obj->_var_reactors[i]._thread, NULL);
+		}
+
+	    free(obj->_var_reactors);
+	    obj->_var_reactors = NULL;
+
+	    /* messages return to the pool, which is freed last */
+	    _thcon_ring_free(obj->_var_ring, 0);
+	    obj->_var_ring = NULL;
+
+	    pthread_mutex_lock(&obj->_var_mutex);
+	    _thcon_table_free(obj);
+	    _thcon_hist_free(obj);
+	    pthread_mutex_unlock(&obj->_var_mutex);
+
+	    _thcon_ring_free(obj->_var_pool, 1);
+	    obj->_var_pool = NULL;
+	    close(obj->_var_ring_fd);
+	    obj->_var_ring_fd = -1;
+	    _thcon_mcast_close(obj);
+	    _thcon_shm_close(obj);
+	}
+    else
+	{
+	    /*
+	     * Wake the client thread to exit its loop. Its cancelled as
+	     * well in case it was still connecting, and joined to the main thread.
+	     */
+	    if(obj->_var_wake_fd != -1)
+			write(obj->_var_wake_fd, &_one, sizeof(uint64_t));
+	    pthread_cancel(obj->_var_run_thread);
+	    pthread_join(obj->_var_run_thread, NULL);
+
+	    if(obj->_var_wake_fd != -1)
+			close(obj->_var_wake_fd);
+	    obj->_var_wake_fd = -1;
+	    _thcon_mcast_close(obj);
+	    _thcon_shm_close(obj);
+	}
 
     THOR_LOG_ERROR("thcon sucessfully freed");
     return 0;
@@ -489,23 +835,158 @@ int thcon_stop(thcon* obj)
 /* send information to the socket */
 int thcon_send_info(thcon* obj, void* data, size_t sz)
 {
-    unsigned int i = 0;
+    struct _thcon_msg* _msg;
     if(obj == NULL || data == NULL)
 		return -1;
 
     /* check if the connection was made*/
-    if(obj->_var_con_stat == thcon_disconnected)
+    if(obj->_var_con_stat != thcon_connected)
 		return -1;
 
     /* call private method for sending the information */
     if(obj->_var_con_mode == thcon_mode_client)
-		_thcon_send_info(obj->var_acc_sock, data, sz);
+		_thcon_send_peer(&obj->_var_svr_peer, data, sz);
     else
 	{
-	    for(i = 0; i < obj->var_num_conns; i++)
-			_thcon_send_info(obj->_var_cons_fds[i], data, sz);
+	    /*
+	     * Connections may have a partially written message,
+	     * the message is passed through the same path.
+	     */
+	    _msg = _thcon_msg_new(sz, 0, 0);
+	    if(_msg == NULL)
+			return -1;
+	    memcpy((void*) _msg->memory, data, sz);
+	    _thcon_fanout(obj, _msg, 1);
+	    _thcon_msg_unref(_msg);
+	}
+
+    return 0;
+}
+
+/*
+ * Send to a single connection. Message is queued behind messages
+ * pending on the connection so that the stream is not interleaved.
+ */
+int thcon_send_to(thcon* obj, int fd, void* data, size_t sz)
+{
+    int _rt = -1;
+    unsigned int _rct = 0;
+    uint64_t _one = 1;
+    struct _thcon_msg* _msg;
+    struct thcon_peer* _peer;
+
+    if(obj == NULL || data == NULL || obj->_var_con_stat != thcon_connected)
+		return -1;
+
+    if(obj->_var_con_mode == thcon_mode_client)
+		return _thcon_send_peer(&obj->_var_svr_peer, data, sz) < 0? -1 : 0;
+
+    _msg = _thcon_msg_new(sz, 0, 0);
+    if(_msg == NULL)
+		return -1;
+    memcpy((void*) _msg->memory, data, sz);
+
+    pthread_mutex_lock(&obj->_var_mutex);
+    if(fd >= 0 && (unsigned int) fd < obj->_var_fd_map_sz && obj->_var_fd_map[fd] >= 0)
+	{
+	    _peer = obj->_var_cons[obj->_var_fd_map[fd]];
+	    _rt = 0;
+	    if(_thcon_peer_push(obj, _peer, _msg))
+		{
+		    shutdown(_peer->_fd, SHUT_RDWR);
+		    _rt = -1;
+		}
+	    else if(!_peer->_out_arm && obj->var_num_reactors > 1)
+			_rct = _peer->_reactor + 1;
+	    else if(!_peer->_out_arm && _thcon_peer_write(obj, _peer) == -1)
+			shutdown(_peer->_fd, SHUT_RDWR);
+	}
+    pthread_mutex_unlock(&obj->_var_mutex);
+
+    /* connection is written by its own reactor */
+    if(_rct > 0 && obj->_var_reactors[_rct - 1]._wake_fd != -1)
+		write(obj->_var_reactors[_rct - 1]._wake_fd, &_one, sizeof(uint64_t));
+
+    _thcon_msg_unref(_msg);
+    return _rt;
+}
+
+/*
+ * Post a reply to a single connection. The reply is copied to a pooled
+ * message without its binary encodings, so all clients are sent the
+ * bytes given, and queued for the writer thread like samples.
+ */
+int thcon_post_to(thcon* obj, int fd, const void* data, size_t sz)
+{
+    struct _thcon_msg* _msg;
+
+    if(obj == NULL || data == NULL || fd < 0 || sz > THORINIFIX_MSG_SZ ||
+       obj->_var_con_mode != thcon_mode_server || obj->_var_con_stat != thcon_connected)
+		return -1;
+
+    _msg = _thcon_msg_get(obj);
+    if(_msg == NULL)
+		return -1;
+
+    memcpy((void*) _msg->memory, data, sz);
+    _msg->size = sz;
+    _msg->hdr = htole32((uint32_t) sz);
+    _msg->bin_memory = NULL;
+    _msg->_fd = fd;
+
+    return _thcon_enqueue(obj, _msg);
+}
+
+/* Set subscription of the connection of the socket */
+int thcon_set_peer_sub(thcon* obj, int fd, unsigned int mask, unsigned int ival)
+{
+    int _rt = -1;
+    struct thcon_peer* _peer;
+
+    if(obj == NULL || obj->_var_con_mode != thcon_mode_server)
+		return -1;
+
+    pthread_mutex_lock(&obj->_var_mutex);
+    if(fd >= 0 && (unsigned int) fd < obj->_var_fd_map_sz && obj->_var_fd_map[fd] >= 0)
+	{
+	    _peer = obj->_var_cons[obj->_var_fd_map[fd]];
+
+	    /* subset records are only sent to framed binary clients */
+	    if(_peer->_hs_frm_flg && _peer->_hs_proto == thcon_proto_bin)
+		{
+		    _peer->_sub_mask = mask & THORNIFIX_CH_ALL;
+		    if(_peer->_sub_mask == THORNIFIX_CH_ALL)
+			_peer->_sub_mask = 0;
+		    _peer->_sub_ival = ival;
+		    _peer->_sub_last = 0;
+		    _rt = 0;
+		}
+	}
+    pthread_mutex_unlock(&obj->_var_mutex);
+    return _rt;
+}
+
+/*
+ * Subscribe to channels in client mode. The subscription is kept and
+ * sent again after reconnecting, its sent now if connected.
+ */
+int thcon_subscribe(thcon* obj, unsigned int mask, double rate)
+{
+    if(obj == NULL || obj->_var_con_mode != thcon_mode_client)
+		return -1;
+
+    /* subset records are only separated and decoded by framed binary clients */
+    if(obj->var_proto != thcon_proto_bin || !obj->var_frm_flg)
+	{
+	    THOR_LOG_ERROR("subscription requires framed binary protocol");
+	    return -1;
 	}
 
+    obj->var_sub_mask = mask & THORNIFIX_CH_ALL;
+    obj->var_sub_ival = rate > 0.0? (unsigned int) (1000000.0 / rate) : 0;
+
+    if(obj->_var_con_stat == thcon_connected && _thcon_send_sub(obj) < 0)
+		return -1;
     return 0;
 }
 
@@ -515,7 +996,7 @@ int thcon_send_info(thcon* obj, void* data, size_t sz)
  */
 int thcon_multicast(thcon* obj, void* data, size_t sz)
 {
-    struct _curl_mem* _msg;
+    struct _thcon_msg* _msg;
 
     /* check for argument pointers */
     if(!obj || !data || !sz)
@@ -525,19 +1006,143 @@ int thcon_multicast(thcon* obj, void* data, size_t sz)
     if(obj->_var_con_stat == thcon_disconnected)
 		return -1;
 
-    _msg = (struct _curl_mem*) malloc(sizeof(struct _curl_mem));
-    _msg->memory = (char*) malloc(sz);
+    _msg = _thcon_msg_new(sz, 0, 0);
+    if(_msg == NULL)
+		return -1;
     memcpy((void*) _msg->memory, data, sz);
-    _msg->size = sz;
 
-    /*--------------------------------------------------*/
-    /************* Mutex Lock This Section **************/
-    pthread_mutex_lock(&obj->_var_mutex_q);
-    gqueue_in(&obj->_msg_queue, (void*) _msg);
-    pthread_mutex_unlock(&obj->_var_mutex_q);
-    sem_post(&obj->_var_sem);
-    /*--------------------------------------------------*/
-    return 0;
+    /* queue for the writer thread */
+    return _thcon_enqueue(obj, _msg);
+}
+
+/*
+ * Encode message struct in both wire formats and queue for the
+ * writer thread.
+ */
+int thcon_multicast_msg(thcon* obj, const struct thor_msg* msg)
+{
+    int _len;
+    struct _thcon_msg* _msg;
+
+    /* check for argument pointers */
+    if(!obj || !msg)
+		return -1;
+
+    /* check it its running in the server mode */
+    if(obj->_var_con_stat == thcon_disconnected)
+		return -1;
+
+    _msg = _thcon_msg_get(obj);
+    if(_msg == NULL)
+		return -1;
+
+    /*
+     * text encoding for the legacy clients, only the message and its
+     * null character are sent which delimits messages on unframed streams
+     */
+    _len = thornifix_encode_msg(msg, _msg->memory, THORINIFIX_MSG_SZ);
+    _msg->size = _len < 0? 0 : (size_t) _len + 1;
+    _msg->hdr = htole32((uint32_t) _msg->size);
+
+    /* binary encoding, binary clients are sent the text if it fails */
+    if(thornifix_encode_msg_bin(msg, _msg->bin_memory, THORNIFIX_BIN_MSG_SZ) < 0)
+		_msg->bin_memory = NULL;
+
+    /* delta encoding continues the stream, keyframe if a client connected */
+    if(obj->var_delta_flg)
+	{
+	    if(__atomic_exchange_n(&obj->_var_delta_key, 0, __ATOMIC_ACQ_REL))
+			thornifix_delta_set_key(&obj->var_delta);
+
+	    _len = thornifix_encode_msg_delta(&obj->var_delta, msg, _msg->memory + THORINIFIX_MSG_SZ + THORNIFIX_BIN_MSG_SZ, THORNIFIX_BIN_MSG_SZ);
+	    if(_len > 0)
+		{
+		    _msg->delta_memory = _msg->memory + THORINIFIX_MSG_SZ + THORNIFIX_BIN_MSG_SZ;
+		    _msg->delta_size = (size_t) _len;
+		    _msg->delta_hdr = htole32((uint32_t) _len);
+		}
+	}
+
+    /* kept in the history for reconnecting clients */
+    _msg->_seq = msg->_seq;
+
+    /* queue for the writer thread */
+    return _thcon_enqueue(obj, _msg);
+}
+
+/*
+ * Read the latest message of the shared memory. If the server
+ * restarted, the object is mapped again.
+ */
+int thcon_shm_latest(thcon* obj, void* buff, size_t sz, unsigned long long* seq)
+{
+    uint64_t _head;
+    unsigned long long _seq;
+    int _rt;
+
+    if(obj == NULL || buff == NULL || obj->var_shm_name[0] == '\0')
+		return -1;
+
+    if((obj->_var_shm == NULL ||
+	__atomic_load_n(&obj->_var_shm->_magic, __ATOMIC_ACQUIRE) != THCON_SHM_MAGIC) &&
+       _thcon_shm_open(obj))
+		return -1;
+
+    _head = __atomic_load_n(&obj->_var_shm->_head, __ATOMIC_ACQUIRE);
+    if(_head == 0)
+		return 0;
+
+    _rt = _thcon_shm_copy(&obj->_var_shm->_slots[_head % obj->_var_shm->_slot_cnt], buff, sz, &_seq);
+    if(_rt > 0 && seq)
+		*seq = _seq;
+    return _rt;
+}
+
+/*
+ * Read a message from the history of the shared memory. The slot
+ * may hold a newer message if the reader fell behind.
+ */
+int thcon_shm_read(thcon* obj, unsigned long long seq, void* buff, size_t sz)
+{
+    unsigned long long _seq;
+    int _rt;
+
+    if(obj == NULL || buff == NULL || seq == 0 || obj->_var_shm == NULL)
+		return -1;
+
+    if(seq > (unsigned long long) __atomic_load_n(&obj->_var_shm->_head, __ATOMIC_ACQUIRE))
+		return 0;
+
+    _rt = _thcon_shm_copy(&obj->_var_shm->_slots[seq % obj->_var_shm->_slot_cnt], buff, sz, &_seq);
+    if(_rt > 0 && _seq != seq)
+		return -1;
+    return _rt;
+}
+
+/*
+ * Copy statistics of the connections to the array. Returns the number
+ * of connections copied.
+ */
+int thcon_get_peer_stats(thcon* obj, struct thcon_peer_stats* stats, unsigned int num)
+{
+    unsigned int i;
+    struct thcon_peer* _peer;
+
+    if(obj == NULL || stats == NULL)
+		return -1;
+
+    pthread_mutex_lock(&obj->_var_mutex);
+    for(i = 0; i < obj->var_num_conns && i < num; i++)
+	{
+	    _peer = _thcon_live_peer(obj, i);
+	    stats[i]._fd = _peer->_fd;
+	    stats[i]._sent_cnt = _peer->_sent_cnt;
+	    stats[i]._drop_cnt = _peer->_drop_cnt;
+	    stats[i]._queued = _peer->_outq_cnt + (_peer->_out_msg? 1 : 0);
+	}
+    pthread_mutex_unlock(&obj->_var_mutex);
+
+    return (int) i;
 }
 
 /* send magic packet to device with mac address specified by mac_addr */
@@ -590,6 +1195,10 @@ static int _thcon_create_connection(thcon* obj, int _con_mode)
     int _stat;
     struct addrinfo *_result, *_p;
 
+    /* clients on the same host may connect to the unix domain socket */
+    if(_con_mode == 0 && obj->var_unix_path[0] != '\0')
+		return _thcon_connect_unix(obj);
+
     /* initialise the address infor struct */
     memset(&obj->_var_info, 0, sizeof(struct addrinfo));
 
@@ -940,8 +1549,8 @@ static xmlNodePtr _get_html_tag_names(xmlNodePtr ptr, struct _html_parser_stack*
 static void* _thcon_thread_function_client(void* obj)
 {
     thcon* _obj;
-    int _stat = 0;
-    int _cancel_state = 0;
+    unsigned int _delay;
+    unsigned int _seed;
 
     /* check object pointer */
     if(obj == NULL)
@@ -949,25 +1558,108 @@ static void* _thcon_thread_function_client(void* obj)
 
     /* cast object pointer to connection type */
     _obj = (thcon*) obj;
+    _seed = (unsigned int) time(NULL) ^ (unsigned int) (uintptr_t) obj;
+    _delay = THCON_RECONN_MIN_TIME;
 
-    /* create socket and bind */
-    if(_thcon_create_connection(_obj, thcon_mode_client))
-		return NULL;
+    /*
+     * Connect and run the session until stop is requested. If the
+     * reconnect flag was set, lost connections are retried with an
+     * exponential back off. The delay is randomised so that clients
+     * do not reconnect at the same time after a server restart.
+     */
+    while(1)
+	{
+	    _thcon_set_conn_stat(_obj, thcon_connecting);
+	    if(_thcon_create_connection(_obj, thcon_mode_client) == 0)
+		{
+		    _delay = THCON_RECONN_MIN_TIME;
+		    if(_thcon_client_session(_obj))
+			{
+			    close(_obj->var_acc_sock);
+			    _thcon_set_conn_stat(_obj, thcon_disconnected);
+			    break;
+			}
+		    close(_obj->var_acc_sock);
+		}
+	    _thcon_set_conn_stat(_obj, thcon_disconnected);
+
+	    if(!_obj->var_reconn_flg)
+			break;
+
+	    /* wait before the next attempt unless stop was requested */
+	    if(_thcon_client_wait(_obj, _delay/2 + (unsigned int) rand_r(&_seed) % (_delay/2 + 1)))
+			break;
+	    _delay = _delay * 2 > THCON_RECONN_MAX_TIME? THCON_RECONN_MAX_TIME : _delay * 2;
+	}
+
+    return NULL;
+}
+
+/*
+ * Handle a connection to the server. Messages are read until the
+ * connection is lost or stop was requested. Returns 1 if stop was
+ * requested.
+ */
+static int _thcon_client_session(thcon* obj)
+{
+    int _stat = 0;
+    int _cancel_state = 0;
+    struct pollfd _fds[3];
+    nfds_t _nfds;
 
     /* make socket non blocking */
-    if(_thcon_make_socket_nonblocking(_obj->var_acc_sock))
-		return NULL;
+    if(_thcon_make_socket_nonblocking(obj->var_acc_sock))
+		return 0;
+
+    /* reset server connection state */
+    _thcon_peer_free(&obj->_var_svr_peer);
+    memset((void*) &obj->_var_svr_peer, 0, sizeof(struct thcon_peer));
+    obj->_var_svr_peer._fd = obj->var_acc_sock;
+    obj->_var_svr_peer._proto = thcon_proto_text;
+    obj->_var_svr_peer._hs_flg = 1;
+    if(_thcon_peer_reserve(obj, &obj->_var_svr_peer, 0))
+		return 0;
+
+    /*
+     * Request the protocol if its not the default. Messages sent
+     * to the server are framed from here on, messages recieved are
+     * framed once the server acknowledges.
+     */
+    if(obj->var_proto != thcon_proto_text || obj->var_frm_flg ||
+       obj->_var_mc_sock != -1 || obj->_var_shm != NULL)
+	{
+	    obj->_var_svr_peer._hs_flg = 0;
+	    _thcon_send_hello(obj);
+	    obj->_var_svr_peer._frm_flg = obj->var_frm_flg;
+
+	    /* subscription follows the hello */
+	    if(obj->var_sub_mask || obj->var_sub_ival)
+			_thcon_send_sub(obj);
+	}
 
     pthread_testcancel();
 
     /* indicate server is idling */
-    _obj->_var_con_stat = thcon_connected;
+    _thcon_set_conn_stat(obj, thcon_connected);
+
+    /*
+     * Wait on the socket, the wake descriptor and the multicast socket.
+     * Messages are delivered as soon as they arrive, stop method writes
+     * to the wake descriptor to exit the loop.
+     */
+    _fds[0].fd = obj->var_acc_sock;
+    _fds[0].events = POLLIN;
+    _fds[1].fd = obj->_var_wake_fd;
+    _fds[1].events = POLLIN;
+    _fds[2].fd = obj->_var_mc_sock;
+    _fds[2].events = POLLIN;
+    _nfds = _fds[1].fd == -1? 1 : (_fds[2].fd == -1? 2 : 3);
 
     /* loop while connection is active and recieving messages */
     do
 	{
 	    pthread_testcancel();
-	    _stat = _thcon_write_to_ext_buff(_obj, _obj->var_acc_sock);
+	    _stat = _thcon_peer_read(obj, &obj->_var_svr_peer);
 
 	    /*
 	     * Server has closed the connection therefore we exit the
@@ -980,104 +1672,1699 @@ static void* _thcon_thread_function_client(void* obj)
 	    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_cancel_state);
 
 	    /*
-	     * If a callback pointer was set, it shall be called immediately.
-	     * Later on, the message should be queued and have the callback pop following
-	     * execution.
+	     * Pass the bytes through the connection state. The recv callback
+	     * is called for every complete message. If the server violated
+	     * the framing protocol, exit the loop.
 	     */
-	    if(_obj->_thcon_recv_callback && _stat > 0)
-			_obj->_thcon_recv_callback(_obj->_ext_obj, _obj->var_membuff_out, _obj->var_outbuff_sz);
+	    if(_stat > 0 &&
+	       _thcon_peer_recv(obj, &obj->_var_svr_peer))
+		{
+		    pthread_setcancelstate(_cancel_state, NULL);
+		    break;
+		}
 
 	    /* enable thread cancel state */
 	    pthread_setcancelstate(_cancel_state, NULL);
 
-	    pthread_testcancel();
-	    /* sleep for 100ms to save processor cycle time */
-	    usleep(THCON_CLIENT_RECV_SLEEP_TIME);
+	    /* read again without waiting if there were bytes */
+	    if(_stat > 0)
+			continue;
+
+	    /* connection failed */
+	    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			break;
+
+	    /* block until the socket is readable or stop was requested */
+	    _fds[0].revents = 0;
+	    _fds[1].revents = 0;
+	    _fds[2].revents = 0;
+	    if(poll(_fds, _nfds, -1) == -1 && errno != EINTR)
+			break;
+
+	    if(_fds[1].revents & POLLIN)
+			return 1;
+
+	    /* deliver datagrams of the multicast group */
+	    if(_fds[2].revents & POLLIN)
+		{
+		    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_cancel_state);
+		    _thcon_mcast_recv(obj);
+		    pthread_setcancelstate(_cancel_state, NULL);
+		}
 	}while(_stat);
 
-    return NULL;
+    return 0;
+}
+
+/*
+ * Wait for the time (ms) before reconnecting. Returns 1 if
+ * stop was requested while waiting.
+ */
+static int _thcon_client_wait(thcon* obj, unsigned int ms)
+{
+    struct pollfd _fd;
+
+    if(obj->_var_wake_fd == -1)
+	{
+	    usleep(ms * 1000);
+	    return 0;
+	}
+
+    _fd.fd = obj->_var_wake_fd;
+    _fd.events = POLLIN;
+    _fd.revents = 0;
+    if(poll(&_fd, 1, (int) ms) > 0 && (_fd.revents & POLLIN))
+		return 1;
+
+    return 0;
+}
+
+/* Set connection status and call the state callback */
+static void _thcon_set_conn_stat(thcon* obj, thcon_stat stat)
+{
+    if(obj->_var_con_stat == stat)
+		return;
+
+    obj->_var_con_stat = stat;
+    if(obj->_thcon_state_callback)
+		obj->_thcon_state_callback(obj->_ext_obj, obj, stat);
+    return;
+}
+
+/*
+ * Send io vector to the socket. Sockets are non blocking, if the socket
+ * buffer is full we wait for the socket to become writable for a limited
+ * time. Returns number of bytes sent or -1 on error.
+ */
+static int _thcon_send_iov(int fd, struct iovec* iov, int cnt)
+{
+    ssize_t _sent;
+    size_t _total = 0;
+    struct msghdr _mh;
+    struct pollfd _pfd;
+
+    memset((void*) &_mh, 0, sizeof(struct msghdr));
+    _mh.msg_iov = iov;
+    _mh.msg_iovlen = cnt;
+
+    while(_mh.msg_iovlen > 0)
+	{
+	    _sent = sendmsg(fd, &_mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+	    if(_sent == -1)
+		{
+		    if(errno == EINTR)
+				continue;
+		    if(errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+
+		    /* wait for the socket to be writable */
+		    _pfd.fd = fd;
+		    _pfd.events = POLLOUT;
+		    if(poll(&_pfd, 1, THCON_SEND_TIMEOUT) <= 0)
+				return -1;
+		    continue;
+		}
+	    _total += (size_t) _sent;
+
+	    /* advance the vector past the bytes sent */
+	    while(_mh.msg_iovlen > 0 && (size_t) _sent >= _mh.msg_iov->iov_len)
+		{
+		    _sent -= _mh.msg_iov->iov_len;
+		    _mh.msg_iov++;
+		    _mh.msg_iovlen--;
+		}
+	    if(_mh.msg_iovlen > 0)
+		{
+		    _mh.msg_iov->iov_base = (char*) _mh.msg_iov->iov_base + _sent;
+		    _mh.msg_iov->iov_len -= _sent;
+		}
+	}
+
+    return (int) _total;
 }
 
 /* Send information to the socket pointed by data msg of size sz */
 static int _thcon_send_info(int fd, void* msg, size_t sz)
 {
-    size_t _buff_sent = 0;
+    struct iovec _iov;
 
-    /*
-     * Send message in non blocking mode. Iterate until the message was sent.
-     */
-    do
+    _iov.iov_base = msg;
+    _iov.iov_len = sz;
+    return _thcon_send_iov(fd, &_iov, 1);
+}
+
+/* Send message prefixed by its length */
+static int _thcon_send_frame(int fd, void* msg, size_t sz)
+{
+    uint32_t _hdr;
+    struct iovec _iov[2];
+
+    _hdr = htole32((uint32_t) sz);
+    _iov[0].iov_base = &_hdr;
+    _iov[0].iov_len = THCON_FRAME_HDR_SZ;
+    _iov[1].iov_base = msg;
+    _iov[1].iov_len = sz;
+    return _thcon_send_iov(fd, _iov, 2);
+}
+
+/* Send message in the framing mode of the peer */
+static int _thcon_send_peer(struct thcon_peer* peer, void* msg, size_t sz)
+{
+    if(peer->_frm_flg)
+		return _thcon_send_frame(peer->_fd, msg, sz);
+    else
+		return _thcon_send_info(peer->_fd, msg, sz);
+}
+
+/* Allocate message with room for the encodings, reference count is one */
+static struct _thcon_msg* _thcon_msg_new(size_t size, size_t bin_size, size_t delta_size)
+{
+    struct _thcon_msg* _msg;
+
+    /* encodings are stored after the struct in a single block */
+    _msg = (struct _thcon_msg*) malloc(sizeof(struct _thcon_msg) + size + bin_size + delta_size);
+    if(_msg == NULL)
+		return NULL;
+
+    _msg->_ref = 1;
+    _msg->_seq = 0;
+    _msg->_fd = -1;
+    _msg->_pool = NULL;
+    _msg->memory = (char*) (_msg + 1);
+    _msg->size = size;
+    _msg->hdr = htole32((uint32_t) size);
+    _msg->bin_memory = bin_size? _msg->memory + size : NULL;
+    _msg->bin_size = bin_size;
+    _msg->bin_hdr = htole32((uint32_t) bin_size);
+    _msg->delta_memory = delta_size? _msg->memory + size + bin_size : NULL;
+    _msg->delta_size = delta_size;
+    _msg->delta_hdr = htole32((uint32_t) delta_size);
+
+    return _msg;
+}
+
+/* Release a reference, message is freed with the last reference */
+static void _thcon_msg_unref(struct _thcon_msg* msg)
+{
+    if(msg == NULL)
+		return;
+
+    if(__atomic_sub_fetch(&msg->_ref, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+    /* return to the pool, free if its full */
+    if(msg->_pool && _thcon_ring_push(msg->_pool, msg) == 0)
+		return;
+    free(msg);
+    return;
+}
+
+/*
+ * Encoding of the message for the protocol negotiated by the peer.
+ * Delta clients are sent the binary encoding of messages without a delta
+ * encoding, binary clients the text if there is no binary encoding.
+ */
+static char* _thcon_peer_enc(struct thcon_peer* peer, struct _thcon_msg* msg, size_t* sz, uint32_t** hdr)
+{
+    if(peer->_proto == thcon_proto_delta && msg->delta_memory)
+	{
+	    *sz = msg->delta_size;
+	    *hdr = &msg->delta_hdr;
+	    return msg->delta_memory;
+	}
+
+    if(THCON_PROTO_BIN(peer->_proto) && msg->bin_memory)
+	{
+	    *sz = msg->bin_size;
+	    *hdr = &msg->bin_hdr;
+	    return msg->bin_memory;
+	}
+
+    *sz = msg->size;
+    *hdr = &msg->hdr;
+    return msg->memory;
+}
+
+/*
+ * Fill io vector with the encoding and framing negotiated by the peer,
+ * skipping bytes of the pending message already sent. Returns the number
+ * of vectors, 0 if the message was sent completely.
+ */
+static int _thcon_peer_iov(struct thcon_peer* peer, struct iovec* iov)
+{
+    int i, j, _cnt = 0;
+    size_t _off = peer->_out_off;
+    size_t _sz;
+    char* _mem;
+    uint32_t* _hdr;
+
+    _mem = _thcon_peer_enc(peer, peer->_out_msg, &_sz, &_hdr);
+    if(peer->_frm_flg)
+	{
+	    iov[_cnt].iov_base = _hdr;
+	    iov[_cnt++].iov_len = THCON_FRAME_HDR_SZ;
+	}
+
+    iov[_cnt].iov_base = _mem;
+    iov[_cnt++].iov_len = _sz;
+
+    /* skip the bytes sent */
+    for(i = 0; i < _cnt && _off >= iov[i].iov_len; i++)
+		_off -= iov[i].iov_len;
+    for(j = 0; i < _cnt; i++, j++)
+		iov[j] = iov[i];
+
+    if(j > 0)
+	{
+	    iov[0].iov_base = (char*) iov[0].iov_base + _off;
+	    iov[0].iov_len -= _off;
+	}
+
+    return j;
+}
+
+/* Enable or disable write notifications of the peer */
+static void _thcon_peer_arm(thcon* obj, struct thcon_peer* peer, int flg)
+{
+    struct epoll_event _event;
+
+    if(obj->_var_reactors == NULL)
+		return;
+
+    memset((void*) &_event, 0, sizeof(struct epoll_event));
+    _event.data.fd = peer->_fd;
+    _event.events = EPOLLIN | EPOLLET | (flg? EPOLLOUT : 0);
+    epoll_ctl(obj->_var_reactors[peer->_reactor]._epoll, EPOLL_CTL_MOD, peer->_fd, &_event);
+    peer->_out_arm = flg;
+    return;
+}
+
+/*
+ * Write pending messages of the peer without blocking. The message being
+ * written is completed first, followed by the messages in the send queue.
+ * On framed connections queued messages are gathered into a single
+ * write, so that a batch of samples costs one system call. If the socket
+ * buffer is full, write notification is enabled and the server thread
+ * continues when the socket becomes writable. Must be called with the
+ * descriptor mutex held. Returns 0 if all messages were sent, 1 if
+ * messages are still pending and -1 on error.
+ */
+static int _thcon_peer_write(thcon* obj, struct thcon_peer* peer)
+{
+    int _cnt;
+    unsigned int i;
+    size_t _len, _t_off;
+    ssize_t _sent;
+    struct iovec _iov[THCON_MAX_IOV];
+    struct msghdr _mh;
+    struct _thcon_msg* _t_msg;
+
+    while(1)
+	{
+	    /* take the next message from the send queue */
+	    if(peer->_out_msg == NULL && _thcon_peer_next(peer) == -1)
+			break;
+
+	    _cnt = _thcon_peer_iov(peer, _iov);
+	    if(_cnt == 0)
+		{
+		    _thcon_peer_done(peer);
+		    continue;
+		}
+
+	    /*
+	     * Gather queued messages behind the current one. Frames are
+	     * delimited by their headers, unframed messages are written one
+	     * at a time. The current message keeps the offset already sent.
+	     */
+	    _t_msg = peer->_out_msg;
+	    _t_off = peer->_out_off;
+	    for(i = 0; peer->_frm_flg && i < peer->_outq_cnt && _cnt + 2 <= THCON_MAX_IOV; i++)
+		{
+		    peer->_out_msg = peer->_outq[(peer->_outq_head + i) % peer->_outq_cap];
+		    peer->_out_off = 0;
+		    _cnt += _thcon_peer_iov(peer, _iov + _cnt);
+		}
+	    peer->_out_msg = _t_msg;
+	    peer->_out_off = _t_off;
+
+	    memset((void*) &_mh, 0, sizeof(struct msghdr));
+	    _mh.msg_iov = _iov;
+	    _mh.msg_iovlen = _cnt;
+	    _sent = sendmsg(peer->_fd, &_mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+	    if(_sent == -1)
+		{
+		    if(errno == EINTR)
+				continue;
+		    if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+			    if(!peer->_out_arm)
+					_thcon_peer_arm(obj, peer, 1);
+			    return 1;
+			}
+		    return -1;
+		}
+
+	    /* release the messages written completely */
+	    while(_sent > 0)
+		{
+		    _len = _thcon_peer_out_len(peer) - peer->_out_off;
+		    if((size_t) _sent < _len)
+			{
+			    peer->_out_off += (size_t) _sent;
+			    break;
+			}
+		    _sent -= (ssize_t) _len;
+		    _thcon_peer_done(peer);
+		    if(_sent == 0 || _thcon_peer_next(peer) == -1)
+				break;
+		}
+	}
+
+    if(peer->_out_arm)
+		_thcon_peer_arm(obj, peer, 0);
+
+    return 0;
+}
+
+/* Number of bytes of the current message on the wire, including its frame header */
+static size_t _thcon_peer_out_len(struct thcon_peer* peer)
+{
+    size_t _len;
+    uint32_t* _hdr;
+
+    _thcon_peer_enc(peer, peer->_out_msg, &_len, &_hdr);
+    return peer->_frm_flg? _len + THCON_FRAME_HDR_SZ : _len;
+}
+
+/*
+ * Add message to the send queue of the peer. If the queue is full the
+ * back pressure policy decides which messages are dropped, dropped
+ * messages are counted on the peer. Must be called with the descriptor
+ * mutex held. Returns -1 if the connection should be closed.
+ */
+static int _thcon_peer_push(thcon* obj, struct thcon_peer* peer, struct _thcon_msg* msg)
+{
+    unsigned int _cap;
+
+    /* allocate the queue on first use */
+    if(peer->_outq == NULL)
 	{
-	    _buff_sent += send(fd, ((char*) msg)+_buff_sent, sz, MSG_DONTWAIT | MSG_NOSIGNAL);
-	    if(_buff_sent == EPIPE)
+	    _cap = obj->var_outq_len > 0? obj->var_outq_len : THCON_DEF_SEND_QUEUE_LEN;
+	    peer->_outq = (struct _thcon_msg**) calloc(_cap, sizeof(struct _thcon_msg*));
+	    if(peer->_outq == NULL)
 			return -1;
-	}while(_buff_sent < sz);
+	    peer->_outq_cap = _cap;
+	    peer->_outq_head = 0;
+	    peer->_outq_cnt = 0;
+	}
 
-    return _buff_sent;
+    if(peer->_outq_cnt == peer->_outq_cap)
+	{
+	    switch(obj->var_bp_policy)
+		{
+		case thcon_bp_drop_newest:
+		    peer->_drop_cnt++;
+		    return 0;
+		case thcon_bp_coalesce:
+		    /* only the latest sample is of interest, release all queued */
+		    while(peer->_outq_cnt > 0)
+			{
+			    _thcon_msg_unref(peer->_outq[peer->_outq_head]);
+			    peer->_outq_head = (peer->_outq_head + 1) % peer->_outq_cap;
+			    peer->_outq_cnt--;
+			    peer->_drop_cnt++;
+			}
+		    break;
+		case thcon_bp_disconnect:
+		    peer->_drop_cnt++;
+		    return -1;
+		case thcon_bp_drop_oldest:
+		default:
+		    _thcon_msg_unref(peer->_outq[peer->_outq_head]);
+		    peer->_outq_head = (peer->_outq_head + 1) % peer->_outq_cap;
+		    peer->_outq_cnt--;
+		    peer->_drop_cnt++;
+		    break;
+		}
+	}
+
+    __atomic_add_fetch(&msg->_ref, 1, __ATOMIC_RELAXED);
+    peer->_outq[(peer->_outq_head + peer->_outq_cnt) % peer->_outq_cap] = msg;
+    peer->_outq_cnt++;
+    return 0;
 }
 
 /*
- * Thread function for handling the server side of the object.
- * All connections are handled in a single thread using epoll.
+ * Take the next message to write. The hello acknowledgement goes ahead
+ * of the send queue. Returns -1 if there is nothing to write.
  */
-static void* _thcon_thread_function_server(void* obj)
+static int _thcon_peer_next(struct thcon_peer* peer)
 {
-    /* counters */
-    int _i = 0, _n = 0, _old_state;
-    int _e_sock = 0;
-    int _stat = 0, _complete = 0;
-    thcon* _obj;
-    struct epoll_event _event, *_events = NULL;
-    char _err_msg[THOR_BUFF_SZ];
+    if(peer->_hs_ack)
+		peer->_out_msg = peer->_hs_ack;
+    else if(peer->_outq_cnt > 0)
+	{
+	    peer->_out_msg = peer->_outq[peer->_outq_head];
+	    peer->_outq_head = (peer->_outq_head + 1) % peer->_outq_cap;
+	    peer->_outq_cnt--;
+	}
+    else
+		return -1;
 
-    /* check for object pointer */
-    if(obj == NULL)
-		return NULL;
+    peer->_out_off = 0;
+    return 0;
+}
 
-    /* Initialise error buffer */
-    memset(_err_msg, 0, THOR_BUFF_SZ);
+/*
+ * Release the message written completely. Once the hello acknowledgement
+ * is on the wire the negotiated protocol and framing apply to the
+ * messages following it.
+ */
+static void _thcon_peer_done(struct thcon_peer* peer)
+{
+    if(peer->_out_msg == peer->_hs_ack)
+	{
+	    peer->_proto = peer->_hs_proto;
+	    peer->_frm_flg = peer->_hs_frm_flg;
+	    peer->_hs_ack = NULL;
+	}
+    else
+		peer->_sent_cnt++;
 
-    /* Thread clean up handler. */
-    pthread_cleanup_push(_thcon_thread_cleanup_server, obj);
+    _thcon_msg_unref(peer->_out_msg);
+    peer->_out_msg = NULL;
+    peer->_out_off = 0;
+    return;
+}
 
-    /* Disable thread cancelling temporarily */
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
+/*
+ * Pass message to all connections. The message is added to the send
+ * queue of each connection, which holds a reference until its written.
+ * Sockets are written without blocking, a connection which can not keep
+ * up does not hold up the others. Connections which failed are shut
+ * down, epoll reports the hang up and the server thread closes them.
+ * With more than one reactor, the reactors holding connections are
+ * woken to write the queues in their own threads. If the flush flag is
+ * not set, messages are only queued. Message may be NULL to flush the
+ * queues. Samples are decimated and reduced to the channels of
+ * subscribed connections, connections subscribed to the same channels
+ * share the subset record.
+ */
+static void _thcon_fanout(thcon* obj, struct _thcon_msg* msg, int flush)
+{
+    unsigned int i, j;
+    unsigned int _wake = 0;
+    unsigned int _sub_cnt = 0;
+    int _own;
+    unsigned int _sub_mask[THCON_SUB_CACHE];
+    uint64_t _one = 1;
+    unsigned long long _now = 0;
+    struct timespec _ts;
+    struct thcon_peer* _peer;
+    struct _thcon_msg* _push;
+    struct _thcon_msg* _sub[THCON_SUB_CACHE];
+
+    /* one datagram reaches all clients of the multicast group */
+    if(msg && msg->_seq > 0 && obj->_var_mc_sock != -1)
+		_thcon_mcast_send(obj, msg);
+    if(msg && msg->_seq > 0 && obj->_var_shm != NULL)
+		_thcon_shm_write(obj, msg);
+
+    if(msg && msg->_seq > 0)
+	{
+	    clock_gettime(CLOCK_MONOTONIC, &_ts);
+	    _now = (unsigned long long) _ts.tv_sec * 1000000ULL + (unsigned long long) _ts.tv_nsec / 1000ULL;
+	}
 
-    /* cast object pointer to the correct type */
-    _obj = (thcon*) obj;
+    pthread_mutex_lock(&obj->_var_mutex);
+    if(msg)
+		_thcon_hist_add(obj, msg);
+    for(i = 0; i < obj->var_num_conns; i++)
+	{
+	    _peer = _thcon_live_peer(obj, i);
+	    _push = msg;
+	    _own = 0;
 
-    /* create socket and bind */
-    if(_thcon_create_connection(_obj, thcon_mode_server))
-		return NULL;
+	    /* replies are only sent to their connection */
+	    if(msg && msg->_fd >= 0 && msg->_fd != _peer->_fd)
+			continue;
 
-    /* make socket non blocking */
-    if(_thcon_make_socket_nonblocking(_obj->var_con_sock))
-		goto listening_sock_exit;
+	    /* clients of the multicast group or shared memory are only sent replies */
+	    if(msg && msg->_seq > 0 && _peer->_nodata_flg)
+			continue;
+
+	    /* subscribed clients are sent samples no faster than requested */
+	    if(msg && msg->_seq > 0 && _peer->_sub_ival > 0)
+		{
+		    if(_peer->_sub_last > 0 && _now - _peer->_sub_last < _peer->_sub_ival)
+				continue;
+		    _peer->_sub_last = _now;
+		}
+
+	    if(msg && msg->_seq > 0 && msg->bin_memory && _peer->_sub_mask)
+		{
+		    for(j = 0; j < _sub_cnt && _sub_mask[j] != _peer->_sub_mask; j++);
+		    if(j < _sub_cnt)
+				_push = _sub[j];
+		    else if((_push = _thcon_msg_subset(msg, _peer->_sub_mask)) == NULL)
+				continue;
+		    else if(_sub_cnt < THCON_SUB_CACHE)
+			{
+			    _sub_mask[_sub_cnt] = _peer->_sub_mask;
+			    _sub[_sub_cnt++] = _push;
+			}
+		    else
+				_own = 1;
+		}
+
+	    if(_push && _thcon_peer_push(obj, _peer, _push))
+		{
+		    THOR_LOG_ERROR("send queue overflow, closing connection");
+		    shutdown(_peer->_fd, SHUT_RDWR);
+		    if(_own)
+				_thcon_msg_unref(_push);
+		    continue;
+		}
+
+	    /* queue holds its own reference */
+	    if(_own)
+			_thcon_msg_unref(_push);
+
+	    /*
+	     * If the socket is waiting to become writable, server thread continues.
+	     * Only framed connections are batched, unframed messages can not be
+	     * separated by the client.
+	     */
+	    if((!flush && _peer->_frm_flg) || _peer->_out_arm)
+			continue;
+
+	    if(obj->var_num_reactors > 1)
+		{
+		    _wake |= 1u << _peer->_reactor;
+		    continue;
+		}
+
+	    if(_thcon_peer_write(obj, _peer) == -1)
+			shutdown(_peer->_fd, SHUT_RDWR);
+	}
+    pthread_mutex_unlock(&obj->_var_mutex);
+
+    for(i = 0; _wake != 0 && i < obj->var_num_reactors; i++)
+	{
+	    if((_wake & (1u << i)) && obj->_var_reactors[i]._wake_fd != -1)
+			write(obj->_var_reactors[i]._wake_fd, &_one, sizeof(uint64_t));
+	}
+
+    for(j = 0; j < _sub_cnt; j++)
+		_thcon_msg_unref(_sub[j]);
+    return;
+}
+
+/*
+ * Encode subset record of a sample for subscribed connections. Subset
+ * records carry the sequence number of the sample, reference count is
+ * one.
+ */
+static struct _thcon_msg* _thcon_msg_subset(struct _thcon_msg* msg, unsigned int mask)
+{
+    int _sz;
+    struct _thcon_msg* _msg;
+
+    _msg = _thcon_msg_new(0, THORNIFIX_BIN_MSG_SZ + THORNIFIX_BIN_MASK_SZ, 0);
+    if(_msg == NULL)
+		return NULL;
+
+    _sz = thornifix_subset_msg_bin(msg->bin_memory, msg->bin_size, mask, _msg->bin_memory, _msg->bin_size);
+    if(_sz <= 0)
+	{
+	    _thcon_msg_unref(_msg);
+	    return NULL;
+	}
+
+    _msg->bin_size = (size_t) _sz;
+    _msg->bin_hdr = htole32((uint32_t) _sz);
+    _msg->_seq = msg->_seq;
+    return _msg;
+}
+
+/* Socket became writable, continue writing the pending message */
+static void _thcon_peer_flush(thcon* obj, int fd)
+{
+    pthread_mutex_lock(&obj->_var_mutex);
+    if(fd >= 0 && (unsigned int) fd < obj->_var_fd_map_sz && obj->_var_fd_map[fd] >= 0)
+	{
+	    if(_thcon_peer_write(obj, obj->_var_cons[obj->_var_fd_map[fd]]) == -1)
+			shutdown(fd, SHUT_RDWR);
+	}
+    pthread_mutex_unlock(&obj->_var_mutex);
+    return;
+}
+
+/*
+ * Create a ring of sz slots, sz is rounded up to a power of two.
+ * Each slot carries a sequence number which tells producers and
+ * consumers whether the slot is free or holds a message.
+ */
+static struct _thcon_ring* _thcon_ring_new(unsigned long sz)
+{
+    unsigned long i, _cap = 1;
+    struct _thcon_ring* _ring;
+
+    while(_cap < sz)
+		_cap <<= 1;
+
+    _ring = (struct _thcon_ring*) calloc(1, sizeof(struct _thcon_ring) + _cap * sizeof(struct _thcon_ring_slot));
+    if(_ring == NULL)
+		return NULL;
+
+    _ring->_mask = _cap - 1;
+    for(i = 0; i < _cap; i++)
+		_ring->_slots[i]._seq = i;
+
+    return _ring;
+}
+
+/*
+ * Add message to the ring without locking. Producers claim a slot by
+ * advancing the enqueue position, the message is published by storing
+ * the slot sequence. Returns -1 if the ring is full.
+ */
+static int _thcon_ring_push(struct _thcon_ring* ring, struct _thcon_msg* msg)
+{
+    unsigned long _pos, _seq;
+    long _diff;
+    struct _thcon_ring_slot* _slot;
+
+    _pos = __atomic_load_n(&ring->_enq, __ATOMIC_RELAXED);
+    while(1)
+	{
+	    _slot = &ring->_slots[_pos & ring->_mask];
+	    _seq = __atomic_load_n(&_slot->_seq, __ATOMIC_ACQUIRE);
+	    _diff = (long) _seq - (long) _pos;
+	    if(_diff == 0)
+		{
+		    if(__atomic_compare_exchange_n(&ring->_enq, &_pos, _pos + 1, 1,
+										   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+	    else if(_diff < 0)
+			return -1;
+	    else
+			_pos = __atomic_load_n(&ring->_enq, __ATOMIC_RELAXED);
+	}
+
+    _slot->_msg = msg;
+    __atomic_store_n(&_slot->_seq, _pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Take the oldest message from the ring, returns NULL if its empty */
+static struct _thcon_msg* _thcon_ring_pop(struct _thcon_ring* ring)
+{
+    unsigned long _pos, _seq;
+    long _diff;
+    struct _thcon_ring_slot* _slot;
+    struct _thcon_msg* _msg;
+
+    _pos = __atomic_load_n(&ring->_deq, __ATOMIC_RELAXED);
+    while(1)
+	{
+	    _slot = &ring->_slots[_pos & ring->_mask];
+	    _seq = __atomic_load_n(&_slot->_seq, __ATOMIC_ACQUIRE);
+	    _diff = (long) _seq - (long) (_pos + 1);
+	    if(_diff == 0)
+		{
+		    if(__atomic_compare_exchange_n(&ring->_deq, &_pos, _pos + 1, 1,
+										   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+	    else if(_diff < 0)
+			return NULL;
+	    else
+			_pos = __atomic_load_n(&ring->_deq, __ATOMIC_RELAXED);
+	}
+
+    _msg = _slot->_msg;
+    __atomic_store_n(&_slot->_seq, _pos + ring->_mask + 1, __ATOMIC_RELEASE);
+    return _msg;
+}
+
+/* Release messages left in the ring and free it */
+static void _thcon_ring_free(struct _thcon_ring* ring, int pool_flg)
+{
+    struct _thcon_msg* _msg;
+
+    if(ring == NULL)
+		return;
+
+    while((_msg = _thcon_ring_pop(ring)) != NULL)
+	{
+	    if(pool_flg)
+			free(_msg);
+	    else
+			_thcon_msg_unref(_msg);
+	}
+    free(ring);
+    return;
+}
+
+/*
+ * Queue message for the writer thread. The writer is only woken if it
+ * was waiting on an empty ring. Returns -1 if the ring is full.
+ */
+static int _thcon_enqueue(thcon* obj, struct _thcon_msg* msg)
+{
+    uint64_t _one = 1;
+
+    if(obj->_var_ring == NULL || _thcon_ring_push(obj->_var_ring, msg))
+	{
+	    THOR_LOG_ERROR("outbound message ring is full, message dropped");
+	    _thcon_msg_unref(msg);
+	    return -1;
+	}
+
+    /* ordered against the idle flag set by the writer before it blocks */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_exchange_n(&obj->_var_ring_idle, 0, __ATOMIC_SEQ_CST))
+		write(obj->_var_ring_fd, &_one, sizeof(uint64_t));
+
+    return 0;
+}
+
+/*
+ * Take a message for the thor message struct from the pool, a new one
+ * is allocated if the pool is empty. Messages are returned to the pool
+ * when the last reference is released.
+ */
+static struct _thcon_msg* _thcon_msg_get(thcon* obj)
+{
+    struct _thcon_msg* _msg = NULL;
+
+    if(obj->_var_pool)
+		_msg = _thcon_ring_pop(obj->_var_pool);
+    if(_msg == NULL)
+	{
+	    _msg = _thcon_msg_new(THORINIFIX_MSG_SZ, THORNIFIX_BIN_MSG_SZ, THORNIFIX_BIN_MSG_SZ);
+	    if(_msg == NULL)
+			return NULL;
+	}
+
+    _msg->_ref = 1;
+    _msg->_seq = 0;
+    _msg->_fd = -1;
+    _msg->_pool = obj->_var_pool;
+    _msg->bin_memory = _msg->memory + THORINIFIX_MSG_SZ;
+    _msg->delta_memory = NULL;
+    return _msg;
+}
+
+/*
+ * Add message to the history. Only sequenced messages are kept, when
+ * the history is full the oldest is released. Must be called with the
+ * descriptor mutex held.
+ */
+static void _thcon_hist_add(thcon* obj, struct _thcon_msg* msg)
+{
+    if(msg->_seq == 0 || obj->var_hist_len == 0)
+		return;
+
+    /* allocate the history on first use */
+    if(obj->_var_hist == NULL)
+	{
+	    obj->_var_hist = (struct _thcon_msg**) calloc(obj->var_hist_len, sizeof(struct _thcon_msg*));
+	    if(obj->_var_hist == NULL)
+			return;
+	    obj->_var_hist_cap = obj->var_hist_len;
+	    obj->_var_hist_head = 0;
+	    obj->_var_hist_cnt = 0;
+	}
+
+    if(obj->_var_hist_cnt == obj->_var_hist_cap)
+	{
+	    _thcon_msg_unref(obj->_var_hist[obj->_var_hist_head]);
+	    obj->_var_hist_head = (obj->_var_hist_head + 1) % obj->_var_hist_cap;
+	    obj->_var_hist_cnt--;
+	}
+
+    __atomic_add_fetch(&msg->_ref, 1, __ATOMIC_RELAXED);
+    obj->_var_hist[(obj->_var_hist_head + obj->_var_hist_cnt) % obj->_var_hist_cap] = msg;
+    obj->_var_hist_cnt++;
+    return;
+}
+
+/*
+ * Queue messages of the history with a sequence number greater than seq
+ * on the peer. Sequenced messages queued before the resume request are
+ * part of the history and are released first, so that the client
+ * recieves them once and in order. Must be called with the descriptor
+ * mutex held.
+ */
+static void _thcon_hist_replay(thcon* obj, struct thcon_peer* peer, unsigned long long seq)
+{
+    unsigned int i, _cnt;
+    struct _thcon_msg* _msg;
+
+    for(i = 0, _cnt = peer->_outq_cnt; i < _cnt; i++)
+	{
+	    _msg = peer->_outq[peer->_outq_head];
+	    peer->_outq_head = (peer->_outq_head + 1) % peer->_outq_cap;
+	    peer->_outq_cnt--;
+	    if(_msg->_seq == 0)
+		{
+		    peer->_outq[(peer->_outq_head + peer->_outq_cnt) % peer->_outq_cap] = _msg;
+		    peer->_outq_cnt++;
+		}
+	    else
+			_thcon_msg_unref(_msg);
+	}
+
+    for(i = 0; i < obj->_var_hist_cnt; i++)
+	{
+	    _msg = obj->_var_hist[(obj->_var_hist_head + i) % obj->_var_hist_cap];
+	    if(_msg->_seq <= seq)
+			continue;
+	    if(_thcon_peer_push(obj, peer, _msg))
+			break;
+	}
+
+    if(!peer->_out_arm && _thcon_peer_write(obj, peer) == -1)
+		shutdown(peer->_fd, SHUT_RDWR);
+    return;
+}
+
+/* Release messages of the history */
+static void _thcon_hist_free(thcon* obj)
+{
+    while(obj->_var_hist_cnt > 0)
+	{
+	    _thcon_msg_unref(obj->_var_hist[obj->_var_hist_head]);
+	    obj->_var_hist_head = (obj->_var_hist_head + 1) % obj->_var_hist_cap;
+	    obj->_var_hist_cnt--;
+	}
+    if(obj->_var_hist)
+		free(obj->_var_hist);
+    obj->_var_hist = NULL;
+    obj->_var_hist_head = 0;
+    obj->_var_hist_cap = 0;
+    return;
+}
+
+/*
+ * Create the socket of the multicast data plane. Server sends to the
+ * group, datagrams stay on the local network. If the address is not a
+ * multicast group its treated as a broadcast address. Client binds the
+ * port and joins the group. Returns -1 if the socket was not created.
+ */
+static int _thcon_mcast_open(thcon* obj)
+{
+    int _opt_val = 1;
+    unsigned char _ttl = THCON_MCAST_TTL;
+    unsigned char _loop = 1;
+    struct ip_mreq _mreq;
+    struct sockaddr_in _bind_addr;
+
+    _thcon_mcast_close(obj);
+    memset(&obj->_var_mc_addr, 0, sizeof(struct sockaddr_in));
+    obj->_var_mc_addr.sin_family = AF_INET;
+    obj->_var_mc_addr.sin_port = htons((uint16_t) atoi(obj->var_mc_port));
+    if(obj->_var_mc_addr.sin_port == 0 ||
+       inet_aton(obj->var_mc_group, &obj->_var_mc_addr.sin_addr) == 0)
+	{
+	    THOR_LOG_ERROR("invalid multicast group or port");
+	    return -1;
+	}
+
+    if((obj->_var_mc_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+	{
+	    obj->_var_mc_sock = -1;
+	    THOR_LOG_ERROR("unable to create multicast socket");
+	    return -1;
+	}
+
+    if(obj->_var_con_mode == thcon_mode_server)
+	{
+	    if(IN_MULTICAST(ntohl(obj->_var_mc_addr.sin_addr.s_addr)))
+		{
+		    setsockopt(obj->_var_mc_sock, IPPROTO_IP, IP_MULTICAST_TTL, &_ttl, sizeof(_ttl));
+		    setsockopt(obj->_var_mc_sock, IPPROTO_IP, IP_MULTICAST_LOOP, &_loop, sizeof(_loop));
+		}
+	    else if(setsockopt(obj->_var_mc_sock, SOL_SOCKET, SO_BROADCAST, &_opt_val, sizeof(int)) < 0)
+		{
+		    THOR_LOG_ERROR("unable to enable broadcast on multicast socket");
+		    _thcon_mcast_close(obj);
+		    return -1;
+		}
+	    return 0;
+	}
+
+    /* several clients on the same host may join the group */
+    setsockopt(obj->_var_mc_sock, SOL_SOCKET, SO_REUSEADDR, &_opt_val, sizeof(int));
+
+    memset(&_bind_addr, 0, sizeof(struct sockaddr_in));
+    _bind_addr.sin_family = AF_INET;
+    _bind_addr.sin_port = obj->_var_mc_addr.sin_port;
+    _bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(bind(obj->_var_mc_sock, (struct sockaddr*) &_bind_addr, sizeof(struct sockaddr_in)) < 0)
+	{
+	    THOR_LOG_ERROR("unable to bind multicast socket");
+	    _thcon_mcast_close(obj);
+	    return -1;
+	}
+
+    if(IN_MULTICAST(ntohl(obj->_var_mc_addr.sin_addr.s_addr)))
+	{
+	    _mreq.imr_multiaddr = obj->_var_mc_addr.sin_addr;
+	    _mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	    if(setsockopt(obj->_var_mc_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &_mreq, sizeof(_mreq)) < 0)
+		{
+		    THOR_LOG_ERROR("unable to join multicast group");
+		    _thcon_mcast_close(obj);
+		    return -1;
+		}
+	}
+
+    if(_thcon_make_socket_nonblocking(obj->_var_mc_sock))
+	{
+	    _thcon_mcast_close(obj);
+	    return -1;
+	}
+    obj->_var_mc_gaps = 0;
+    return 0;
+}
+
+/* Close socket of the multicast data plane */
+static void _thcon_mcast_close(thcon* obj)
+{
+    if(obj->_var_mc_sock != -1)
+		close(obj->_var_mc_sock);
+    obj->_var_mc_sock = -1;
+    return;
+}
+
+/*
+ * Send binary encoding of the message to the group. Datagrams are not
+ * retried, clients detect the missing sequence numbers.
+ */
+static void _thcon_mcast_send(thcon* obj, struct _thcon_msg* msg)
+{
+    if(msg->bin_memory == NULL || msg->bin_size == 0)
+		return;
+
+    if(sendto(obj->_var_mc_sock,
+	      msg->bin_memory,
+	      msg->bin_size,
+	      MSG_DONTWAIT,
+	      (struct sockaddr*) &obj->_var_mc_addr,
+	      sizeof(struct sockaddr_in)) < 0 &&
+       errno != EAGAIN && errno != EWOULDBLOCK)
+		THOR_LOG_ERROR("unable to send multicast message");
+    return;
+}
+
+/*
+ * Read pending datagrams of the group. Messages older than the last
+ * sequence number were already recieved and are discarded, unless they
+ * are old enough to indicate the server restarted. Messages skipped
+ * are added to the gap count.
+ */
+static void _thcon_mcast_recv(thcon* obj)
+{
+    char _buff[THCON_MCAST_BUFF_SZ + 1];
+    ssize_t _sz;
+    uint64_t _t;
+    unsigned long long _seq;
+
+    while((_sz = recv(obj->_var_mc_sock, _buff, THCON_MCAST_BUFF_SZ, 0)) > 0)
+	{
+	    if(!thornifix_is_bin_msg(_buff, (size_t) _sz))
+			continue;
+
+	    memcpy(&_t, _buff + 8, sizeof(uint64_t));
+	    _seq = (unsigned long long) le64toh(_t);
+	    if(obj->_var_last_seq > 0)
+		{
+		    if(_seq <= obj->_var_last_seq &&
+		       obj->_var_last_seq - _seq < THCON_MCAST_REORDER_WIN)
+				continue;
+		    if(_seq > obj->_var_last_seq + 1)
+				obj->_var_mc_gaps += _seq - obj->_var_last_seq - 1;
+		}
+	    obj->_var_last_seq = _seq;
+
+	    if(obj->_thcon_recv_callback == NULL)
+			continue;
+
+	    _buff[_sz] = '\0';
+	    pthread_mutex_lock(&obj->_var_mutex_cb);
+	    obj->_var_act_sock = obj->_var_mc_sock;
+	    obj->_thcon_recv_callback(obj->_ext_obj, _buff, (size_t) _sz);
+	    pthread_mutex_unlock(&obj->_var_mutex_cb);
+	}
+    return;
+}
+
+/*
+ * Create or map the shared memory object. Server creates the object
+ * sized for the history length and initialises the header, the magic
+ * is set last. Clients map it read only and check the header, the
+ * mapping is retried on read if the server was not running.
+ */
+static int _thcon_shm_open(thcon* obj)
+{
+    int _fd;
+    unsigned int _cnt;
+    struct stat _st;
+    struct _thcon_shm* _shm;
+
+    _thcon_shm_close(obj);
+    if(obj->_var_con_mode == thcon_mode_server)
+	{
+	    _cnt = obj->var_hist_len > 0? obj->var_hist_len : 1;
+	    obj->_var_shm_sz = sizeof(struct _thcon_shm) + _cnt * sizeof(struct _thcon_shm_slot);
+
+	    shm_unlink(obj->var_shm_name);
+	    _fd = shm_open(obj->var_shm_name, O_CREAT | O_RDWR, 0644);
+	    if(_fd == -1 || ftruncate(_fd, (off_t) obj->_var_shm_sz) == -1)
+		{
+		    THOR_LOG_ERROR("unable to create shared memory");
+		    if(_fd != -1)
+			close(_fd);
+		    return -1;
+		}
+
+	    _shm = (struct _thcon_shm*) mmap(NULL, obj->_var_shm_sz, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	    close(_fd);
+	    if(_shm == MAP_FAILED)
+		{
+		    THOR_LOG_ERROR("unable to map shared memory");
+		    return -1;
+		}
+
+	    /* memory of a new object is zero */
+	    _shm->_version = THCON_SHM_VERSION;
+	    _shm->_slot_cnt = _cnt;
+	    _shm->_slot_sz = (uint32_t) sizeof(struct _thcon_shm_slot);
+	    __atomic_store_n(&_shm->_magic, THCON_SHM_MAGIC, __ATOMIC_RELEASE);
+	    obj->_var_shm = _shm;
+	    return 0;
+	}
+
+    _fd = shm_open(obj->var_shm_name, O_RDONLY, 0);
+    if(_fd == -1)
+		return -1;
+    if(fstat(_fd, &_st) == -1 || (size_t) _st.st_size < sizeof(struct _thcon_shm))
+	{
+	    close(_fd);
+	    return -1;
+	}
+
+    _shm = (struct _thcon_shm*) mmap(NULL, (size_t) _st.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+    close(_fd);
+    if(_shm == MAP_FAILED)
+		return -1;
+
+    if(__atomic_load_n(&_shm->_magic, __ATOMIC_ACQUIRE) != THCON_SHM_MAGIC ||
+       _shm->_version != THCON_SHM_VERSION ||
+       _shm->_slot_sz != sizeof(struct _thcon_shm_slot) ||
+       sizeof(struct _thcon_shm) + (size_t) _shm->_slot_cnt * _shm->_slot_sz > (size_t) _st.st_size)
+	{
+	    munmap((void*) _shm, (size_t) _st.st_size);
+	    return -1;
+	}
+
+    obj->_var_shm = _shm;
+    obj->_var_shm_sz = (size_t) _st.st_size;
+    return 0;
+}
+
+/*
+ * Unmap the shared memory. Server clears the magic so that mapped
+ * clients know to map the object again and removes the object.
+ */
+static void _thcon_shm_close(thcon* obj)
+{
+    if(obj->_var_shm == NULL)
+		return;
+
+    if(obj->_var_con_mode == thcon_mode_server)
+	{
+	    __atomic_store_n(&obj->_var_shm->_magic, 0, __ATOMIC_RELEASE);
+	    shm_unlink(obj->var_shm_name);
+	}
+    munmap((void*) obj->_var_shm, obj->_var_shm_sz);
+    obj->_var_shm = NULL;
+    obj->_var_shm_sz = 0;
+    return;
+}
+
+/*
+ * Write binary encoding of the message to its slot. Only the writer
+ * thread writes sequenced messages.
+ */
+static void _thcon_shm_write(thcon* obj, struct _thcon_msg* msg)
+{
+    uint32_t _lock;
+    struct _thcon_shm_slot* _slot;
+
+    if(msg->bin_memory == NULL || msg->bin_size > THORNIFIX_BIN_MSG_SZ)
+		return;
+
+    _slot = &obj->_var_shm->_slots[msg->_seq % obj->_var_shm->_slot_cnt];
+    _lock = _slot->_lock;
+    __atomic_store_n(&_slot->_lock, _lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(_slot->_data, msg->bin_memory, msg->bin_size);
+    _slot->_size = (uint32_t) msg->bin_size;
+    _slot->_seq = (uint64_t) msg->_seq;
+
+    __atomic_store_n(&_slot->_lock, _lock + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&obj->_var_shm->_head, (uint64_t) msg->_seq, __ATOMIC_RELEASE);
+    return;
+}
+
+/*
+ * Copy slot to the buffer. Copy is retried while the server writes
+ * the slot. Returns the size of the message, or -1 if the buffer was
+ * too small or the slot was not stable.
+ */
+static int _thcon_shm_copy(const struct _thcon_shm_slot* slot, void* buff, size_t sz, unsigned long long* seq)
+{
+    int i;
+    uint32_t _lock, _size;
+
+    for(i = 0; i < THCON_SHM_READ_TRIES; i++)
+	{
+	    _lock = __atomic_load_n(&slot->_lock, __ATOMIC_ACQUIRE);
+	    if(_lock & 1)
+			continue;
+
+	    _size = slot->_size;
+	    if(_size > THORNIFIX_BIN_MSG_SZ)
+			continue;
+	    *seq = (unsigned long long) slot->_seq;
+	    memcpy(buff, slot->_data, _size < sz? _size : sz);
+
+	    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	    if(__atomic_load_n(&slot->_lock, __ATOMIC_RELAXED) != _lock)
+			continue;
+
+	    return _size <= sz? (int) _size : -1;
+	}
+
+    return -1;
+}
+
+/* Send hello packet to the server */
+static int _thcon_send_hello(thcon* obj)
+{
+    char _hello[THCON_HELLO_SZ + THCON_HELLO_RESUME_SZ];
+    uint64_t _seq;
+    size_t _sz = THCON_HELLO_SZ;
+
+    memset(_hello, 0, THCON_HELLO_SZ + THCON_HELLO_RESUME_SZ);
+    memcpy(_hello, THCON_HELLO_MAGIC, THCON_HELLO_MAGIC_SZ);
+    _hello[4] = THCON_HELLO_VERSION;
+    _hello[5] = (char) obj->var_proto;
+    _hello[6] = obj->var_frm_flg? THCON_HELLO_FLG_FRAMED : 0;
+    if(obj->_var_mc_sock != -1 || obj->_var_shm != NULL)
+		_hello[6] |= THCON_HELLO_FLG_NODATA;
+
+    /*
+     * Sequence numbers are only recieved in framed binary messages,
+     * if one was recieved ask the server to resume after it.
+     */
+    if(THCON_PROTO_BIN(obj->var_proto) && obj->var_frm_flg && obj->_var_last_seq > 0)
+	{
+	    _hello[6] |= THCON_HELLO_FLG_RESUME;
+	    _seq = htole64((uint64_t) obj->_var_last_seq);
+	    memcpy(_hello + THCON_HELLO_SZ, &_seq, THCON_HELLO_RESUME_SZ);
+	    _sz += THCON_HELLO_RESUME_SZ;
+	}
+
+    return _thcon_send_info(obj->var_acc_sock, _hello, _sz);
+}
+
+/* Send subscription to the server */
+static int _thcon_send_sub(thcon* obj)
+{
+    char _sub[THCON_SUB_SZ];
+    uint32_t _val;
+
+    memcpy(_sub, THCON_SUB_MAGIC, THCON_SUB_MAGIC_SZ);
+    _val = htole32((uint32_t) obj->var_sub_mask);
+    memcpy(_sub + THCON_SUB_MAGIC_SZ, &_val, sizeof(uint32_t));
+    _val = htole32((uint32_t) obj->var_sub_ival);
+    memcpy(_sub + THCON_SUB_MAGIC_SZ + sizeof(uint32_t), &_val, sizeof(uint32_t));
+
+    return _thcon_send_peer(&obj->_var_svr_peer, _sub, THCON_SUB_SZ);
+}
+
+/* Record subscription of the peer, takes effect from the next sample */
+static void _thcon_peer_sub(thcon* obj, struct thcon_peer* peer, const char* msg)
+{
+    uint32_t _mask, _ival;
+
+    memcpy(&_mask, msg + THCON_SUB_MAGIC_SZ, sizeof(uint32_t));
+    memcpy(&_ival, msg + THCON_SUB_MAGIC_SZ + sizeof(uint32_t), sizeof(uint32_t));
+    thcon_set_peer_sub(obj, peer->_fd, (unsigned int) le32toh(_mask), (unsigned int) le32toh(_ival));
+    return;
+}
+
+/* Find the peer of the socket */
+static struct thcon_peer* _thcon_find_peer(thcon* obj, int fd)
+{
+    struct thcon_peer* _peer = NULL;
+
+    pthread_mutex_lock(&obj->_var_mutex);
+    if(fd >= 0 && (unsigned int) fd < obj->_var_fd_map_sz && obj->_var_fd_map[fd] >= 0)
+		_peer = obj->_var_cons[obj->_var_fd_map[fd]];
+    pthread_mutex_unlock(&obj->_var_mutex);
+    return _peer;
+}
+
+/* Free the buffers of the peer */
+static void _thcon_peer_free(struct thcon_peer* peer)
+{
+    if(peer->_rbuff)
+		free(peer->_rbuff);
+    peer->_rbuff = NULL;
+    peer->_rbuff_off = 0;
+
+    /* release the message being written and the send queue */
+    if(peer->_hs_ack != peer->_out_msg)
+		_thcon_msg_unref(peer->_hs_ack);
+    peer->_hs_ack = NULL;
+    _thcon_msg_unref(peer->_out_msg);
+    peer->_out_msg = NULL;
+    peer->_out_off = 0;
+    while(peer->_outq_cnt > 0)
+	{
+	    _thcon_msg_unref(peer->_outq[peer->_outq_head]);
+	    peer->_outq_head = (peer->_outq_head + 1) % peer->_outq_cap;
+	    peer->_outq_cnt--;
+	}
+    if(peer->_outq)
+		free(peer->_outq);
+    peer->_outq = NULL;
+    peer->_outq_cap = 0;
+    peer->_outq_head = 0;
+    peer->_rbuff_len = 0;
+    peer->_rbuff_cap = 0;
+    return;
+}
+
+/*
+ * Make room for at least sz bytes after the pending bytes of the
+ * receive buffer. Consumed space at the head of the buffer is reclaimed
+ * first, the buffer is only grown if that is not enough. One byte is
+ * reserved for terminating messages passed to the callback.
+ */
+static int _thcon_peer_reserve(thcon* obj, struct thcon_peer* peer, size_t sz)
+{
+    size_t _cap;
+    char* _t_buff;
+
+    /* allocate the buffer on first use */
+    if(peer->_rbuff == NULL)
+	{
+	    _cap = obj->var_rbuff_sz > THCON_MIN_RBUFF_SZ? obj->var_rbuff_sz : THCON_MIN_RBUFF_SZ;
+	    peer->_rbuff = (char*) malloc(sizeof(char) * _cap);
+	    if(peer->_rbuff == NULL)
+			return -1;
+	    peer->_rbuff_off = 0;
+	    peer->_rbuff_len = 0;
+	    peer->_rbuff_cap = _cap;
+	}
+
+    if(peer->_rbuff_off + peer->_rbuff_len + sz + 1 <= peer->_rbuff_cap)
+		return 0;
+
+    /* move pending bytes to the start of the buffer */
+    if(peer->_rbuff_off > 0)
+	{
+	    memmove(peer->_rbuff, peer->_rbuff + peer->_rbuff_off, peer->_rbuff_len);
+	    peer->_rbuff_off = 0;
+	    if(peer->_rbuff_len + sz + 1 <= peer->_rbuff_cap)
+			return 0;
+	}
+
+    _cap = peer->_rbuff_cap;
+    while(_cap < peer->_rbuff_len + sz + 1)
+		_cap += _cap;
+
+    _t_buff = (char*) realloc(peer->_rbuff, _cap);
+    if(_t_buff == NULL)
+		return -1;
+    peer->_rbuff = _t_buff;
+    peer->_rbuff_cap = _cap;
+    return 0;
+}
+
+/*
+ * Read bytes available on the socket into the receive buffer of the
+ * peer. Returns the number of bytes read, 0 if the connection was
+ * closed and -1 on error, errno is set by read.
+ */
+static int _thcon_peer_read(thcon* obj, struct thcon_peer* peer)
+{
+    ssize_t _sz;
+
+    if(_thcon_peer_reserve(obj, peer, THCON_MIN_RBUFF_SZ/2))
+		return -1;
+
+    _sz = read(peer->_fd,
+			   peer->_rbuff + peer->_rbuff_off + peer->_rbuff_len,
+			   peer->_rbuff_cap - peer->_rbuff_off - peer->_rbuff_len - 1);
+    if(_sz > 0)
+		peer->_rbuff_len += (size_t) _sz;
+
+    return (int) _sz;
+}
+
+/*
+ * Call recv callback with a message from the reassembly buffer.
+ * The message is null terminated for the duration of the call as
+ * the callbacks may treat text messages as strings.
+ */
+static void _thcon_peer_deliver(thcon* obj, struct thcon_peer* peer, char* msg, size_t sz)
+{
+    char _t;
+    uint64_t _seq;
+
+    /* subscriptions are handled by the server, not passed on */
+    if(obj->_var_con_mode == thcon_mode_server && peer->_hs_frm_flg &&
+       peer->_hs_proto == thcon_proto_bin && sz == THCON_SUB_SZ &&
+       memcmp(msg, THCON_SUB_MAGIC, THCON_SUB_MAGIC_SZ) == 0)
+	{
+	    _thcon_peer_sub(obj, peer, msg);
+	    return;
+	}
+
+    if(obj->_thcon_recv_callback == NULL || sz == 0)
+		return;
+
+    /* record the sequence number to resume from after reconnecting */
+    if(obj->_var_con_mode == thcon_mode_client && peer->_hs_frm_flg &&
+       THCON_PROTO_BIN(peer->_hs_proto) && thornifix_is_bin_msg(msg, sz))
+	{
+	    memcpy(&_seq, msg + 8, sizeof(uint64_t));
+	    obj->_var_last_seq = (unsigned long long) le64toh(_seq);
+	}
+
+    _t = msg[sz];
+    msg[sz] = '\0';
+
+    /* callbacks are not called concurrently by the reactors */
+    pthread_mutex_lock(&obj->_var_mutex_cb);
+    obj->_var_act_sock = peer->_fd;
+    obj->_thcon_recv_callback(obj->_ext_obj, msg, sz);
+    pthread_mutex_unlock(&obj->_var_mutex_cb);
+    msg[sz] = _t;
+    return;
+}
+
+/*
+ * Handle the hello packet on the server side. First bytes of a
+ * connection are checked, if its a hello the protocol is recorded and
+ * the acknowledgement is queued ahead of the send queue. The message
+ * being written is completed in the old format, protocol and framing
+ * are switched by the writer once the acknowledgement is on the wire.
+ * Returns the number of bytes consumed, or -1 if more bytes are required.
+ */
+static int _thcon_peer_hello_svr(thcon* obj, struct thcon_peer* peer)
+{
+    int _rt = 0;
+    char* _data = peer->_rbuff + peer->_rbuff_off;
+    char* _ack;
+    size_t _cmp_sz;
+    uint64_t _seq = 0;
+    thcon_proto _proto;
+
+    /* wait for the remainder of a partial hello */
+    _cmp_sz = peer->_rbuff_len < THCON_HELLO_MAGIC_SZ? peer->_rbuff_len : THCON_HELLO_MAGIC_SZ;
+    if(peer->_rbuff_len < THCON_HELLO_SZ && memcmp(_data, THCON_HELLO_MAGIC, _cmp_sz) == 0)
+		return -1;
+    if(peer->_rbuff_len < THCON_HELLO_SZ + THCON_HELLO_RESUME_SZ &&
+       memcmp(_data, THCON_HELLO_MAGIC, THCON_HELLO_MAGIC_SZ) == 0 &&
+       (_data[6] & THCON_HELLO_FLG_RESUME))
+		return -1;
+
+    pthread_mutex_lock(&obj->_var_mutex);
+    if(peer->_rbuff_len >= THCON_HELLO_SZ &&
+       memcmp(_data, THCON_HELLO_MAGIC, THCON_HELLO_MAGIC_SZ) == 0)
+	{
+	    /* unknown protocols are served the text format, delta the binary if its not served */
+	    if(_data[5] == (char) thcon_proto_delta && obj->var_delta_flg)
+		{
+		    _proto = thcon_proto_delta;
+		    __atomic_store_n(&obj->_var_delta_key, 1, __ATOMIC_RELEASE);
+		}
+	    else if(THCON_PROTO_BIN(_data[5]))
+			_proto = thcon_proto_bin;
+	    else
+			_proto = thcon_proto_text;
+
+	    /* samples are only withheld if they are published to the group or shared memory */
+	    peer->_nodata_flg = (_data[6] & THCON_HELLO_FLG_NODATA) &&
+			(obj->_var_mc_sock != -1 || obj->_var_shm != NULL)? 1 : 0;
+
+	    _rt = THCON_HELLO_SZ;
+	    if(peer->_hs_ack == NULL)
+			peer->_hs_ack = _thcon_msg_new(THCON_HELLO_SZ, 0, 0);
+	    if(peer->_hs_ack == NULL)
+		{
+		    THOR_LOG_ERROR("unable to allocate hello acknowledgement");
+		    peer->_hs_flg = 1;
+		    pthread_mutex_unlock(&obj->_var_mutex);
+		    shutdown(peer->_fd, SHUT_RDWR);
+		    return _rt;
+		}
+
+	    _ack = peer->_hs_ack->memory;
+	    memcpy(_ack, _data, THCON_HELLO_SZ);
+	    _ack[4] = THCON_HELLO_VERSION;
+	    _ack[5] = (char) _proto;
+	    if(!peer->_nodata_flg)
+			_ack[6] &= (char) ~THCON_HELLO_FLG_NODATA;
+	    peer->_hs_proto = _proto;
+	    peer->_hs_frm_flg = (_data[6] & THCON_HELLO_FLG_FRAMED)? 1 : 0;
+
+	    /* replay messages the client missed while it was disconnected */
+	    if(_data[6] & THCON_HELLO_FLG_RESUME)
+		{
+		    memcpy(&_seq, _data + THCON_HELLO_SZ, THCON_HELLO_RESUME_SZ);
+		    _thcon_hist_replay(obj, peer, (unsigned long long) le64toh(_seq));
+		    _rt += THCON_HELLO_RESUME_SZ;
+		}
+
+	    if(!peer->_out_arm && _thcon_peer_write(obj, peer) == -1)
+			shutdown(peer->_fd, SHUT_RDWR);
+	}
+    peer->_hs_flg = 1;
+    pthread_mutex_unlock(&obj->_var_mutex);
+
+    return _rt;
+}
+
+/*
+ * Handle the hello acknowledgement on the client side. Until the server
+ * acknowledges, messages are delivered as they were read. Returns the
+ * number of bytes consumed.
+ */
+static int _thcon_peer_hello_cli(thcon* obj, struct thcon_peer* peer)
+{
+    size_t _pos, _keep;
+    char* _ack = NULL;
+    char* _data = peer->_rbuff + peer->_rbuff_off;
+
+    /* search for the magic of the acknowledgement */
+    for(_pos = 0; _pos + THCON_HELLO_MAGIC_SZ <= peer->_rbuff_len; _pos++)
+	{
+	    if(memcmp(_data + _pos, THCON_HELLO_MAGIC, THCON_HELLO_MAGIC_SZ) == 0)
+		{
+		    _ack = _data + _pos;
+		    break;
+		}
+	}
+
+    if(_ack == NULL)
+	{
+	    /* hold back trailing bytes which may be the start of the acknowledgement */
+	    for(_keep = THCON_HELLO_MAGIC_SZ-1; _keep > 0; _keep--)
+		{
+		    if(_keep <= peer->_rbuff_len &&
+		       memcmp(_data + peer->_rbuff_len - _keep, THCON_HELLO_MAGIC, _keep) == 0)
+				break;
+		}
+	    _thcon_peer_deliver(obj, peer, _data, peer->_rbuff_len - _keep);
+	    return (int) (peer->_rbuff_len - _keep);
+	}
+
+    /* messages sent before the acknowledgement are not framed */
+    _pos = (size_t) (_ack - _data);
+    _thcon_peer_deliver(obj, peer, _data, _pos);
+    if(peer->_rbuff_len - _pos < THCON_HELLO_SZ)
+		return (int) _pos;
+
+    peer->_proto = (thcon_proto) _ack[5];
+    peer->_frm_flg = (_ack[6] & THCON_HELLO_FLG_FRAMED)? 1 : 0;
+    peer->_hs_proto = peer->_proto;
+    peer->_hs_frm_flg = peer->_frm_flg;
+    peer->_hs_flg = 1;
+    return (int) (_pos + THCON_HELLO_SZ);
+}
+
+/*
+ * Process bytes pending in the receive buffer of the connection. Every
+ * complete message is passed to the recv callback. Connections not using
+ * framing have all pending bytes passed in a single call. Returns -1 if
+ * the connection violated the protocol.
+ */
+static int _thcon_peer_recv(thcon* obj, struct thcon_peer* peer)
+{
+    int _rt = 0, _stat;
+    size_t _pos = 0;
+    uint32_t _flen;
+    char* _data = peer->_rbuff + peer->_rbuff_off;
+
+    /* handle hello packet and its acknowledgement */
+    if(!peer->_hs_flg)
+	{
+	    if(obj->_var_con_mode == thcon_mode_server)
+			_stat = _thcon_peer_hello_svr(obj, peer);
+	    else
+			_stat = _thcon_peer_hello_cli(obj, peer);
+
+	    if(_stat < 0)
+			return 0;
+	    _pos = (size_t) _stat;
+	}
+
+    if(!peer->_hs_flg)
+		goto peer_recv_compact;
+
+    if(!peer->_hs_frm_flg)
+	{
+	    _thcon_peer_deliver(obj, peer, _data + _pos, peer->_rbuff_len - _pos);
+	    _pos = peer->_rbuff_len;
+	    goto peer_recv_compact;
+	}
+
+    /* extract all complete frames */
+    while(peer->_rbuff_len - _pos >= THCON_FRAME_HDR_SZ)
+	{
+	    memcpy(&_flen, _data + _pos, THCON_FRAME_HDR_SZ);
+	    _flen = le32toh(_flen);
+	    if(_flen > THCON_MAX_FRAME_SZ)
+		{
+		    THOR_LOG_ERROR("frame size exceeds the limit");
+		    _rt = -1;
+		    break;
+		}
+
+	    /* wait for the rest of the frame */
+	    if(peer->_rbuff_len - _pos - THCON_FRAME_HDR_SZ < _flen)
+			break;
+
+	    _thcon_peer_deliver(obj, peer, _data + _pos + THCON_FRAME_HDR_SZ, _flen);
+	    _pos += THCON_FRAME_HDR_SZ + _flen;
+	}
+
+peer_recv_compact:
+    /*
+     * Consumed bytes are skipped, the space is reclaimed when
+     * the next read needs it.
+     */
+    peer->_rbuff_off += _pos;
+    peer->_rbuff_len -= _pos;
+    if(peer->_rbuff_len == 0)
+		peer->_rbuff_off = 0;
+
+    return _rt;
+}
+
+/*
+ * Thread function for handling the server side of the object.
+ * Each reactor runs this function with its own listening socket and
+ * epoll instance. Connections accepted by a reactor are handled in
+ * its thread until they are closed.
+ */
+static void* _thcon_thread_function_server(void* obj)
+{
+    /* counters */
+    int _i = 0, _n = 0, _old_state;
+    int _stat = 0, _complete = 0, _fd;
+    uint64_t _wake;
+    thcon* _obj;
+    struct thcon_reactor* _rct;
+    struct thcon_peer* _peer;
+    struct epoll_event _event, *_events = NULL;
+
+    /* check for object pointer */
+    if(obj == NULL)
+		return NULL;
+
+    /* cast object pointer to the correct type */
+    _rct = (struct thcon_reactor*) obj;
+    _obj = _rct->_obj;
+
+    /* Thread clean up handler. */
+    pthread_cleanup_push(_thcon_thread_cleanup_server, obj);
+
+    /* Disable thread cancelling temporarily */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
+
+    /* create socket and bind */
+    _rct->_list_sock = _thcon_create_listener(_obj);
+    if(_rct->_list_sock == -1)
+		pthread_exit(NULL);
 
-    /* listen on socket */
-    if(listen(_obj->var_con_sock, THCON_MAX_CLIENTS))
-		goto listening_sock_exit;
+    /* make socket non blocking and listen on socket */
+    if(_thcon_make_socket_nonblocking(_rct->_list_sock) ||
+       listen(_rct->_list_sock, THCON_MAX_CLIENTS))
+		pthread_exit(NULL);
 
     /* create and epoll instance */
-    _e_sock = epoll_create1(0);
+    _rct->_epoll = epoll_create1(0);
+    if(_rct->_epoll == -1)
+		pthread_exit(NULL);
+
+    memset((void*) &_event, 0, sizeof(struct epoll_event));
+    _event.data.fd = _rct->_list_sock;
+    _event.events = EPOLLIN | EPOLLET;
+    if(epoll_ctl(_rct->_epoll, EPOLL_CTL_ADD, _rct->_list_sock, &_event))
+		pthread_exit(NULL);
+
+    /* first reactor accepts connections on the unix domain socket */
+    if(_rct->_idx == 0 && _obj->var_unix_path[0] != '\0')
+	{
+	    _rct->_unix_sock = _thcon_create_unix_listener(_obj);
+	    if(_rct->_unix_sock != -1)
+		{
+		    _event.data.fd = _rct->_unix_sock;
+		    _event.events = EPOLLIN | EPOLLET;
+		    epoll_ctl(_rct->_epoll, EPOLL_CTL_ADD, _rct->_unix_sock, &_event);
+		}
+	}
 
-    if(_e_sock == -1)
-		goto epoll_exit_lbl;
-    _obj->_var_epol_inst = &_e_sock;
-    _event.data.fd = _obj->var_con_sock;
+    /* event descriptor for waking the reactor to write its connections */
+    _rct->_wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(_rct->_wake_fd == -1)
+		pthread_exit(NULL);
+
+    _event.data.fd = _rct->_wake_fd;
     _event.events = EPOLLIN | EPOLLET;
+    if(epoll_ctl(_rct->_epoll, EPOLL_CTL_ADD, _rct->_wake_fd, &_event))
+		pthread_exit(NULL);
 
-    if(epoll_ctl(_e_sock, EPOLL_CTL_ADD, _obj->var_con_sock, &_event))
-		goto epoll_exit_lbl;
+    _events = (struct epoll_event*) calloc(THCON_MAX_EVENTS, sizeof(struct epoll_event));
+    _rct->_events = (void*) _events;
 
     /* Restore thread cancelling */
     pthread_setcancelstate(_old_state, NULL);
     pthread_testcancel();
-    _events = (struct epoll_event*) calloc(THCON_MAX_EVENTS, sizeof(struct epoll_event));
-    _obj->_var_event_col = (void*) _events;
-
-    /* allocate memory for the incomming connections */
-    _obj->_var_cons_fds = (int*) calloc(THCON_MAX_CLIENTS, sizeof(int));
 
     /* indicate server is idling */
     _obj->_var_con_stat = thcon_connected;
@@ -1088,10 +3375,29 @@ static void* _thcon_thread_function_server(void* obj)
 	    /* check for cancel here */
 	    pthread_testcancel();
 
-	    _n = epoll_wait(_e_sock, _events, THCON_MAX_EVENTS, -1);
+	    _n = epoll_wait(_rct->_epoll, _events, THCON_MAX_EVENTS, -1);
 	    for(_i = 0; _i < _n; _i++)
 		{
 		    _complete = 0;
+		    _fd = _events[_i].data.fd;
+
+		    /* messages were queued for the connections of this reactor */
+		    if(_fd == _rct->_wake_fd)
+			{
+			    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
+			    while(read(_rct->_wake_fd, &_wake, sizeof(uint64_t)) > 0);
+			    _thcon_reactor_write(_obj, _rct);
+			    pthread_setcancelstate(_old_state, NULL);
+			    continue;
+			}
+
+		    /* socket became writable, continue writing the pending message */
+		    if((_events[_i].events & EPOLLOUT) && _fd != _rct->_list_sock && _fd != _rct->_unix_sock)
+			{
+			    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
+			    _thcon_peer_flush(_obj, _fd);
+			    pthread_setcancelstate(_old_state, NULL);
+			}
 
 		    /* check for errors */
 		    if(((_events[_i].events & EPOLLERR) ||
@@ -1103,56 +3409,27 @@ static void* _thcon_thread_function_server(void* obj)
 				 * we close the file descriptor and remove the
 				 * socket from the socket array.
 				 */
-			    if(_events[_i].data.fd != _obj->var_con_sock)
-				{
-					/*
-					 * Number of connections are decremented by the
-					 * adjust file descriptor methods.
-					 * The all operations involved in object variables
-					 * are wrapped in mutex for thread safety.
-					 */
-				    _thcon_adjust_fds(_obj, _events[_i].data.fd);
-				    close(_events[_i].data.fd);
-
-				    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
-				    pthread_setcancelstate(_old_state, NULL);
-
-				    /*
-				     * Indicate, the connection object was closed.
-				     */
-				    if(_obj->_thcon_conn_closed)
-						_obj->_thcon_conn_closed(_obj->_ext_obj, obj, _events[_i].data.fd);
-				}
+			    if(_fd != _rct->_list_sock && _fd != _rct->_unix_sock)
+					_complete = 1;
 			    else
 				{
 					/* errors have occured */
 					THOR_LOG_ERROR("epoll error");
 				}
-
-			    pthread_testcancel();
-			    continue;
 			}
 		    else if((_events[_i].events & EPOLLIN) ||
 					(_events[_i].events & EPOLLRDHUP))
 			{
-			    if(_obj->var_con_sock == _events[_i].data.fd)
+			    if(_rct->_list_sock == _fd || _rct->_unix_sock == _fd)
 				{
 				    /*
 				     * Information on listening socket, means we have a connection.
 				     * Call internal method to haddle the incomming connection and add
-				     * to the epoll instance.
+				     * to the epoll instance. Connection made callback is fired for
+				     * each connection accepted.
 				     */
 				    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
-				    _thcon_accept_conn(_obj, _obj->var_con_sock, _e_sock, &_event);
-
-
-				    /*
-				     * Fire callback to indicate connection was established and that
-				     * the sys object should be started.
-				     */
-				    if(_obj->_thcon_conn_made)
-						_obj->_thcon_conn_made(_obj->_ext_obj, obj);
-
+				    _thcon_accept_conn(_obj, _rct, _fd);
 				    pthread_setcancelstate(_old_state, NULL);
 				    pthread_testcancel();
 				    continue;
@@ -1165,18 +3442,21 @@ static void* _thcon_thread_function_server(void* obj)
 				     * in a single pass. Since we are running on edge triggered mode
 				     * in epoll, we wont get a notification again.
 				     */
-				    while(1)
+				    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
+				    _peer = _thcon_find_peer(_obj, _fd);
+				    while(_peer)
 					{
 					    /*
-					     * Active socket is set. When recv callback is called,
-					     * a user will be able to query the socket which the message
-					     * came through.
+					     * Bytes are read into the receive buffer of the connection,
+					     * which calls the recv callback for each complete message.
+					     * Connections violating the framing protocol are closed.
 					     */
-					    _obj->_var_act_sock = _events[_i].data.fd;
-
-					    _stat = _thcon_write_to_int_buff(_obj, _events[_i].data.fd);
-					    if(_obj->_thcon_recv_callback && _stat > 0)
-							_obj->_thcon_recv_callback(_obj->_ext_obj, _obj->var_membuff_in, _obj->var_inbuff_sz);
+					    _stat = _thcon_peer_read(_obj, _peer);
+					    if(_stat > 0 && _thcon_peer_recv(_obj, _peer))
+						{
+						    _complete = 1;
+						    break;
+						}
 					    if(_stat == -1)
 						{
 						    /*
@@ -1194,7 +3474,7 @@ static void* _thcon_thread_function_server(void* obj)
 						    break;
 						}
 					}
-
+				    pthread_setcancelstate(_old_state, NULL);
 				}
 			}
 		    if(_complete)
@@ -1207,17 +3487,20 @@ static void* _thcon_thread_function_server(void* obj)
 			     * The all operations involved in object variables
 			     * are wrapped in mutex for thread safety.
 			     */
-			    _thcon_adjust_fds(_obj, _events[_i].data.fd);
-
+			    _thcon_adjust_fds(_obj, _fd);
 
 			    /*
 			     * Indicate, the connection object was closed.
 			     */
 			    if(_obj->_thcon_conn_closed)
-					_obj->_thcon_conn_closed(_obj->_ext_obj, obj, _events[_i].data.fd);
+				{
+				    pthread_mutex_lock(&_obj->_var_mutex_cb);
+				    _obj->_thcon_conn_closed(_obj->_ext_obj, _obj, _fd);
+				    pthread_mutex_unlock(&_obj->_var_mutex_cb);
+				}
 
 			    /* close connection so that epoll shall remove the watching descriptor */
-			    close(_events[_i].data.fd);
+			    close(_fd);
 				pthread_setcancelstate(_old_state, NULL);
 			    pthread_testcancel();
 			}
@@ -1228,35 +3511,26 @@ static void* _thcon_thread_function_server(void* obj)
      * Pthread clean up pop handler not executed when this point is reached
      * natuarally.
      */
-    pthread_cleanup_pop(0);
-    free(_events);
-
-epoll_exit_lbl:
-    if(_e_sock)
-		close(_e_sock);
-
-listening_sock_exit:
-    if(_obj->var_con_sock)
-		close(_e_sock);
-
-    pthread_exit(NULL);
+    pthread_cleanup_pop(1);
     return NULL;
 }
 
-/* Accept connection */
-static int _thcon_accept_conn(thcon* obj, int list_sock, int epoll_inst, struct epoll_event* event)
+/* Accept connections waiting on the listening socket of the reactor */
+static int _thcon_accept_conn(thcon* obj, struct thcon_reactor* rct, int sock)
 {
-    struct sockaddr _in_addr;
-    socklen_t _in_len=0;
-    int _fd=0, _stat=0;
+    struct sockaddr_storage _in_addr;
+    socklen_t _in_len;
+    int _fd=0, _stat=0, _one = 1;
     char _err_msg[THOR_BUFF_SZ];
+    struct thcon_peer* _peer;
+    struct epoll_event _event;
 
     char _hbuf[NI_MAXHOST], _sbuf[NI_MAXSERV];
-    memset((void*) &_in_addr, 0, sizeof(struct sockaddr));
     memset(_err_msg, 0, THOR_BUFF_SZ);
     while(1)
 	{
-	    _fd = accept(list_sock, &_in_addr, &_in_len);
+	    _in_len = sizeof(struct sockaddr_storage);
+	    _fd = accept(sock, (struct sockaddr*) &_in_addr, &_in_len);
 	    if(_fd == -1)
 		{
 		    if(errno == EAGAIN ||
@@ -1277,7 +3551,7 @@ static int _thcon_accept_conn(thcon* obj, int list_sock, int epoll_inst, struct
 
 
 	    /* get information about the connection and log */
-	    _stat = getnameinfo(&_in_addr, _in_len,
+	    _stat = getnameinfo((struct sockaddr*) &_in_addr, _in_len,
 							_hbuf, NI_MAXHOST,
 							_sbuf, NI_MAXSERV,
 							NI_NUMERICHOST | NI_NUMERICSERV);
@@ -1287,223 +3561,401 @@ static int _thcon_accept_conn(thcon* obj, int list_sock, int epoll_inst, struct
 		    sprintf(_err_msg, "Accepted connection from %s on port %s\n", _hbuf, _sbuf);
 		    THOR_LOG_ERROR(_err_msg);
 		}
-	    /* make the connection non blocking  and add to the epoll instance */
+	    /* make the connection non blocking */
 	    _thcon_make_socket_nonblocking(_fd);
 
-	    event->data.fd = _fd;
-	    event->events = EPOLLIN | EPOLLET;
-	    epoll_ctl(epoll_inst, EPOLL_CTL_ADD, _fd, event);
-
 	    /*
-	     * Check if buffer needs expanding or not and set fd value.
+	     * Messages are coalesced by the batching of the writer thread,
+	     * disable delaying small segments in the kernel.
 	     */
-	    _thcon_alloc_fds(obj);
+	    if(obj->var_batch_cnt > 1 && sock == rct->_list_sock)
+			setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &_one, sizeof(int));
 
-	    /* counter incremented in a mutex */
+	    /* add to the connection table, counter incremented in a mutex */
 	    pthread_mutex_lock(&obj->_var_mutex);
-	    obj->_var_cons_fds[obj->var_num_conns++] = _fd;
+	    _peer = _thcon_alloc_fds(obj, _fd);
+	    if(_peer == NULL)
+		{
+		    pthread_mutex_unlock(&obj->_var_mutex);
+		    THOR_LOG_ERROR("unable to add connection to the table");
+		    close(_fd);
+		    continue;
+		}
+	    _peer->_reactor = rct->_idx;
 
-	    /*
-	     * Set the active socket so that a user may be able to
-	     * query the socket which the new connection was made.
-	     */
-	    obj->_var_act_sock = _fd;
+	    /* receive buffer is reused for the life of the socket */
+	    if(_thcon_peer_reserve(obj, _peer, 0))
+			THOR_LOG_ERROR("unable to allocate receive buffer");
 
 	    /* Display message in debug mode */
-	    sprintf(_err_msg, "Connection made on socket: %i\n", obj->_var_cons_fds[obj->var_num_conns-1]);
+	    sprintf(_err_msg, "Connection made on socket: %i\n", _peer->_fd);
 	    THOR_LOG_ERROR(_err_msg);
 
 	    pthread_mutex_unlock(&obj->_var_mutex);
+
+	    /* add to the epoll instance of the reactor */
+	    memset((void*) &_event, 0, sizeof(struct epoll_event));
+	    _event.data.fd = _fd;
+	    _event.events = EPOLLIN | EPOLLET;
+	    epoll_ctl(rct->_epoll, EPOLL_CTL_ADD, _fd, &_event);
+
+	    /*
+	     * Set the active socket so that a user may be able to
+	     * query the socket which the new connection was made.
+	     * Fire callback to indicate connection was established and that
+	     * the sys object should be started.
+	     */
+	    pthread_mutex_lock(&obj->_var_mutex_cb);
+	    obj->_var_act_sock = _fd;
+	    if(obj->_thcon_conn_made)
+			obj->_thcon_conn_made(obj->_ext_obj, obj);
+	    pthread_mutex_unlock(&obj->_var_mutex_cb);
 	}
 
     return 0;
 }
 
-/* Write data on socket to the buffer */
-static int _thcon_write_to_int_buff(thcon* obj, int socket_fd)
+/*
+ * Create listening socket of a server reactor bound to the port. Address
+ * is reused so that the server can be restarted while old connections are
+ * in TIME_WAIT. With more than one reactor, the port is shared by the
+ * listening sockets of all reactors. Returns the socket or -1 on error.
+ */
+static int _thcon_create_listener(thcon* obj)
 {
-    int _sz = 0;
-	obj->var_inbuff_sz = 0;
+    const char* _err_msg;
+    int _stat, _sock = -1, _opt = 1;
+    struct addrinfo _hints, *_result, *_p;
 
-	/* free the buffer if it exists */
-	if(obj->var_membuff_in)
-		free(obj->var_membuff_in);
-	obj->var_membuff_in = NULL;
+    memset(&_hints, 0, sizeof(struct addrinfo));
+    _hints.ai_family = AF_UNSPEC;
+    _hints.ai_socktype = SOCK_STREAM;
+    _hints.ai_protocol = 0;
+    _hints.ai_flags = AI_PASSIVE;
 
-	/* allocate and memset the initial buffer */
-	obj->var_membuff_in = (char*) malloc(sizeof(char) * THORNIFIX_MSG_BUFF_SZ);
-    memset((void*) obj->var_membuff_in, 0, THORNIFIX_MSG_BUFF_SZ);
-	do {
-		_sz = read(socket_fd,
-				   obj->var_membuff_in + obj->var_inbuff_sz,
-				   THORNIFIX_MSG_BUFF_SZ);
+    _stat = getaddrinfo(NULL, obj->var_port_name, &_hints, &_result);
+    if(_stat != 0)
+	{
+	    _err_msg = gai_strerror(_stat);
+	    THOR_LOG_ERROR(_err_msg);
+	    return -1;
+	}
 
-		/* break out of the loop if its an error */
-		if(_sz == -1)
-			break;
+    for(_p = _result; _p != NULL; _p = _p->ai_next)
+	{
+	    _sock = socket(_p->ai_family, _p->ai_socktype, _p->ai_protocol);
+	    if(_sock == -1)
+			continue;
 
-		obj->var_inbuff_sz += _sz;
+	    setsockopt(_sock, SOL_SOCKET, SO_REUSEADDR, &_opt, sizeof(int));
+	    if(obj->var_num_reactors > 1 &&
+	       setsockopt(_sock, SOL_SOCKET, SO_REUSEPORT, &_opt, sizeof(int)) == -1)
+		{
+		    THOR_LOG_ERROR("unable to share the port between reactors");
+		    close(_sock);
+		    _sock = -1;
+		    continue;
+		}
 
-		/* reallocate buffer if read size is more than half of the initial buffer */
-		if(((float) _sz) > (float) (THORNIFIX_MSG_BUFF_SZ / 2)) {
-			obj->var_membuff_in = (char*)
-				realloc(obj->var_membuff_in, (obj->var_inbuff_sz + THORNIFIX_MSG_BUFF_SZ));
+	    /* bind socket to the address */
+	    if(bind(_sock, _p->ai_addr, _p->ai_addrlen) == -1)
+		{
+		    close(_sock);
+		    _sock = -1;
+		    continue;
 		}
+	    else
+			break;
+	}
 
-	} while(_sz > 0);
+    freeaddrinfo(_result);
+    if(_p == NULL)
+	{
+	    THOR_LOG_ERROR("Unable to find a valid address");
+	    return -1;
+	}
 
-	obj->var_membuff_in[obj->var_inbuff_sz] = '\0';
-	if(_sz == -1 && obj->var_inbuff_sz > 0)
-		return obj->var_inbuff_sz;
-	else
-		return _sz;
+    return _sock;
 }
 
-/* Write data on socket to the external buffer */
-static int _thcon_write_to_ext_buff(thcon* obj, int socket_fd)
+/* Fill the address of the unix domain socket, paths not fitting are rejected */
+static int _thcon_unix_addr(thcon* obj, struct sockaddr_un* addr)
 {
-	int _sz = 0;
-	obj->var_outbuff_sz = 0;
+    size_t _len;
 
-	/* Free the buffer if its allocated */
-	if(obj->var_membuff_out)
-		free(obj->var_membuff_out);
-	obj->var_membuff_out = NULL;
+    _len = strnlen(obj->var_unix_path, THCON_UNIX_PATH_SZ);
+    if(_len >= sizeof(addr->sun_path))
+	{
+	    THOR_LOG_ERROR("unix domain socket path is too long");
+	    return -1;
+	}
 
-	/* allocate and memset the buffer */
-	obj->var_membuff_out = (char*) malloc(sizeof(char) * THORNIFIX_MSG_BUFF_SZ);
-	memset((void*) obj->var_membuff_out, 0, THORNIFIX_MSG_BUFF_SZ);
-	do {
-		_sz = recv(socket_fd,
-				   obj->var_membuff_out + obj->var_outbuff_sz,
-				   THORNIFIX_MSG_BUFF_SZ,
-				   MSG_DONTWAIT);
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, obj->var_unix_path, _len);
+    return 0;
+}
 
-		/* break out of the loop if its an error */
-		if(_sz == -1)
-			break;
+/*
+ * Create listening unix domain socket on the path. A socket file left
+ * by a previous server is removed. Returns the socket or -1.
+ */
+static int _thcon_create_unix_listener(thcon* obj)
+{
+    int _sock;
+    struct sockaddr_un _addr;
 
-		obj->var_outbuff_sz += _sz;
+    if(_thcon_unix_addr(obj, &_addr))
+		return -1;
 
-		/* reallocate buffer if the read size is more than half of the initial buffer */
-		if((float) _sz > (float) (THORNIFIX_MSG_BUFF_SZ / 2)) {
-			obj->var_membuff_out = (char*)
-				realloc(obj->var_membuff_out, (obj->var_outbuff_sz + THORNIFIX_MSG_BUFF_SZ));
-		}
+    _sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(_sock == -1)
+	{
+	    THOR_LOG_ERROR("unable to create unix domain socket");
+	    return -1;
+	}
 
-	} while(_sz > 0);
+    unlink(obj->var_unix_path);
+    if(bind(_sock, (struct sockaddr*) &_addr, sizeof(struct sockaddr_un)) == -1 ||
+       _thcon_make_socket_nonblocking(_sock) ||
+       listen(_sock, THCON_MAX_CLIENTS) == -1)
+	{
+	    THOR_LOG_ERROR("unable to listen on unix domain socket");
+	    close(_sock);
+	    return -1;
+	}
 
-	obj->var_membuff_out[obj->var_outbuff_sz] = '\0';
-	if(_sz == -1 && obj->var_outbuff_sz > 0)
-		return obj->var_outbuff_sz;
-	else
-		return _sz;
+    return _sock;
 }
 
+/* Connect to the unix domain socket of the server in client mode */
+static int _thcon_connect_unix(thcon* obj)
+{
+    struct sockaddr_un _addr;
+
+    if(_thcon_unix_addr(obj, &_addr))
+		return -1;
+
+    obj->var_con_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(obj->var_con_sock == -1)
+		return -1;
+
+    if(connect(obj->var_con_sock, (struct sockaddr*) &_addr, sizeof(struct sockaddr_un)) == -1)
+	{
+	    close(obj->var_con_sock);
+	    return -1;
+	}
+
+    obj->var_acc_sock = obj->var_con_sock;
+    return 0;
+}
 
-/* Alocate memory */
-inline __attribute__ ((always_inline)) static int _thcon_alloc_fds(thcon* obj)
+/*
+ * Write messages queued for the connections of the reactor. Called by
+ * the reactor when woken by the writer thread. Connections waiting on
+ * write notifications are continued when the socket becomes writable.
+ */
+static void _thcon_reactor_write(thcon* obj, struct thcon_reactor* rct)
 {
-    int _t_exs_sz;
-    int* _t_buff;
+    unsigned int i;
+    struct thcon_peer* _peer;
 
-    /*
-     * Mutex is locked for the entire session. This is due to the
-     * num connection variable being accessed in different places.
-     */
     pthread_mutex_lock(&obj->_var_mutex);
-
-    /*
-     * If the counter is 0, then its the first connection,
-     * set the initial size of the buffer and create it
-     */
-    if(obj->var_num_conns == 0)
+    for(i = 0; i < obj->var_num_conns; i++)
 	{
-	    obj->_var_bf_sz = THCON_MAX_CLIENTS;
-	    obj->_var_cons_fds = (int*) calloc(obj->_var_bf_sz, sizeof(int));
+	    _peer = _thcon_live_peer(obj, i);
+	    if(_peer->_reactor != rct->_idx || _peer->_out_arm)
+			continue;
+	    if(_peer->_out_msg == NULL && _peer->_hs_ack == NULL && _peer->_outq_cnt == 0)
+			continue;
+
+	    if(_thcon_peer_write(obj, _peer) == -1)
+			shutdown(_peer->_fd, SHUT_RDWR);
 	}
+    pthread_mutex_unlock(&obj->_var_mutex);
+    return;
+}
+
+/*
+ * Grow the connection table to sz slots. New slots are linked to the
+ * free list. Must be called with the descriptor mutex held.
+ */
+static int _thcon_table_grow(thcon* obj, unsigned int sz)
+{
+    unsigned int i;
+    struct thcon_peer** _t_cons;
+    unsigned int* _t_live;
+
+    _t_cons = (struct thcon_peer**) realloc(obj->_var_cons, sz * sizeof(struct thcon_peer*));
+    if(_t_cons == NULL)
+		return -1;
+    obj->_var_cons = _t_cons;
+
+    _t_live = (unsigned int*) realloc(obj->_var_live, sz * sizeof(unsigned int));
+    if(_t_live == NULL)
+		return -1;
+    obj->_var_live = _t_live;
 
     /*
-     * Check if the number of connections has reached 80% of the buffer.
-     * If it has, create a new buffer of double the size of existing buffer
-     * and copy the contents of existing buffer to the new one. Subsequently
-     * detroy the existing buffer.
+     * Table is only grown when the free list is empty. Connections are
+     * allocated for the new slots so that reactors holding a connection
+     * are not affected by the table moving.
      */
-    if(obj->var_num_conns > ((int) 0.8*obj->_var_bf_sz))
+    for(i = obj->_var_bf_sz; i < sz; i++)
 	{
-	    /* Record existing size */
-	    _t_exs_sz = obj->_var_bf_sz;
+	    obj->_var_cons[i] = (struct thcon_peer*) calloc(1, sizeof(struct thcon_peer));
+	    if(obj->_var_cons[i] == NULL)
+			break;
+	    obj->_var_cons[i]->_fd = -1;
+	    obj->_var_cons[i]->_slot_next = i+1 < sz? (int) (i+1) : -1;
+	}
+    if(i == obj->_var_bf_sz)
+		return -1;
 
-	    /* New buffer size */
-	    obj->_var_bf_sz += obj->_var_bf_sz;
+    /* terminate the free list at the last allocated slot */
+    obj->_var_cons[i-1]->_slot_next = -1;
+    obj->_var_free_slot = (int) obj->_var_bf_sz;
+    obj->_var_bf_sz = i;
 
-	    /*
-	     * Create a new temporary buffer and copy the contents of existing
-	     * buffer to the new one.
-	     */
-	    _t_buff = (int*) calloc(obj->_var_bf_sz, sizeof(int));
-	    memcpy(_t_buff, obj->_var_cons_fds, sizeof(int) * _t_exs_sz);
+    return 0;
+}
+
+/*
+ * Grow the map from descriptors to slots to hold the descriptor.
+ * Must be called with the descriptor mutex held.
+ */
+static int _thcon_fd_map_grow(thcon* obj, int fd)
+{
+    unsigned int i, _sz;
+    int* _t_map;
+
+    _sz = obj->_var_fd_map_sz? obj->_var_fd_map_sz : THCON_DEF_FD_MAP_SZ;
+    while(_sz <= (unsigned int) fd)
+		_sz += _sz;
+
+    _t_map = (int*) realloc(obj->_var_fd_map, _sz * sizeof(int));
+    if(_t_map == NULL)
+		return -1;
+
+    for(i = obj->_var_fd_map_sz; i < _sz; i++)
+		_t_map[i] = -1;
+    obj->_var_fd_map = _t_map;
+    obj->_var_fd_map_sz = _sz;
 
-	    /*--------------------------------------------------*/
-	    /************* Mutex Lock This Section **************/
-	    /*
-	     * Free the existing buffer and set the new pointer to object
-	     * buffer pointer
-	     */
-	    free(obj->_var_cons_fds);
-	    obj->_var_cons_fds = _t_buff;
-	    /*--------------------------------------------------*/
-	}
-    pthread_mutex_unlock(&obj->_var_mutex);
     return 0;
 }
 
 /*
- * Adjust file descriptor internal buffer when connections are closed.
- * When connections are closed, epoll instance will auto remove the descriptor
- * from the queue. This method will remove the descriptor from the internal
- * list and adjust the memory buffer if required.
+ * Add connection of the descriptor to the table. A free slot is taken
+ * from the free list, the table is doubled if there are none. Must be
+ * called with the descriptor mutex held. Returns the connection or NULL
+ * if memory could not be allocated.
  */
-inline __attribute__ ((always_inline)) static int _thcon_adjust_fds(thcon* obj, int fd)
+static struct thcon_peer* _thcon_alloc_fds(thcon* obj, int fd)
 {
-    int* _t_buff;
-    unsigned int i, a;
+    int _slot;
+    struct thcon_peer* _peer;
 
-    /* check if connection count is 0, exit method */
-    pthread_mutex_lock(&obj->_var_mutex);
-    if(obj->var_num_conns < 1)
-		goto _thcon_adjust_fds_exit;
+    if(obj->_var_free_slot < 0 &&
+       _thcon_table_grow(obj, obj->_var_bf_sz? obj->_var_bf_sz * 2 : THCON_MAX_CLIENTS))
+		return NULL;
+
+    if((unsigned int) fd >= obj->_var_fd_map_sz && _thcon_fd_map_grow(obj, fd))
+		return NULL;
+
+    _slot = obj->_var_free_slot;
+    _peer = obj->_var_cons[_slot];
+    obj->_var_free_slot = _peer->_slot_next;
+
+    memset((void*) _peer, 0, sizeof(struct thcon_peer));
+    _peer->_fd = fd;
+    _peer->_proto = thcon_proto_text;
+    _peer->_slot_next = -1;
+
+    /* add to the live list and index by descriptor */
+    _peer->_live_pos = obj->var_num_conns;
+    obj->_var_live[obj->var_num_conns++] = (unsigned int) _slot;
+    obj->_var_fd_map[fd] = _slot;
+
+    return _peer;
+}
+
+/*
+ * Remove connection of the descriptor from the table when its closed.
+ * Buffers of the connection are freed, its slot returned to the free list
+ * and the last live connection takes its position in the live list.
+ * Must be called with the descriptor mutex held.
+ */
+static void _thcon_table_remove(thcon* obj, int fd)
+{
+    int _slot;
+    unsigned int _last;
+    struct thcon_peer* _peer;
+    char _err_msg[THOR_BUFF_SZ];
+
+    if(fd < 0 || (unsigned int) fd >= obj->_var_fd_map_sz || obj->_var_fd_map[fd] < 0)
+		return;
 
-    /* allocate memory for the new buffer */
-    _t_buff = (int*) calloc((obj->var_num_conns-1), sizeof(int));
+    _slot = obj->_var_fd_map[fd];
+    _peer = obj->_var_cons[_slot];
 
-    /* copy existing descriptors to the new buffer */
-    for(i=0,a=0; i<obj->var_num_conns; i++)
+    /* report messages lost on slow connections */
+    if(_peer->_drop_cnt > 0)
 	{
-	    /*
-	     * If the closing file descriptor was found,
-	     * do not copy it.
-	     */
-	    if(obj->_var_cons_fds[i] == fd)
-			continue;
-	    _t_buff[a++] = obj->_var_cons_fds[i];
+	    sprintf(_err_msg, "Socket %i sent %llu, dropped %llu messages\n",
+			    fd, _peer->_sent_cnt, _peer->_drop_cnt);
+	    THOR_LOG_ERROR(_err_msg);
 	}
+    _thcon_peer_free(_peer);
+
+    _last = obj->_var_live[--obj->var_num_conns];
+    obj->_var_live[_peer->_live_pos] = _last;
+    obj->_var_cons[_last]->_live_pos = _peer->_live_pos;
 
-    /* free internal buffer and assign new buffer */
-    /*--------------------------------------------------*/
-    /************* Mutex Lock This Section **************/
-    free(obj->_var_cons_fds);
-    obj->_var_cons_fds = _t_buff;
-    /*--------------------------------------------------*/
+    _peer->_fd = -1;
+    _peer->_slot_next = obj->_var_free_slot;
+    obj->_var_free_slot = _slot;
+    obj->_var_fd_map[fd] = -1;
 
-    /* Decrement number of connections */
-    obj->var_num_conns--;
-_thcon_adjust_fds_exit:
+    return;
+}
 
+/* Remove connection of the descriptor from the table */
+static int _thcon_adjust_fds(thcon* obj, int fd)
+{
+    pthread_mutex_lock(&obj->_var_mutex);
+    _thcon_table_remove(obj, fd);
     pthread_mutex_unlock(&obj->_var_mutex);
     return 0;
 }
 
+/* Free the connection table */
+static void _thcon_table_free(thcon* obj)
+{
+    unsigned int i;
+
+    for(i = 0; obj->_var_cons && i < obj->_var_bf_sz; i++)
+	{
+	    _thcon_peer_free(obj->_var_cons[i]);
+	    free(obj->_var_cons[i]);
+	}
+    if(obj->_var_cons)
+		free(obj->_var_cons);
+    if(obj->_var_live)
+		free(obj->_var_live);
+    if(obj->_var_fd_map)
+		free(obj->_var_fd_map);
+
+    obj->_var_cons = NULL;
+    obj->_var_live = NULL;
+    obj->_var_fd_map = NULL;
+    obj->_var_fd_map_sz = 0;
+    obj->_var_bf_sz = 0;
+    obj->_var_free_slot = -1;
+    obj->var_num_conns = 0;
+    return;
+}
+
 
 /*
  * The thread function peeks at the queue. If the messages exist in
@@ -1511,10 +3963,12 @@ _thcon_adjust_fds_exit:
  */
 static void* _thcon_thread_function_write_server(void* obj)
 {
-    unsigned int i;
     int _old_state;
+    unsigned int _pend = 0;
+    long _rem;
     thcon* _obj;
-    struct _curl_mem* _msg;
+    struct _thcon_msg* _msg;
+    struct timespec _t0;
 
     if(obj == NULL)
 		return NULL;
@@ -1526,41 +3980,66 @@ static void* _thcon_thread_function_write_server(void* obj)
 	{
 	    pthread_testcancel();
 
-	    /* wait on semaphore */
-	    sem_wait(&_obj->_var_sem);
-
-	    pthread_testcancel();
-
 	    /*
-	     * If the message queue is empty we continue the loop
-	     * and wait on semaphore until, posted from enqueu
-	     * method.
+	     * If the ring is empty, indicate the writer is idle and check
+	     * again before waiting on the descriptor. Producers only write to
+	     * the descriptor when the writer is idle. While a batch is open
+	     * the wait is limited to the remainder of the batch window.
 	     */
-	    if(gqueue_count(&_obj->_msg_queue) == 0)
-			continue;
+	    _msg = _thcon_ring_pop(_obj->_var_ring);
+	    if(_msg == NULL)
+		{
+		    _rem = -1;
+		    if(_pend > 0)
+			{
+			    _rem = (long) _obj->var_batch_time - _thcon_elapsed_us(&_t0);
+			    if(_rem <= 0)
+				{
+				    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
+				    _thcon_fanout(_obj, NULL, 1);
+				    _pend = 0;
+				    pthread_setcancelstate(_old_state, NULL);
+				    continue;
+				}
+			}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
+		    __atomic_store_n(&_obj->_var_ring_idle, 1, __ATOMIC_SEQ_CST);
+		    _msg = _thcon_ring_pop(_obj->_var_ring);
+		    if(_msg == NULL)
+			{
+			    _thcon_ring_wait(_obj, _rem);
+			    continue;
+			}
+		    __atomic_store_n(&_obj->_var_ring_idle, 0, __ATOMIC_SEQ_CST);
+		}
 
-	    /* Pop message from queue */
-	    pthread_mutex_lock(&_obj->_var_mutex_q);
-	    gqueue_out(&_obj->_msg_queue, (void**) &_msg);
-	    pthread_mutex_unlock(&_obj->_var_mutex_q);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
 
 	    /*
 	     * Write to all sockets. Cancellation state is disable between the write.
+	     * Sockets are written without blocking, connections which could not
+	     * take the whole message keep a reference to it. In batching mode
+	     * messages are only queued until the batch is full or its window
+	     * has elapsed. Replies to a single connection are not batched.
 	     */
-	    /*--------------------------------------------------*/
-	    /************* Mutex Lock This Section **************/
-	    pthread_mutex_lock(&_obj->_var_mutex);
-	    for(i = 0; i < _obj->var_num_conns; i++)
-	    	_thcon_send_info(_obj->_var_cons_fds[i], _msg->memory, _msg->size);
-	    pthread_mutex_unlock(&_obj->_var_mutex);
-	    /*--------------------------------------------------*/
-
-	    /* free memory */
-	    free(_msg->memory);
-	    free(_msg);
-	    _msg->memory = NULL;
+	    if(_msg->_fd >= 0)
+			_thcon_fanout(_obj, _msg, 1);
+	    else
+		{
+		    if(_pend++ == 0)
+				clock_gettime(CLOCK_MONOTONIC, &_t0);
+		    if(_obj->var_batch_cnt <= 1 || _pend >= _obj->var_batch_cnt ||
+		       (_obj->var_batch_time > 0 && _thcon_elapsed_us(&_t0) >= (long) _obj->var_batch_time))
+			{
+			    _thcon_fanout(_obj, _msg, 1);
+			    _pend = 0;
+			}
+		    else
+				_thcon_fanout(_obj, _msg, 0);
+		}
+
+	    /* release reference of the queue */
+	    _thcon_msg_unref(_msg);
 	    _msg = NULL;
 
    	    pthread_setcancelstate(_old_state, NULL);
@@ -1570,65 +4049,94 @@ static void* _thcon_thread_function_write_server(void* obj)
 }
 
 /*
- * Thread cleanup handler for the server method.
+ * Wait on the descriptor of the outbound ring for up to usec micro
+ * seconds, or until woken if usec is negative.
+ */
+static void _thcon_ring_wait(thcon* obj, long usec)
+{
+    uint64_t _val;
+    fd_set _set;
+    struct timeval _tv;
+
+    if(usec >= 0)
+	{
+	    FD_ZERO(&_set);
+	    FD_SET(obj->_var_ring_fd, &_set);
+	    _tv.tv_sec = usec / 1000000;
+	    _tv.tv_usec = usec % 1000000;
+	    if(select(obj->_var_ring_fd + 1, &_set, NULL, NULL, &_tv) <= 0)
+			return;
+	}
+
+    read(obj->_var_ring_fd, &_val, sizeof(uint64_t));
+    return;
+}
+
+/* Micro seconds elapsed since the time */
+static long _thcon_elapsed_us(const struct timespec* t0)
+{
+    struct timespec _tn;
+
+    clock_gettime(CLOCK_MONOTONIC, &_tn);
+    return (long) (_tn.tv_sec - t0->tv_sec) * 1000000L + (_tn.tv_nsec - t0->tv_nsec) / 1000L;
+}
+
+/*
+ * Thread cleanup handler for the server reactors. Connections of
+ * the reactor are closed and removed from the connection table.
  */
 static void _thcon_thread_cleanup_server(void* obj)
 {
     unsigned int i;
     thcon* _obj;
+    struct thcon_reactor* _rct;
+    struct thcon_peer* _peer;
 
     if(obj == NULL)
 		return;
 
     /* Cast to correct object */
-    _obj = (thcon*) obj;
+    _rct = (struct thcon_reactor*) obj;
+    _obj = _rct->_obj;
 
-    if(_obj->_var_event_col != NULL)
-		free(_obj->_var_event_col);
-    _obj->_var_event_col = NULL;
+    if(_rct->_events != NULL)
+		free(_rct->_events);
+    _rct->_events = NULL;
 
-    /* close open connections */
-    for(i=0; i<_obj->var_num_conns; i++)
-		close(_obj->_var_cons_fds[i]);
     /*
-     * All open file descriptors are closed.
-     * This thread join should proceed, closing the write method.
+     * close open connections of the reactor, removing a connection
+     * moves the last live connection into its position.
      */
-    free(_obj->_var_cons_fds);
-    _obj->var_num_conns = 0;
-
-
-    if(_obj->_var_epol_inst)
-		close(*_obj->_var_epol_inst);
-    _obj->_var_epol_inst = NULL;
-
-    /* create connection socekt */
-    if(_obj->var_con_sock)
-		close(_obj->var_con_sock);
-
-    return;
-
-}
+    pthread_mutex_lock(&_obj->_var_mutex);
+    for(i = _obj->var_num_conns; i > 0; i--)
+	{
+	    _peer = _thcon_live_peer(_obj, i-1);
+	    if(_peer->_reactor != _rct->_idx)
+			continue;
+	    close(_peer->_fd);
+	    _thcon_table_remove(_obj, _peer->_fd);
+	}
+    pthread_mutex_unlock(&_obj->_var_mutex);
 
-/*
- * Delete helper method for clearing queue.
- */
-static void _thcon_queue_del_helper(void* data)
-{
-    struct _curl_mem* _mem;
-    if(!data)
-		return;
+    if(_rct->_epoll != -1)
+		close(_rct->_epoll);
+    _rct->_epoll = -1;
 
-    /* cast data object to */
-    _mem = (struct _curl_mem*) data;
+    if(_rct->_wake_fd != -1)
+		close(_rct->_wake_fd);
+    _rct->_wake_fd = -1;
 
-    /* check and free buffers */
-    if(_mem->memory && _mem->size)
-		free(_mem->memory);
-    _mem->memory = NULL;
+    /* close listening socket */
+    if(_rct->_list_sock != -1)
+		close(_rct->_list_sock);
+    _rct->_list_sock = -1;
 
-    /* free object itself */
-    free(_mem);
+    if(_rct->_unix_sock != -1)
+	{
+	    close(_rct->_unix_sock);
+	    unlink(_obj->var_unix_path);
+	}
+    _rct->_unix_sock = -1;
 
     return;
 }
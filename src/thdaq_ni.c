@@ -0,0 +1,196 @@
+/*
+ * NI backend of the data acquisition interface. Analog inputs are
+ * read on the sample clock of the device, outputs are written on
+ * demand.
+ */
+#include "thdaq.h"
+
+#define THDAQ_NI_EMPTY_STR ""
+#define THDAQ_NI_CLOCK_SOURCE "OnboardClock"
+#define THDAQ_NI_WRITE_TIMEOUT 10.0
+
+#ifdef THOR_INC_NI
+
+typedef struct _thdaq_ni thdaq_ni;
+
+struct _thdaq_ni
+{
+    thdaq var_parent;
+    unsigned int var_task_flg;				/* flag to indicate tasks were created */
+
+    TaskHandle var_a_outask;				/* analog output task */
+    TaskHandle var_a_intask;				/* analog input task */
+};
+
+/* Callback methods hooked to the parent class */
+static void _thdaq_ni_delete(void* obj);
+static int _thdaq_ni_create(void* obj);
+static int _thdaq_ni_clear(void* obj);
+static int _thdaq_ni_cfg_clock(void* obj, float64 rate, unsigned int buff_sz);
+static int _thdaq_ni_start(void* obj);
+static int _thdaq_ni_stop(void* obj);
+static int _thdaq_ni_read(void* obj, unsigned int scans, float64 time_out, float64* buff, unsigned int sz, int32* read);
+static int _thdaq_ni_write(void* obj, const float64* buff, unsigned int sz);
+
+/* Constructor */
+thdaq* thdaq_ni_new(void)
+{
+    thdaq_ni* _obj;
+
+    _obj = (thdaq_ni*) calloc(1, sizeof(thdaq_ni));
+    if(_obj == NULL)
+	return NULL;
+
+    _obj->var_task_flg = 0;
+    _obj->var_parent.var_child = (void*) _obj;
+
+    /* Set function pointers of the parent object */
+    _obj->var_parent.var_fptr.var_del_fptr = _thdaq_ni_delete;
+    _obj->var_parent.var_fptr.var_set_config_fptr = NULL;
+    _obj->var_parent.var_fptr.var_create_fptr = _thdaq_ni_create;
+    _obj->var_parent.var_fptr.var_clear_fptr = _thdaq_ni_clear;
+    _obj->var_parent.var_fptr.var_cfg_clock_fptr = _thdaq_ni_cfg_clock;
+    _obj->var_parent.var_fptr.var_start_fptr = _thdaq_ni_start;
+    _obj->var_parent.var_fptr.var_stop_fptr = _thdaq_ni_stop;
+    _obj->var_parent.var_fptr.var_read_fptr = _thdaq_ni_read;
+    _obj->var_parent.var_fptr.var_write_fptr = _thdaq_ni_write;
+
+    return &_obj->var_parent;
+}
+
+/*===========================================================================*/
+/***************************** Private Methods *******************************/
+
+/* Delete object callback method, clears tasks if still created */
+static void _thdaq_ni_delete(void* obj)
+{
+    if(obj == NULL)
+	return;
+
+    _thdaq_ni_clear(obj);
+    free(obj);
+    return;
+}
+
+/* Create tasks and the voltage channels */
+static int _thdaq_ni_create(void* obj)
+{
+    thdaq_ni* _obj;
+
+    if(obj == NULL)
+	return -1;
+    _obj = (thdaq_ni*) obj;
+
+    if(ERR_CHECK(NICreateTask(THDAQ_NI_EMPTY_STR, &_obj->var_a_outask)))
+	return -1;
+    if(ERR_CHECK(NICreateTask(THDAQ_NI_EMPTY_STR, &_obj->var_a_intask)))
+	{
+	    NIClearTask(_obj->var_a_outask);
+	    return -1;
+	}
+    _obj->var_task_flg = 1;
+
+    /* If channels failed, clear the tasks */
+    if(ERR_CHECK(NICreateAOVoltageChan(_obj->var_a_outask, _obj->var_parent.var_ao_chan, THDAQ_NI_EMPTY_STR,
+				       _obj->var_parent.var_min_val, _obj->var_parent.var_max_val, DAQmx_Val_Volts , NULL)) ||
+       ERR_CHECK(NICreateAIVoltageChan(_obj->var_a_intask, _obj->var_parent.var_ai_chan, THDAQ_NI_EMPTY_STR, DAQmx_Val_NRSE,
+				       _obj->var_parent.var_min_val, _obj->var_parent.var_max_val, DAQmx_Val_Volts, NULL)))
+	{
+	    _thdaq_ni_clear(obj);
+	    return -1;
+	}
+
+    return 0;
+}
+
+/* Clear tasks */
+static int _thdaq_ni_clear(void* obj)
+{
+    thdaq_ni* _obj;
+
+    if(obj == NULL)
+	return -1;
+    _obj = (thdaq_ni*) obj;
+
+    if(!_obj->var_task_flg)
+	return 0;
+
+    NIClearTask(_obj->var_a_outask);
+    NIClearTask(_obj->var_a_intask);
+    _obj->var_task_flg = 0;
+    return 0;
+}
+
+/* Configure continuous sampling of the input task */
+static int _thdaq_ni_cfg_clock(void* obj, float64 rate, unsigned int buff_sz)
+{
+    if(obj == NULL)
+	return -1;
+
+    return ERR_CHECK(NICfgSampClkTiming(((thdaq_ni*) obj)->var_a_intask, THDAQ_NI_CLOCK_SOURCE, rate, DAQmx_Val_Rising, DAQmx_Val_ContSamps,
+					buff_sz > 0? buff_sz : 1))? -1 : 0;
+}
+
+/* Start tasks */
+static int _thdaq_ni_start(void* obj)
+{
+    thdaq_ni* _obj;
+
+    if(obj == NULL)
+	return -1;
+    _obj = (thdaq_ni*) obj;
+
+    if(ERR_CHECK(NIStartTask(_obj->var_a_intask)))
+	return -1;
+    return ERR_CHECK(NIStartTask(_obj->var_a_outask))? -1 : 0;
+}
+
+/* Stop tasks */
+static int _thdaq_ni_stop(void* obj)
+{
+    thdaq_ni* _obj;
+
+    if(obj == NULL)
+	return -1;
+    _obj = (thdaq_ni*) obj;
+
+    NIStopTask(_obj->var_a_outask);
+    NIStopTask(_obj->var_a_intask);
+    return 0;
+}
+
+/* Read scans, waits until the scans were acquired or timed out */
+static int _thdaq_ni_read(void* obj, unsigned int scans, float64 time_out, float64* buff, unsigned int sz, int32* read)
+{
+    if(obj == NULL || buff == NULL)
+	return -1;
+
+    return ERR_CHECK(NIReadAnalogF64(((thdaq_ni*) obj)->var_a_intask, (int32) scans, time_out, DAQmx_Val_GroupByScanNumber,
+				     buff, sz, read, NULL))? -1 : 0;
+}
+
+/* Write one scan to the output task */
+static int _thdaq_ni_write(void* obj, const float64* buff, unsigned int sz)
+{
+    int32 _samples = 0;
+
+    if(obj == NULL || buff == NULL)
+	return -1;
+
+    if(ERR_CHECK(NIWriteAnalogArrayF64(((thdaq_ni*) obj)->var_a_outask, 1, 0, THDAQ_NI_WRITE_TIMEOUT, DAQmx_Val_GroupByScanNumber,
+				       (float64*) buff, &_samples, NULL)))
+	return -1;
+
+    return 0;
+}
+
+#else
+
+/* Driver was not included, the simulated device shall be used */
+thdaq* thdaq_ni_new(void)
+{
+    THOR_LOG_ERROR("thor built without the NI driver");
+    return NULL;
+}
+
+#endif
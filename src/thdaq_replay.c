@@ -0,0 +1,392 @@
+/*
+ * Replay backend of the data acquisition interface. Inputs are read from
+ * a capture of a session, binary sample records as written by the server,
+ * and returned at the timing they were acquired, a multiple of it or as
+ * fast as they are read. Writes are accepted and ignored.
+ */
+#include <time.h>
+#include <errno.h>
+#include "thdaq.h"
+
+#define THDAQ_REPLAY_MAX_AI 14
+#define THDAQ_REPLAY_NSEC_CONV 1000000000ULL
+#define THDAQ_REPLAY_IDLE 0.5				/* seconds a read waits once finished */
+#define THDAQ_REPLAY_PATH_SZ 256
+
+/* Setting names */
+#define THDAQ_REPLAY_FILE "file"
+#define THDAQ_REPLAY_SPEED "speed"
+#define THDAQ_REPLAY_LOOP "loop"
+
+typedef struct _thdaq_replay thdaq_replay;
+
+struct _thdaq_replay
+{
+    thdaq var_parent;
+    unsigned int var_run_flg;
+    unsigned int var_loop;				/* start over at the end of the capture */
+    unsigned int var_end_flg;				/* end of the capture was reached */
+    float64 var_speed;					/* multiple of the recorded timing, 0 as fast as read */
+
+    char var_path[THDAQ_REPLAY_PATH_SZ];
+    FILE* var_file;
+
+    /*
+     * Record read and not yet returned. Timing is anchored to the
+     * first record returned after start.
+     */
+    unsigned int _var_pend;
+    unsigned int _var_anchor_flg;
+    struct thor_msg _var_msg;
+    unsigned long long _var_rec0;			/* recorded time of the anchor record (ns) */
+    unsigned long long _var_wall0;			/* time the anchor record was returned (ns) */
+
+    unsigned long long _var_cnt;			/* records returned */
+    unsigned long long _var_first;			/* time the first record was returned (ns) */
+};
+
+/* Callback methods hooked to the parent class */
+static void _thdaq_replay_delete(void* obj);
+static int _thdaq_replay_set_config(void* obj, const config_setting_t* setting);
+static int _thdaq_replay_create(void* obj);
+static int _thdaq_replay_clear(void* obj);
+static int _thdaq_replay_cfg_clock(void* obj, float64 rate, unsigned int buff_sz);
+static int _thdaq_replay_start(void* obj);
+static int _thdaq_replay_stop(void* obj);
+static int _thdaq_replay_read(void* obj, unsigned int scans, float64 time_out, float64* buff, unsigned int sz, int32* read);
+static int _thdaq_replay_write(void* obj, const float64* buff, unsigned int sz);
+
+static int _thdaq_replay_next(thdaq_replay* obj);
+static void _thdaq_replay_sleep(unsigned long long due);
+
+/* Get the current time in ns */
+#define _thdaq_replay_now(ts)						\
+    (clock_gettime(CLOCK_MONOTONIC, &(ts)), (unsigned long long) (ts).tv_sec * THDAQ_REPLAY_NSEC_CONV + (ts).tv_nsec)
+
+/* Constructor */
+thdaq* thdaq_replay_new(void)
+{
+    thdaq_replay* _obj;
+
+    _obj = (thdaq_replay*) calloc(1, sizeof(thdaq_replay));
+    if(_obj == NULL)
+	return NULL;
+
+    _obj->var_parent.var_child = (void*) _obj;
+
+    /* Set function pointers of the parent object */
+    _obj->var_parent.var_fptr.var_del_fptr = _thdaq_replay_delete;
+    _obj->var_parent.var_fptr.var_set_config_fptr = _thdaq_replay_set_config;
+    _obj->var_parent.var_fptr.var_create_fptr = _thdaq_replay_create;
+    _obj->var_parent.var_fptr.var_clear_fptr = _thdaq_replay_clear;
+    _obj->var_parent.var_fptr.var_cfg_clock_fptr = _thdaq_replay_cfg_clock;
+    _obj->var_parent.var_fptr.var_start_fptr = _thdaq_replay_start;
+    _obj->var_parent.var_fptr.var_stop_fptr = _thdaq_replay_stop;
+    _obj->var_parent.var_fptr.var_read_fptr = _thdaq_replay_read;
+    _obj->var_parent.var_fptr.var_write_fptr = _thdaq_replay_write;
+
+    /* Default to the recorded timing, reads are paced by the capture */
+    _obj->var_parent.var_paced = 1;
+    _obj->var_speed = 1.0;
+    _obj->var_file = NULL;
+    _obj->var_path[0] = '\0';
+
+    return &_obj->var_parent;
+}
+
+/*===========================================================================*/
+/***************************** Private Methods *******************************/
+
+/* Delete object callback method */
+static void _thdaq_replay_delete(void* obj)
+{
+    if(obj == NULL)
+	return;
+
+    _thdaq_replay_clear(obj);
+    free(obj);
+    return;
+}
+
+/* Read capture file, speed and looping */
+static int _thdaq_replay_set_config(void* obj, const config_setting_t* setting)
+{
+    const char* _t_buff;
+    const config_setting_t* _t_setting;
+    thdaq_replay* _obj;
+
+    if(obj == NULL || setting == NULL)
+	return -1;
+    _obj = (thdaq_replay*) obj;
+
+    _t_setting = config_setting_get_member(setting, THDAQ_REPLAY_FILE);
+    _t_buff = _t_setting? config_setting_get_string(_t_setting) : NULL;
+    if(_t_buff)
+	{
+	    strncpy(_obj->var_path, _t_buff, THDAQ_REPLAY_PATH_SZ-1);
+	    _obj->var_path[THDAQ_REPLAY_PATH_SZ-1] = '\0';
+	}
+
+    _t_setting = config_setting_get_member(setting, THDAQ_REPLAY_SPEED);
+    if(_t_setting && config_setting_get_float(_t_setting) >= 0.0)
+	_obj->var_speed = config_setting_get_float(_t_setting);
+
+    _t_setting = config_setting_get_member(setting, THDAQ_REPLAY_LOOP);
+    if(_t_setting)
+	_obj->var_loop = config_setting_get_bool(_t_setting)? 1 : 0;
+
+    return 0;
+}
+
+/* Open the capture */
+static int _thdaq_replay_create(void* obj)
+{
+    thdaq_replay* _obj;
+
+    if(obj == NULL)
+	return -1;
+    _obj = (thdaq_replay*) obj;
+
+    if(_obj->var_parent.var_num_ai > THDAQ_REPLAY_MAX_AI)
+	{
+	    THOR_LOG_ERROR("capture has fewer channels than requested");
+	    return -1;
+	}
+
+    _thdaq_replay_clear(obj);
+    _obj->var_file = fopen(_obj->var_path, "rb");
+    if(_obj->var_file == NULL)
+	{
+	    THOR_LOG_ERROR("unable to open capture for replay");
+	    return -1;
+	}
+
+    _obj->var_run_flg = 0;
+    _obj->var_end_flg = 0;
+    _obj->_var_pend = 0;
+    _obj->_var_anchor_flg = 0;
+    _obj->_var_cnt = 0;
+    return 0;
+}
+
+/* Close the capture */
+static int _thdaq_replay_clear(void* obj)
+{
+    thdaq_replay* _obj;
+
+    if(obj == NULL)
+	return -1;
+    _obj = (thdaq_replay*) obj;
+
+    if(_obj->var_file)
+	fclose(_obj->var_file);
+    _obj->var_file = NULL;
+    _obj->var_run_flg = 0;
+    return 0;
+}
+
+/* Timing comes from the capture, sample clock is not used */
+static int _thdaq_replay_cfg_clock(void* obj, float64 rate, unsigned int buff_sz)
+{
+    return obj? 0 : -1;
+}
+
+/* Start, timing is anchored again at the next record */
+static int _thdaq_replay_start(void* obj)
+{
+    thdaq_replay* _obj;
+
+    if(obj == NULL)
+	return -1;
+    _obj = (thdaq_replay*) obj;
+
+    if(_obj->var_file == NULL)
+	return -1;
+
+    _obj->_var_anchor_flg = 0;
+    _obj->var_run_flg = 1;
+    return 0;
+}
+
+/* Stop */
+static int _thdaq_replay_stop(void* obj)
+{
+    if(obj == NULL)
+	return -1;
+
+    ((thdaq_replay*) obj)->var_run_flg = 0;
+    return 0;
+}
+
+/*
+ * Read scans of the capture. Each scan is returned when it is due relative
+ * to the first scan read after start. If the next scan is due later than
+ * the time out, scans read so far are returned or the read fails. Once the
+ * capture finished, reads fail.
+ */
+static int _thdaq_replay_read(void* obj, unsigned int scans, float64 time_out, float64* buff, unsigned int sz, int32* read)
+{
+    unsigned int _i, _ch, _num_ai;
+    unsigned long long _due, _now;
+    struct timespec _ts;
+    const double* _ai[THDAQ_REPLAY_MAX_AI];
+    char _err_msg[THOR_BUFF_SZ];
+    thdaq_replay* _obj;
+
+    if(obj == NULL || buff == NULL)
+	return -1;
+    _obj = (thdaq_replay*) obj;
+
+    if(!_obj->var_run_flg)
+	{
+	    THOR_LOG_ERROR("replay not started");
+	    return -1;
+	}
+
+    _num_ai = _obj->var_parent.var_num_ai;
+    if(_num_ai == 0 || scans * _num_ai > sz)
+	return -1;
+
+    /* Channels in the order of the record */
+    _ai[0] = &_obj->_var_msg._ai0_val;
+    _ai[1] = &_obj->_var_msg._ai1_val;
+    _ai[2] = &_obj->_var_msg._ai2_val;
+    _ai[3] = &_obj->_var_msg._ai3_val;
+    _ai[4] = &_obj->_var_msg._ai4_val;
+    _ai[5] = &_obj->_var_msg._ai5_val;
+    _ai[6] = &_obj->_var_msg._ai6_val;
+    _ai[7] = &_obj->_var_msg._ai7_val;
+    _ai[8] = &_obj->_var_msg._ai8_val;
+    _ai[9] = &_obj->_var_msg._ai9_val;
+    _ai[10] = &_obj->_var_msg._ai10_val;
+    _ai[11] = &_obj->_var_msg._ai11_val;
+    _ai[12] = &_obj->_var_msg._ai12_val;
+    _ai[13] = &_obj->_var_msg._ai13_val;
+
+    for(_i=0; _i<scans; _i++)
+	{
+	    if(!_obj->_var_pend && _thdaq_replay_next(_obj))
+		break;
+
+	    _now = _thdaq_replay_now(_ts);
+	    if(!_obj->_var_anchor_flg)
+		{
+		    _obj->_var_rec0 = _obj->_var_msg._tstamp;
+		    _obj->_var_wall0 = _now;
+		    _obj->_var_anchor_flg = 1;
+		    if(_obj->_var_cnt == 0)
+			_obj->_var_first = _now;
+		}
+
+	    /* Wait for the scan unless replaying as fast as possible */
+	    if(_obj->var_speed > 0.0 && _obj->_var_msg._tstamp > _obj->_var_rec0)
+		{
+		    _due = _obj->_var_wall0 + (unsigned long long) ((_obj->_var_msg._tstamp - _obj->_var_rec0) / _obj->var_speed);
+		    if(_due > _now && (_due - _now) / (float64) THDAQ_REPLAY_NSEC_CONV > time_out)
+			{
+			    if(_i > 0)
+				break;
+			    _thdaq_replay_sleep(_now + (unsigned long long) (time_out * THDAQ_REPLAY_NSEC_CONV));
+			    return -1;
+			}
+		    _thdaq_replay_sleep(_due);
+		}
+
+	    for(_ch=0; _ch<_num_ai; _ch++)
+		buff[_i * _num_ai + _ch] = *_ai[_ch];
+	    _obj->_var_pend = 0;
+	    _obj->_var_cnt++;
+	}
+
+    /* Capture finished, report the replay rate once */
+    if(_i == 0 && _obj->var_end_flg)
+	{
+	    if(_obj->var_end_flg == 1)
+		{
+		    _now = _thdaq_replay_now(_ts);
+		    sprintf(_err_msg, "replay finished %llu scans in %.3f s", _obj->_var_cnt,
+			    (_now - _obj->_var_first) / (float64) THDAQ_REPLAY_NSEC_CONV);
+		    THOR_LOG_ERROR(_err_msg);
+		    _obj->var_end_flg = 2;
+		}
+
+	    _thdaq_replay_sleep(_thdaq_replay_now(_ts) +
+				(unsigned long long) ((time_out < THDAQ_REPLAY_IDLE? time_out : THDAQ_REPLAY_IDLE) * THDAQ_REPLAY_NSEC_CONV));
+	    return -1;
+	}
+
+    if(read)
+	*read = (int32) _i;
+    return _i > 0? 0 : -1;
+}
+
+/* Outputs are not replayed */
+static int _thdaq_replay_write(void* obj, const float64* buff, unsigned int sz)
+{
+    return (obj && buff)? 0 : -1;
+}
+
+/*
+ * Read the next sample record of the capture in to the pending record,
+ * other records are skipped. At the end of the capture it starts over
+ * if looping, unless a whole pass found no sample record.
+ */
+static int _thdaq_replay_next(thdaq_replay* obj)
+{
+    char _rec[THORNIFIX_BIN_MSG_SZ];
+    int _rewound = 0;
+
+    if(obj->var_file == NULL || obj->var_end_flg)
+	return -1;
+
+    while(1)
+	{
+	    if(fread(_rec, 1, THORNIFIX_BIN_MSG_SZ, obj->var_file) != THORNIFIX_BIN_MSG_SZ)
+		{
+		    if(!obj->var_loop || ftell(obj->var_file) < THORNIFIX_BIN_MSG_SZ)
+			{
+			    obj->var_end_flg = 1;
+			    return -1;
+			}
+
+		    /* A pass from the start without samples would start over forever */
+		    if(_rewound)
+			{
+			    THOR_LOG_ERROR("capture has no sample records");
+			    obj->var_end_flg = 1;
+			    return -1;
+			}
+
+		    /* Start over, recorded time starts over */
+		    rewind(obj->var_file);
+		    obj->_var_anchor_flg = 0;
+		    _rewound = 1;
+		    continue;
+		}
+
+	    if(thornifix_bin_msg_len(_rec, THORNIFIX_BIN_MSG_SZ) != THORNIFIX_BIN_MSG_SZ ||
+	       thornifix_decode_msg_bin(_rec, THORNIFIX_BIN_MSG_SZ, &obj->_var_msg))
+		{
+		    THOR_LOG_ERROR("capture is not a sequence of sample records");
+		    obj->var_end_flg = 1;
+		    return -1;
+		}
+
+	    if(obj->_var_msg._cmd == 0)
+		break;
+	}
+
+    obj->_var_pend = 1;
+    return 0;
+}
+
+/* Sleep until the time given (ns, monotonic clock) */
+static void _thdaq_replay_sleep(unsigned long long due)
+{
+    struct timespec _ts;
+
+    _ts.tv_sec = due / THDAQ_REPLAY_NSEC_CONV;
+    _ts.tv_nsec = due % THDAQ_REPLAY_NSEC_CONV;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &_ts, NULL) == EINTR);
+    return;
+}
@@ -0,0 +1,485 @@
+/*
+ * Simulated backend of the data acquisition interface. Inputs are
+ * generated from waveforms with noise and injected faults, values
+ * only depend on the scan number and the seed so that runs can be
+ * repeated. Reads are paced by a simulated sample clock, unless
+ * free running which returns scans as fast as they are read.
+ */
+#include <time.h>
+#include <errno.h>
+#include "thdaq.h"
+
+#define THDAQ_SIM_MAX_AI 32
+#define THDAQ_SIM_MAX_AO 8
+#define THDAQ_SIM_NSEC_CONV 1000000000ULL
+#define THDAQ_SIM_DEF_SEED 1
+
+/* Setting names */
+#define THDAQ_SIM_SEED "seed"
+#define THDAQ_SIM_FREE_RUN "free_run"
+#define THDAQ_SIM_WAVEFORM "waveform"
+#define THDAQ_SIM_OFFSET "offset"
+#define THDAQ_SIM_AMPLITUDE "amplitude"
+#define THDAQ_SIM_FREQUENCY "frequency"
+#define THDAQ_SIM_NOISE "noise"
+#define THDAQ_SIM_FAULT_RATE "fault_rate"
+#define THDAQ_SIM_SPIKE_RATE "spike_rate"
+#define THDAQ_SIM_SPIKE_SIZE "spike_size"
+#define THDAQ_SIM_STUCK "stuck"
+#define THDAQ_SIM_LOOPBACK "loopback"
+
+typedef struct _thdaq_sim thdaq_sim;
+
+/* Waveform of an input channel */
+typedef enum {
+    thdaq_sim_const,
+    thdaq_sim_sine,
+    thdaq_sim_square,
+    thdaq_sim_triangle,
+    thdaq_sim_ramp
+} thdaq_sim_wave;
+
+struct _thdaq_sim_chan
+{
+    thdaq_sim_wave var_wave;
+    float64 var_offset;
+    float64 var_amp;
+    float64 var_freq;					/* Hz */
+    float64 var_noise;					/* standard deviation */
+    unsigned int var_stuck;				/* stuck at the offset */
+};
+
+struct _thdaq_sim
+{
+    thdaq var_parent;
+    unsigned int var_task_flg;
+    unsigned int var_run_flg;
+    unsigned int var_free_run;
+
+    float64 var_rate;					/* sample rate of the clock */
+    unsigned int var_buff_sz;				/* scans held before the buffer overflows */
+
+    unsigned long long var_seed;
+    unsigned long long _var_rng;			/* state of the sample generator */
+    unsigned long long _var_fault_rng;			/* state of the fault generator */
+
+    float64 var_fault_rate;				/* probability of a failed read or write */
+    float64 var_spike_rate;				/* probability of a spike on a sample */
+    float64 var_spike_size;
+
+    unsigned long long _var_scan;			/* next scan to be read */
+    unsigned long long _var_start;			/* time scan zero was acquired (ns) */
+
+    struct _thdaq_sim_chan var_ai[THDAQ_SIM_MAX_AI];
+    float64 var_ao[THDAQ_SIM_MAX_AO];
+    int var_loop[THDAQ_SIM_MAX_AO];			/* input channel each output is looped back to */
+};
+
+/* Callback methods hooked to the parent class */
+static void _thdaq_sim_delete(void* obj);
+static int _thdaq_sim_set_config(void* obj, const config_setting_t* setting);
+static int _thdaq_sim_create(void* obj);
+static int _thdaq_sim_clear(void* obj);
+static int _thdaq_sim_cfg_clock(void* obj, float64 rate, unsigned int buff_sz);
+static int _thdaq_sim_start(void* obj);
+static int _thdaq_sim_stop(void* obj);
+static int _thdaq_sim_read(void* obj, unsigned int scans, float64 time_out, float64* buff, unsigned int sz, int32* read);
+static int _thdaq_sim_write(void* obj, const float64* buff, unsigned int sz);
+
+static float64 _thdaq_sim_sample(thdaq_sim* obj, unsigned int ch, unsigned long long scan);
+
+/* Get the current time in ns */
+#define _thdaq_sim_now(ts)						\
+    (clock_gettime(CLOCK_MONOTONIC, &(ts)), (unsigned long long) (ts).tv_sec * THDAQ_SIM_NSEC_CONV + (ts).tv_nsec)
+
+/* Uniform random number in [0, 1) from xorshift64* */
+inline __attribute__ ((always_inline)) static float64 _thdaq_sim_uniform(unsigned long long* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (float64) ((*state * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+/* Constructor */
+thdaq* thdaq_sim_new(void)
+{
+    unsigned int _i;
+    thdaq_sim* _obj;
+
+    _obj = (thdaq_sim*) calloc(1, sizeof(thdaq_sim));
+    if(_obj == NULL)
+	return NULL;
+
+    _obj->var_parent.var_child = (void*) _obj;
+
+    /* Set function pointers of the parent object */
+    _obj->var_parent.var_fptr.var_del_fptr = _thdaq_sim_delete;
+    _obj->var_parent.var_fptr.var_set_config_fptr = _thdaq_sim_set_config;
+    _obj->var_parent.var_fptr.var_create_fptr = _thdaq_sim_create;
+    _obj->var_parent.var_fptr.var_clear_fptr = _thdaq_sim_clear;
+    _obj->var_parent.var_fptr.var_cfg_clock_fptr = _thdaq_sim_cfg_clock;
+    _obj->var_parent.var_fptr.var_start_fptr = _thdaq_sim_start;
+    _obj->var_parent.var_fptr.var_stop_fptr = _thdaq_sim_stop;
+    _obj->var_parent.var_fptr.var_read_fptr = _thdaq_sim_read;
+    _obj->var_parent.var_fptr.var_write_fptr = _thdaq_sim_write;
+
+    /* Default to constant inputs at zero without faults */
+    _obj->var_seed = THDAQ_SIM_DEF_SEED;
+    _obj->var_rate = 0.0;
+    _obj->var_buff_sz = 1;
+    for(_i=0; _i<THDAQ_SIM_MAX_AI; _i++)
+	_obj->var_ai[_i].var_wave = thdaq_sim_const;
+    for(_i=0; _i<THDAQ_SIM_MAX_AO; _i++)
+	_obj->var_loop[_i] = -1;
+
+    return &_obj->var_parent;
+}
+
+/*===========================================================================*/
+/***************************** Private Methods *******************************/
+
+/* Delete object callback method */
+static void _thdaq_sim_delete(void* obj)
+{
+    if(obj)
+	free(obj);
+    return;
+}
+
+/*
+ * Read settings of the simulated device. Arrays are in the order of the
+ * input channels, waveforms are "const", "sine", "square", "triangle" or
+ * "ramp". Settings missing keep their values.
+ */
+static int _thdaq_sim_set_config(void* obj, const config_setting_t* setting)
+{
+    int _i, _ch;
+    const char* _t_buff;
+    const config_setting_t* _t_setting;
+    thdaq_sim* _obj;
+
+    if(obj == NULL || setting == NULL)
+	return -1;
+    _obj = (thdaq_sim*) obj;
+
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_SEED);
+    if(_t_setting)
+	_obj->var_seed = (unsigned long long) config_setting_get_int(_t_setting);
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_FREE_RUN);
+    if(_t_setting)
+	_obj->var_free_run = config_setting_get_bool(_t_setting)? 1 : 0;
+
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_WAVEFORM);
+    for(_i=0; _t_setting && _i<config_setting_length(_t_setting) && _i<THDAQ_SIM_MAX_AI; _i++)
+	{
+	    _t_buff = config_setting_get_string_elem(_t_setting, _i);
+	    if(_t_buff == NULL)
+		continue;
+	    else if(strcmp(_t_buff, "sine") == 0)
+		_obj->var_ai[_i].var_wave = thdaq_sim_sine;
+	    else if(strcmp(_t_buff, "square") == 0)
+		_obj->var_ai[_i].var_wave = thdaq_sim_square;
+	    else if(strcmp(_t_buff, "triangle") == 0)
+		_obj->var_ai[_i].var_wave = thdaq_sim_triangle;
+	    else if(strcmp(_t_buff, "ramp") == 0)
+		_obj->var_ai[_i].var_wave = thdaq_sim_ramp;
+	    else
+		_obj->var_ai[_i].var_wave = thdaq_sim_const;
+	}
+
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_OFFSET);
+    for(_i=0; _t_setting && _i<config_setting_length(_t_setting) && _i<THDAQ_SIM_MAX_AI; _i++)
+	_obj->var_ai[_i].var_offset = config_setting_get_float_elem(_t_setting, _i);
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_AMPLITUDE);
+    for(_i=0; _t_setting && _i<config_setting_length(_t_setting) && _i<THDAQ_SIM_MAX_AI; _i++)
+	_obj->var_ai[_i].var_amp = config_setting_get_float_elem(_t_setting, _i);
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_FREQUENCY);
+    for(_i=0; _t_setting && _i<config_setting_length(_t_setting) && _i<THDAQ_SIM_MAX_AI; _i++)
+	_obj->var_ai[_i].var_freq = config_setting_get_float_elem(_t_setting, _i);
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_NOISE);
+    for(_i=0; _t_setting && _i<config_setting_length(_t_setting) && _i<THDAQ_SIM_MAX_AI; _i++)
+	_obj->var_ai[_i].var_noise = config_setting_get_float_elem(_t_setting, _i);
+
+    /* Faults */
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_FAULT_RATE);
+    if(_t_setting)
+	_obj->var_fault_rate = config_setting_get_float(_t_setting);
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_SPIKE_RATE);
+    if(_t_setting)
+	_obj->var_spike_rate = config_setting_get_float(_t_setting);
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_SPIKE_SIZE);
+    if(_t_setting)
+	_obj->var_spike_size = config_setting_get_float(_t_setting);
+
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_STUCK);
+    for(_i=0; _t_setting && _i<config_setting_length(_t_setting); _i++)
+	{
+	    _ch = config_setting_get_int_elem(_t_setting, _i);
+	    if(_ch >= 0 && _ch < THDAQ_SIM_MAX_AI)
+		_obj->var_ai[_ch].var_stuck = 1;
+	}
+
+    _t_setting = config_setting_get_member(setting, THDAQ_SIM_LOOPBACK);
+    for(_i=0; _t_setting && _i<config_setting_length(_t_setting) && _i<THDAQ_SIM_MAX_AO; _i++)
+	{
+	    _ch = config_setting_get_int_elem(_t_setting, _i);
+	    _obj->var_loop[_i] = (_ch >= 0 && _ch < THDAQ_SIM_MAX_AI)? _ch : -1;
+	}
+
+    return 0;
+}
+
+/* Create tasks, the generators are seeded so that each run repeats */
+static int _thdaq_sim_create(void* obj)
+{
+    unsigned int _i;
+    thdaq_sim* _obj;
+
+    if(obj == NULL)
+	return -1;
+    _obj = (thdaq_sim*) obj;
+
+    if(_obj->var_parent.var_num_ai > THDAQ_SIM_MAX_AI || _obj->var_parent.var_num_ao > THDAQ_SIM_MAX_AO)
+	{
+	    THOR_LOG_ERROR("simulated device has too many channels");
+	    return -1;
+	}
+
+    /* state of xorshift shall not be zero */
+    _obj->_var_rng = _obj->var_seed? _obj->var_seed : THDAQ_SIM_DEF_SEED;
+    _obj->_var_fault_rng = _obj->_var_rng ^ 0x9e3779b97f4a7c15ULL;
+    _obj->_var_scan = 0;
+    for(_i=0; _i<THDAQ_SIM_MAX_AO; _i++)
+	_obj->var_ao[_i] = 0.0;
+
+    _obj->var_run_flg = 0;
+    _obj->var_task_flg = 1;
+    return 0;
+}
+
+/* Clear tasks */
+static int _thdaq_sim_clear(void* obj)
+{
+    if(obj == NULL)
+	return -1;
+
+    ((thdaq_sim*) obj)->var_task_flg = 0;
+    ((thdaq_sim*) obj)->var_run_flg = 0;
+    return 0;
+}
+
+/* Configure the simulated clock */
+static int _thdaq_sim_cfg_clock(void* obj, float64 rate, unsigned int buff_sz)
+{
+    thdaq_sim* _obj;
+
+    if(obj == NULL || !(rate > 0.0))
+	return -1;
+    _obj = (thdaq_sim*) obj;
+
+    _obj->var_rate = rate;
+    _obj->var_buff_sz = buff_sz > 0? buff_sz : 1;
+    return 0;
+}
+
+/* Start acquisition, scans continue from the last scan read */
+static int _thdaq_sim_start(void* obj)
+{
+    struct timespec _ts;
+    thdaq_sim* _obj;
+
+    if(obj == NULL)
+	return -1;
+    _obj = (thdaq_sim*) obj;
+
+    if(!_obj->var_task_flg || !(_obj->var_rate > 0.0))
+	{
+	    THOR_LOG_ERROR("simulated device not configured");
+	    return -1;
+	}
+
+    _obj->_var_start = _thdaq_sim_now(_ts) - (unsigned long long) (_obj->_var_scan * (THDAQ_SIM_NSEC_CONV / _obj->var_rate));
+    _obj->var_run_flg = 1;
+    return 0;
+}
+
+/* Stop acquisition */
+static int _thdaq_sim_stop(void* obj)
+{
+    if(obj == NULL)
+	return -1;
+
+    ((thdaq_sim*) obj)->var_run_flg = 0;
+    return 0;
+}
+
+/*
+ * Read scans. Unless free running, waits until the last scan was acquired
+ * by the simulated clock. If more scans were acquired than the buffer holds
+ * the read fails as the device buffer overflowed, with a buffer of a single
+ * scan the reader skips to the latest scan instead.
+ */
+static int _thdaq_sim_read(void* obj, unsigned int scans, float64 time_out, float64* buff, unsigned int sz, int32* read)
+{
+    unsigned int _i, _ch, _num_ai;
+    unsigned long long _avail, _due, _now;
+    float64 _period;
+    struct timespec _ts;
+    thdaq_sim* _obj;
+
+    if(obj == NULL || buff == NULL || scans == 0)
+	return -1;
+    _obj = (thdaq_sim*) obj;
+
+    if(!_obj->var_run_flg)
+	{
+	    THOR_LOG_ERROR("simulated device not started");
+	    return -1;
+	}
+
+    _num_ai = _obj->var_parent.var_num_ai;
+    if(scans * _num_ai > sz)
+	scans = sz / _num_ai;
+    if(scans == 0)
+	return -1;
+
+    if(_obj->var_fault_rate > 0.0 && _thdaq_sim_uniform(&_obj->_var_fault_rng) < _obj->var_fault_rate)
+	{
+	    THOR_LOG_ERROR("simulated read fault");
+	    return -1;
+	}
+
+    if(!_obj->var_free_run)
+	{
+	    _period = THDAQ_SIM_NSEC_CONV / _obj->var_rate;
+	    _now = _thdaq_sim_now(_ts);
+	    _avail = _now >= _obj->_var_start? (unsigned long long) ((_now - _obj->_var_start) / _period) + 1 : 0;
+
+	    /* Check for overflow of the device buffer */
+	    if(_avail > _obj->_var_scan + _obj->var_buff_sz)
+		{
+		    if(_obj->var_buff_sz > 1)
+			{
+			    THOR_LOG_ERROR("simulated device buffer overflowed");
+			    _obj->_var_scan = _avail;
+			    return -1;
+			}
+		    _obj->_var_scan = _avail - 1;
+		}
+
+	    /* Wait for the last scan */
+	    _due = _obj->_var_start + (unsigned long long) ((_obj->_var_scan + scans - 1) * _period);
+	    if(_due > _now)
+		{
+		    if((_due - _now) / (float64) THDAQ_SIM_NSEC_CONV > time_out)
+			{
+			    _due = _now + (unsigned long long) (time_out * THDAQ_SIM_NSEC_CONV);
+			    _ts.tv_sec = _due / THDAQ_SIM_NSEC_CONV;
+			    _ts.tv_nsec = _due % THDAQ_SIM_NSEC_CONV;
+			    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &_ts, NULL) == EINTR);
+			    THOR_LOG_ERROR("simulated read timed out");
+			    return -1;
+			}
+
+		    _ts.tv_sec = _due / THDAQ_SIM_NSEC_CONV;
+		    _ts.tv_nsec = _due % THDAQ_SIM_NSEC_CONV;
+		    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &_ts, NULL) == EINTR);
+		}
+	}
+
+    /* Generate scans grouped by scan */
+    for(_i=0; _i<scans; _i++, _obj->_var_scan++)
+	for(_ch=0; _ch<_num_ai; _ch++)
+	    buff[_i * _num_ai + _ch] = _thdaq_sim_sample(_obj, _ch, _obj->_var_scan);
+
+    if(read)
+	*read = (int32) scans;
+    return 0;
+}
+
+/* Write one scan, outputs looped back are read on the next scans */
+static int _thdaq_sim_write(void* obj, const float64* buff, unsigned int sz)
+{
+    unsigned int _i;
+    thdaq_sim* _obj;
+
+    if(obj == NULL || buff == NULL)
+	return -1;
+    _obj = (thdaq_sim*) obj;
+
+    if(!_obj->var_task_flg)
+	return -1;
+
+    if(_obj->var_fault_rate > 0.0 && _thdaq_sim_uniform(&_obj->_var_fault_rng) < _obj->var_fault_rate)
+	{
+	    THOR_LOG_ERROR("simulated write fault");
+	    return -1;
+	}
+
+    for(_i=0; _i<sz && _i<_obj->var_parent.var_num_ao; _i++)
+	_obj->var_ao[_i] = buff[_i];
+    return 0;
+}
+
+/*
+ * Sample of an input channel. Noise and spikes are drawn in scan and
+ * channel order, so the values only depend on the seed and the number
+ * of scans read. Samples are clipped to the channel range.
+ */
+static float64 _thdaq_sim_sample(thdaq_sim* obj, unsigned int ch, unsigned long long scan)
+{
+    unsigned int _i;
+    float64 _val, _phase, _u;
+    struct _thdaq_sim_chan* _chan;
+
+    _chan = &obj->var_ai[ch];
+
+    /* Stuck channels read a flat value */
+    if(_chan->var_stuck)
+	return _chan->var_offset;
+
+    _phase = _chan->var_freq * (scan / obj->var_rate);
+    _phase -= floor(_phase);
+
+    switch(_chan->var_wave)
+	{
+	case thdaq_sim_sine:
+	    _val = _chan->var_offset + _chan->var_amp * sin(2.0 * M_PI * _phase);
+	    break;
+	case thdaq_sim_square:
+	    _val = _chan->var_offset + (_phase < 0.5? _chan->var_amp : -_chan->var_amp);
+	    break;
+	case thdaq_sim_triangle:
+	    _val = _chan->var_offset + _chan->var_amp * (1.0 - 4.0 * fabs(_phase - 0.5));
+	    break;
+	case thdaq_sim_ramp:
+	    _val = _chan->var_offset + _chan->var_amp * (2.0 * _phase - 1.0);
+	    break;
+	default:
+	    _val = _chan->var_offset;
+	}
+
+    /* Outputs looped back replace the waveform */
+    for(_i=0; _i<obj->var_parent.var_num_ao; _i++)
+	if(obj->var_loop[_i] == (int) ch)
+	    _val = obj->var_ao[_i];
+
+    /* Gaussian noise from Box-Muller */
+    if(_chan->var_noise > 0.0)
+	{
+	    _u = _thdaq_sim_uniform(&obj->_var_rng);
+	    _val += _chan->var_noise * sqrt(-2.0 * log(1.0 - _u)) * cos(2.0 * M_PI * _thdaq_sim_uniform(&obj->_var_rng));
+	}
+
+    if(obj->var_spike_rate > 0.0 && _thdaq_sim_uniform(&obj->_var_rng) < obj->var_spike_rate)
+	_val += obj->var_spike_size;
+
+    /* Clip to the range of the channel */
+    if(_val < obj->var_parent.var_min_val)
+	_val = obj->var_parent.var_min_val;
+    else if(_val > obj->var_parent.var_max_val)
+	_val = obj->var_parent.var_max_val;
+
+    return _val;
+}
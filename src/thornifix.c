@@ -2,8 +2,54 @@
 /* The current date is: 25/01/2013  */
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <endian.h>
 #include "thornifix.h"
 
+/* Collect address of message values in wire order */
+static void _thornifix_msg_val_addr(const struct thor_msg* msg, const double** vals);
+
+/* Field conversion of the text format, end of the field is set to next */
+static int _thornifix_parse_int(const char* buff, const char* end, const char** next, int* val);
+static int _thornifix_parse_f64(const char* buff, const char* end, const char** next, double* val);
+static int _thornifix_parse_slow(const char* buff, const char* end, const char** next, double* val);
+
+/* Field conversion of the text encoder, returns number of characters written */
+static size_t _thornifix_put_uint(char* buff, unsigned long long val);
+static int _thornifix_put_f64(char* buff, size_t size, double val);
+
+/* Powers of ten exactly representable as doubles */
+static const double _thornifix_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define THORNIFIX_POW10_MAX 22
+#define THORNIFIX_MANT_DIGITS 19
+#define THORNIFIX_MANT_EXACT (1ULL << 53)
+#define THORNIFIX_NUM_BUFF_SZ 64
+#define THORNIFIX_FIXED_MAX 1e19							/* integral part written by the integer formatter */
+#define THORNIFIX_FIXED_SZ 24							/* fixed point field and delimiter */
+#define THORNIFIX_FIELD_SZ 320							/* widest field, integral digits of the largest double */
+#define THORNIFIX_DELTA_COUNT_MAX 2147483647.0					/* largest count of a delta record */
+
+/* Size of the counts and decimal places of a delta record, padded to 4 bytes */
+#define _thornifix_delta_val_sz(num)				\
+    ((size_t) (num) * sizeof(int32_t) + (((size_t) (num) + 3) & ~((size_t) 3)))
+
+/* Little endian helpers for the binary format */
+inline __attribute__ ((always_inline)) static void _thornifix_put_u64(char* buff, uint64_t val)
+{
+    val = htole64(val);
+    memcpy(buff, &val, sizeof(uint64_t));
+}
+
+inline __attribute__ ((always_inline)) static uint64_t _thornifix_get_u64(const char* buff)
+{
+    uint64_t _val;
+    memcpy(&_val, buff, sizeof(uint64_t));
+    return le64toh(_val);
+}
+
 int thor_interpol(const double* x, const double* y, int n, double* z, double* fz, int m)
 {
     int i, j, k;
@@ -55,63 +101,733 @@ int thor_interpol(const double* x, const double* y, int n, double* z, double* fz
     return 0;
 }
 
-/* decode message */
+/*
+ * Decode text message in a single pass. Fields are converted as they are
+ * scanned, nothing is copied. Values with up to 19 significant digits and
+ * small exponents are converted exactly with one multiplication or
+ * division, other values are converted by strtod.
+ */
 int thornifix_decode_msg(const char* buff, size_t size, struct thor_msg* msg)
 {
-    int _cnt;
-    char _t_buff[THORNIFIX_MSG_BUFF_SZ];
-    char* _tok;
-    char _msg_buff[THORNIFIX_MSG_ELM_NUM][THORNIFIX_MSG_BUFF_ELM_SZ];
-    
+    int _i;
+    const char* _pos;
+    const char* _end;
+    const double* _vals[THORNIFIX_BIN_VAL_NUM];
+
     /* check for arguments */
     if(buff == NULL || msg == NULL)
-	return -1;
+	return THORNIFIX_ERR_ARGS;
 
     /* initialise buffer */
     thorinifix_init_msg(msg);
 
-    /* copy message to a local buffer */
-    memset((void*) _t_buff, 0, THORNIFIX_MSG_BUFF_SZ);
-    strncpy(_t_buff, buff, THORNIFIX_MSG_BUFF_SZ-1);
-    _t_buff[THORNIFIX_MSG_BUFF_SZ-1] = '\0';
-
-    /* initialise char message buffer */
-    for(_cnt=0; _cnt<THORNIFIX_MSG_ELM_NUM; _cnt++)
-	memset((void*) _msg_buff[_cnt], 0, THORNIFIX_MSG_BUFF_ELM_SZ);
-
-    /* tokenize the string */
-    _cnt = 0;
-    _tok = strtok(_t_buff, "|");
-    while(_tok != NULL)
-	{
-	    /* copy exact bytes to the char buffer */
-	    strncpy(_msg_buff[_cnt], _tok, THORNIFIX_MSG_BUFF_ELM_SZ-1);
-	    _msg_buff[_cnt][THORNIFIX_MSG_BUFF_ELM_SZ-1] = '\0';
-	    _tok = strtok(NULL, "|");
-	    if(++_cnt >= THORNIFIX_MSG_ELM_NUM)
-		break;
-	}
-
-    /* copy to message buffer */
-    msg->_cmd = _msg_buff[0][0] != '\0'? atoi(_msg_buff[0]) : 0;
-    msg->_ao0_val = _msg_buff[1][0] != '\0'? atof(_msg_buff[1]) : 0;
-    msg->_ao1_val = _msg_buff[2][0] != '\0'? atof(_msg_buff[2]) : 0;
-    msg->_ai0_val = _msg_buff[3][0] != '\0'? atof(_msg_buff[3]) : 0;
-    msg->_ai1_val = _msg_buff[4][0] != '\0'? atof(_msg_buff[4]) : 0;
-    msg->_ai2_val = _msg_buff[5][0] != '\0'? atof(_msg_buff[5]) : 0;
-    msg->_ai3_val = _msg_buff[6][0] != '\0'? atof(_msg_buff[6]) : 0;
-    msg->_ai4_val = _msg_buff[7][0] != '\0'? atof(_msg_buff[7]) : 0;
-    msg->_ai5_val = _msg_buff[8][0] != '\0'? atof(_msg_buff[8]) : 0;
-    msg->_ai6_val = _msg_buff[9][0] != '\0'? atof(_msg_buff[9]) : 0;
-    msg->_ai7_val = _msg_buff[10][0] != '\0'? atof(_msg_buff[10]) : 0;
-    msg->_ai8_val = _msg_buff[11][0] != '\0'? atof(_msg_buff[11]) : 0;
-    msg->_ai9_val = _msg_buff[12][0] != '\0'? atof(_msg_buff[12]) : 0;
-    msg->_ai10_val = _msg_buff[13][0] != '\0'? atof(_msg_buff[13]) : 0;
-    msg->_ai11_val = _msg_buff[14][0] != '\0'? atof(_msg_buff[14]) : 0;
-    msg->_ai12_val = _msg_buff[15][0] != '\0'? atof(_msg_buff[15]) : 0;
-    msg->_ai13_val = _msg_buff[16][0] != '\0'? atof(_msg_buff[16]) : 0;
-    msg->_di0_val = _msg_buff[17][0] != '\0'? atof(_msg_buff[17]) : 0;
-    msg->_di1_val = _msg_buff[18][0] != '\0'? atof(_msg_buff[18]) : 0;
+    /* message ends at the first null character */
+    _end = memchr(buff, '\0', size);
+    if(_end == NULL)
+	_end = buff + size;
+
+    if(_thornifix_parse_int(buff, _end, &_pos, &msg->_cmd))
+	return THORNIFIX_ERR_FIELD;
+
+    _thornifix_msg_val_addr(msg, _vals);
+    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM; _i++)
+	{
+	    if(_pos + 1 >= _end || *_pos != '|')
+		return THORNIFIX_ERR_COUNT;
+	    if(_thornifix_parse_f64(_pos+1, _end, &_pos, (double*) _vals[_i]))
+		return THORNIFIX_ERR_FIELD;
+	}
+
+    /* trailing delimiter, further fields are ignored */
+    if(_pos < _end && *_pos != '|' && *_pos != '\n' && *_pos != '\r')
+	return THORNIFIX_ERR_FIELD;
+
+    return 0;
+}
+
+/*
+ * Encode message to the text format. Values are scaled to hundredths and
+ * written by the integer formatter, rounding matches printf.
+ */
+int thornifix_encode_msg(const struct thor_msg* msg, char* buff, size_t size)
+{
+    int _i, _len;
+    char* _p;
+    char* _end;
+    char _num[THORNIFIX_FIELD_SZ];
+    const double* _vals[THORNIFIX_BIN_VAL_NUM];
+
+    /* check for arguments */
+    if(msg == NULL || buff == NULL || size < THORNIFIX_FIXED_SZ)
+	return -1;
+
+    _p = buff;
+    _end = buff + size;
+
+    /* command */
+    if(msg->_cmd < 0)
+	{
+	    *_p++ = '-';
+	    _p += _thornifix_put_uint(_p, (unsigned long long) -(long long) msg->_cmd);
+	}
+    else
+	_p += _thornifix_put_uint(_p, (unsigned long long) msg->_cmd);
+    *_p++ = '|';
+
+    _thornifix_msg_val_addr(msg, _vals);
+    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM; _i++)
+	{
+	    /*
+	     * field is formatted on its own, it is copied if the field,
+	     * delimiter and null character fit in the remaining space
+	     */
+	    _len = _thornifix_put_f64(_num, THORNIFIX_FIELD_SZ, *_vals[_i]);
+	    if(_len < 0 || _p + _len + 2 > _end)
+		return -1;
+	    memcpy(_p, _num, (size_t) _len);
+	    _p += _len;
+	    *_p++ = '|';
+	}
+
+    *_p = '\0';
+    return (int) (_p - buff);
+}
+
+/* encode message to binary format */
+int thornifix_encode_msg_bin(const struct thor_msg* msg, char* buff, size_t size)
+{
+    int _i;
+    uint32_t _cmd;
+    uint64_t _val;
+    const double* _vals[THORNIFIX_BIN_VAL_NUM];
+
+    /* check for arguments */
+    if(msg == NULL || buff == NULL || size < THORNIFIX_BIN_MSG_SZ)
+	return -1;
+
+    _thornifix_msg_val_addr(msg, _vals);
+
+    /* header */
+    buff[0] = THORNIFIX_BIN_MAGIC0;
+    buff[1] = THORNIFIX_BIN_MAGIC1;
+    buff[2] = THORNIFIX_BIN_VERSION;
+    buff[3] = THORNIFIX_BIN_TYPE_SAMPLE;
+
+    _cmd = htole32((uint32_t) msg->_cmd);
+    memcpy(buff+4, &_cmd, sizeof(uint32_t));
+    _thornifix_put_u64(buff+8, (uint64_t) msg->_seq);
+    _thornifix_put_u64(buff+16, (uint64_t) msg->_tstamp);
+
+    /* copy values as raw ieee754 bits */
+    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM; _i++)
+	{
+	    memcpy(&_val, _vals[_i], sizeof(uint64_t));
+	    _thornifix_put_u64(buff+THORNIFIX_BIN_HDR_SZ+_i*THORNIFIX_MSG_BUFF_ELM_SZ, _val);
+	}
+
+    return THORNIFIX_BIN_MSG_SZ;
+}
+
+/* decode binary message */
+int thornifix_decode_msg_bin(const char* buff, size_t size, struct thor_msg* msg)
+{
+    int _i;
+    uint32_t _cmd;
+    uint64_t _val;
+    const double* _vals[THORNIFIX_BIN_VAL_NUM];
+
+    uint32_t _mask = THORNIFIX_CH_ALL;
+    size_t _off = THORNIFIX_BIN_HDR_SZ;
+
+    /* check for arguments, header is checked by the length */
+    if(buff == NULL || msg == NULL || thornifix_bin_msg_len(buff, size) < 0)
+	return -1;
+
+    if(buff[3] == THORNIFIX_BIN_TYPE_DELTA)
+	return -1;
+
+    if(buff[3] == THORNIFIX_BIN_TYPE_SUBSET)
+	{
+	    memcpy(&_mask, buff+THORNIFIX_BIN_HDR_SZ, sizeof(uint32_t));
+	    _mask = le32toh(_mask);
+	    _off += THORNIFIX_BIN_MASK_SZ;
+	}
+
+    memcpy(&_cmd, buff+4, sizeof(uint32_t));
+    msg->_cmd = (int) le32toh(_cmd);
+
+    msg->_seq = (unsigned long long) _thornifix_get_u64(buff+8);
+    msg->_tstamp = (unsigned long long) _thornifix_get_u64(buff+16);
+
+    _thornifix_msg_val_addr(msg, _vals);
+    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM; _i++)
+	{
+	    if(!(_mask & (1u << _i)))
+		continue;
+	    _val = _thornifix_get_u64(buff+_off);
+	    memcpy((void*) _vals[_i], &_val, sizeof(uint64_t));
+	    _off += THORNIFIX_MSG_BUFF_ELM_SZ;
+	}
+
+    return 0;
+}
+
+/* copy channels of a binary message to a subset record */
+int thornifix_subset_msg_bin(const char* buff,
+			     size_t size,
+			     unsigned int mask,
+			     char* out,
+			     size_t out_size)
+{
+    int _i;
+    uint32_t _mask;
+    size_t _off;
+
+    /* check for arguments, only full records are converted */
+    if(buff == NULL || out == NULL || size < THORNIFIX_BIN_MSG_SZ ||
+       !thornifix_is_bin_msg(buff, size) || buff[3] != THORNIFIX_BIN_TYPE_SAMPLE ||
+       out_size < THORNIFIX_BIN_HDR_SZ+THORNIFIX_BIN_MASK_SZ)
+	return -1;
+
+    mask &= THORNIFIX_CH_ALL;
+    memcpy(out, buff, THORNIFIX_BIN_HDR_SZ);
+    out[3] = THORNIFIX_BIN_TYPE_SUBSET;
+    _mask = htole32((uint32_t) mask);
+    memcpy(out+THORNIFIX_BIN_HDR_SZ, &_mask, sizeof(uint32_t));
+
+    _off = THORNIFIX_BIN_HDR_SZ+THORNIFIX_BIN_MASK_SZ;
+    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM; _i++)
+	{
+	    if(!(mask & (1u << _i)))
+		continue;
+	    if(_off + THORNIFIX_MSG_BUFF_ELM_SZ > out_size)
+		return -1;
+	    memcpy(out+_off, buff+THORNIFIX_BIN_HDR_SZ+_i*THORNIFIX_MSG_BUFF_ELM_SZ, THORNIFIX_MSG_BUFF_ELM_SZ);
+	    _off += THORNIFIX_MSG_BUFF_ELM_SZ;
+	}
+
+    return (int) _off;
+}
+
+/* length of the binary record */
+int thornifix_bin_msg_len(const char* buff, size_t size)
+{
+    uint32_t _mask;
+    size_t _len;
+
+    /* check header, newer versions are rejected */
+    if(buff == NULL || !thornifix_is_bin_msg(buff, size) ||
+       buff[2] != THORNIFIX_BIN_VERSION)
+	return -1;
+
+    if(buff[3] == THORNIFIX_BIN_TYPE_SAMPLE)
+	_len = THORNIFIX_BIN_MSG_SZ;
+    else if(buff[3] == THORNIFIX_BIN_TYPE_SUBSET && size >= THORNIFIX_BIN_HDR_SZ+THORNIFIX_BIN_MASK_SZ)
+	{
+	    memcpy(&_mask, buff+THORNIFIX_BIN_HDR_SZ, sizeof(uint32_t));
+	    _mask = le32toh(_mask) & THORNIFIX_CH_ALL;
+	    _len = THORNIFIX_BIN_HDR_SZ+THORNIFIX_BIN_MASK_SZ+
+		(size_t) __builtin_popcount(_mask)*THORNIFIX_MSG_BUFF_ELM_SZ;
+	}
+    else if(buff[3] == THORNIFIX_BIN_TYPE_DELTA && size >= THORNIFIX_DELTA_HDR_SZ)
+	{
+	    memcpy(&_mask, buff+THORNIFIX_DELTA_HDR_SZ-THORNIFIX_BIN_MASK_SZ, sizeof(uint32_t));
+	    _mask = le32toh(_mask) & THORNIFIX_CH_ALL;
+	    _len = THORNIFIX_DELTA_HDR_SZ+_thornifix_delta_val_sz(__builtin_popcount(_mask));
+	}
+    else
+	return -1;
+
+    return _len <= size? (int) _len : -1;
+}
+
+/* initialise delta stream state */
+void thornifix_delta_init(struct thornifix_delta* obj, unsigned int key_ival)
+{
+    int _i;
+
+    if(obj == NULL)
+	return;
+
+    memset((void*) obj, 0, sizeof(struct thornifix_delta));
+    obj->_key_ival = key_ival;
+    obj->_key_flg = 1;
+    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM; _i++)
+	obj->_dec[_i] = THORNIFIX_DELTA_DEC_DEF;
+
+    return;
+}
+
+/*
+ * Encode message to the delta stream. Channel is sent if its quantised
+ * value differs from the one known to the reciever by more than the
+ * deadband. Values which can't be quantised are sent in a keyframe.
+ */
+int thornifix_encode_msg_delta(struct thornifix_delta* obj, const struct thor_msg* msg, char* buff, size_t size)
+{
+    int _i, _len, _num = 0, _key;
+    double _scale, _count;
+    int32_t _counts[THORNIFIX_BIN_VAL_NUM];
+    uint32_t _mask = 0, _u32;
+    size_t _off, _doff;
+    const double* _vals[THORNIFIX_BIN_VAL_NUM];
+    const double* _last[THORNIFIX_BIN_VAL_NUM];
+
+    if(obj == NULL || msg == NULL || buff == NULL)
+	return -1;
+
+    _thornifix_msg_val_addr(msg, _vals);
+    _thornifix_msg_val_addr(&obj->_last, _last);
+
+    _key = obj->_key_flg || (obj->_key_ival > 0 && obj->_key_cnt + 1 >= obj->_key_ival);
+    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM && !_key; _i++)
+	{
+	    _scale = _thornifix_pow10[obj->_dec[_i]];
+	    _count = rint(*_vals[_i] * _scale);
+
+	    /* nan, inf and values out of the range of the counts */
+	    if(!(fabs(_count) <= THORNIFIX_DELTA_COUNT_MAX))
+		{
+		    _key = 1;
+		    break;
+		}
+
+	    _counts[_i] = (int32_t) _count;
+	    if(_count / _scale != *_last[_i] && !(fabs(*_vals[_i] - *_last[_i]) <= obj->_band[_i]))
+		{
+		    _mask |= 1u << _i;
+		    _num++;
+		}
+	}
+
+    if(_key)
+	{
+	    _len = thornifix_encode_msg_bin(msg, buff, size);
+	    if(_len < 0)
+		return -1;
+
+	    memcpy((void*) &obj->_last, (const void*) msg, sizeof(struct thor_msg));
+	    obj->_key_flg = 0;
+	    obj->_key_cnt = 0;
+	    obj->_ref = msg->_seq;
+	    return _len;
+	}
+
+    _len = THORNIFIX_DELTA_HDR_SZ+_thornifix_delta_val_sz(_num);
+    if(size < (size_t) _len)
+	return -1;
+
+    /* header */
+    buff[0] = THORNIFIX_BIN_MAGIC0;
+    buff[1] = THORNIFIX_BIN_MAGIC1;
+    buff[2] = THORNIFIX_BIN_VERSION;
+    buff[3] = THORNIFIX_BIN_TYPE_DELTA;
+
+    _u32 = htole32((uint32_t) msg->_cmd);
+    memcpy(buff+4, &_u32, sizeof(uint32_t));
+    _thornifix_put_u64(buff+8, (uint64_t) msg->_seq);
+    _thornifix_put_u64(buff+16, (uint64_t) msg->_tstamp);
+    _thornifix_put_u64(buff+THORNIFIX_BIN_HDR_SZ, (uint64_t) obj->_ref);
+    _u32 = htole32(_mask);
+    memcpy(buff+THORNIFIX_DELTA_HDR_SZ-THORNIFIX_BIN_MASK_SZ, &_u32, sizeof(uint32_t));
+
+    /* counts followed by the decimal places, the reciever now has the quantised value */
+    _off = THORNIFIX_DELTA_HDR_SZ;
+    _doff = _off + (size_t) _num * sizeof(int32_t);
+    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM; _i++)
+	{
+	    if(!(_mask & (1u << _i)))
+		continue;
+	    _u32 = htole32((uint32_t) _counts[_i]);
+	    memcpy(buff+_off, &_u32, sizeof(uint32_t));
+	    buff[_doff++] = (char) obj->_dec[_i];
+	    _off += sizeof(int32_t);
+	    *((double*) _last[_i]) = (double) _counts[_i] / _thornifix_pow10[obj->_dec[_i]];
+	}
+    memset(buff+_doff, 0, (size_t) _len - _doff);
+
+    obj->_last._cmd = msg->_cmd;
+    obj->_last._seq = msg->_seq;
+    obj->_last._tstamp = msg->_tstamp;
+    obj->_ref = msg->_seq;
+    obj->_key_cnt++;
+    return _len;
+}
+
+/* decode record of a delta stream */
+int thornifix_decode_msg_delta(struct thornifix_delta* obj, const char* buff, size_t size, struct thor_msg* msg)
+{
+    int _i, _num;
+    uint32_t _mask, _u32;
+    size_t _off, _doff;
+    unsigned char _dec;
+    const double* _last[THORNIFIX_BIN_VAL_NUM];
+
+    if(obj == NULL || buff == NULL || msg == NULL || thornifix_bin_msg_len(buff, size) < 0)
+	return THORNIFIX_ERR_ARGS;
+
+    /* keyframe */
+    if(buff[3] == THORNIFIX_BIN_TYPE_SAMPLE)
+	{
+	    if(thornifix_decode_msg_bin(buff, size, &obj->_last))
+		return THORNIFIX_ERR_ARGS;
+	    obj->_key_flg = 0;
+	    obj->_ref = obj->_last._seq;
+	    memcpy((void*) msg, (const void*) &obj->_last, sizeof(struct thor_msg));
+	    return 0;
+	}
+
+    /* other records are not part of the stream */
+    if(buff[3] != THORNIFIX_BIN_TYPE_DELTA)
+	return thornifix_decode_msg_bin(buff, size, msg)? THORNIFIX_ERR_ARGS : 0;
+
+    /* wait for a keyframe if the referenced record was missed */
+    if(obj->_key_flg || (unsigned long long) _thornifix_get_u64(buff+THORNIFIX_BIN_HDR_SZ) != obj->_ref)
+	{
+	    obj->_key_flg = 1;
+	    return THORNIFIX_ERR_REF;
+	}
+
+    memcpy(&_mask, buff+THORNIFIX_DELTA_HDR_SZ-THORNIFIX_BIN_MASK_SZ, sizeof(uint32_t));
+    _mask = le32toh(_mask) & THORNIFIX_CH_ALL;
+    _num = __builtin_popcount(_mask);
+
+    /* check decimal places before changing the state */
+    _doff = THORNIFIX_DELTA_HDR_SZ + (size_t) _num * sizeof(int32_t);
+    for(_i=0; _i<_num; _i++)
+	{
+	    if((unsigned char) buff[_doff+_i] > THORNIFIX_DELTA_DEC_MAX)
+		return THORNIFIX_ERR_FIELD;
+	}
+
+    _thornifix_msg_val_addr(&obj->_last, _last);
+    _off = THORNIFIX_DELTA_HDR_SZ;
+    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM; _i++)
+	{
+	    if(!(_mask & (1u << _i)))
+		continue;
+	    memcpy(&_u32, buff+_off, sizeof(uint32_t));
+	    _dec = (unsigned char) buff[_doff++];
+	    *((double*) _last[_i]) = (double) (int32_t) le32toh(_u32) / _thornifix_pow10[_dec];
+	    _off += sizeof(int32_t);
+	}
+
+    memcpy(&_u32, buff+4, sizeof(uint32_t));
+    obj->_last._cmd = (int) le32toh(_u32);
+    obj->_last._seq = (unsigned long long) _thornifix_get_u64(buff+8);
+    obj->_last._tstamp = (unsigned long long) _thornifix_get_u64(buff+16);
+    obj->_ref = obj->_last._seq;
+
+    memcpy((void*) msg, (const void*) &obj->_last, sizeof(struct thor_msg));
+    return 0;
+}
+
+/* encode command record */
+int thornifix_encode_cmd(const struct thor_cmd* cmd, char* buff, size_t size)
+{
+    int _i;
+    uint32_t _u32;
+    uint64_t _val;
+
+    if(cmd == NULL || buff == NULL || size < THORNIFIX_CMD_SZ)
+	return -1;
+
+    buff[0] = THORNIFIX_CMD_MAGIC0;
+    buff[1] = THORNIFIX_CMD_MAGIC1;
+    buff[2] = THORNIFIX_CMD_VERSION;
+    buff[3] = (char) cmd->_type;
+
+    _u32 = htole32((uint32_t) cmd->_id);
+    memcpy(buff+4, &_u32, sizeof(uint32_t));
+    _u32 = htole32((uint32_t) cmd->_status);
+    memcpy(buff+8, &_u32, sizeof(uint32_t));
+    memset(buff+12, 0, sizeof(uint32_t));
+    _thornifix_put_u64(buff+16, (uint64_t) cmd->_tstamp);
+
+    for(_i=0; _i<THORNIFIX_CMD_ARG_NUM; _i++)
+	{
+	    memcpy(&_val, &cmd->_args[_i], sizeof(uint64_t));
+	    _thornifix_put_u64(buff+24+_i*THORNIFIX_MSG_BUFF_ELM_SZ, _val);
+	}
+
+    return THORNIFIX_CMD_SZ;
+}
+
+/* decode command record */
+int thornifix_decode_cmd(const char* buff, size_t size, struct thor_cmd* cmd)
+{
+    int _i;
+    uint32_t _u32;
+    uint64_t _val;
+
+    if(buff == NULL || cmd == NULL || !thornifix_is_cmd(buff, size) ||
+       buff[2] != THORNIFIX_CMD_VERSION)
+	return -1;
+
+    cmd->_type = (unsigned char) buff[3];
+    memcpy(&_u32, buff+4, sizeof(uint32_t));
+    cmd->_id = (unsigned int) le32toh(_u32);
+    memcpy(&_u32, buff+8, sizeof(uint32_t));
+    cmd->_status = (int) le32toh(_u32);
+    cmd->_tstamp = (unsigned long long) _thornifix_get_u64(buff+16);
+
+    for(_i=0; _i<THORNIFIX_CMD_ARG_NUM; _i++)
+	{
+	    _val = _thornifix_get_u64(buff+24+_i*THORNIFIX_MSG_BUFF_ELM_SZ);
+	    memcpy(&cmd->_args[_i], &_val, sizeof(uint64_t));
+	}
+
+    return 0;
+}
 
+/* Convert integer field */
+static int _thornifix_parse_int(const char* buff, const char* end, const char** next, int* val)
+{
+    const char* _p = buff;
+    long long _val = 0;
+    int _neg = 0;
+
+    if(_p < end && (*_p == '-' || *_p == '+'))
+	_neg = *_p++ == '-';
+
+    /* at least one digit, no more than fit an int */
+    if(_p >= end || (unsigned int) (*_p - '0') > 9)
+	return -1;
+    for(; _p < end && (unsigned int) (*_p - '0') <= 9; _p++)
+	{
+	    _val = _val * 10 + (*_p - '0');
+	    if(_val > 2147483648LL)
+		return -1;
+	}
+
+    _val = _neg? -_val : _val;
+    if(_val > 2147483647LL)
+	return -1;
+
+    *val = (int) _val;
+    *next = _p;
     return 0;
 }
+
+/*
+ * Convert floating point field. Digits are accumulated in an integer
+ * mantissa, if the mantissa and the power of ten are exact the result is
+ * correctly rounded. Other fields fall back to strtod.
+ */
+static int _thornifix_parse_f64(const char* buff, const char* end, const char** next, double* val)
+{
+    const char* _p = buff;
+    uint64_t _mant = 0;
+    int _neg = 0, _digits = 0, _sig = 0, _exp = 0, _e = 0, _eneg = 0;
+
+    if(_p < end && (*_p == '-' || *_p == '+'))
+	_neg = *_p++ == '-';
+
+    /* integer part, leading zeros are not significant */
+    for(; _p < end && (unsigned int) (*_p - '0') <= 9; _p++, _digits++)
+	{
+	    if(_mant == 0 && *_p == '0')
+		continue;
+	    if(_sig++ < THORNIFIX_MANT_DIGITS)
+		_mant = _mant * 10 + (uint64_t) (*_p - '0');
+	    else
+		_exp++;
+	}
+
+    /* fraction */
+    if(_p < end && *_p == '.')
+	{
+	    for(_p++; _p < end && (unsigned int) (*_p - '0') <= 9; _p++, _digits++)
+		{
+		    if(_mant == 0 && *_p == '0')
+			{
+			    _exp--;
+			    continue;
+			}
+		    if(_sig++ < THORNIFIX_MANT_DIGITS)
+			{
+			    _mant = _mant * 10 + (uint64_t) (*_p - '0');
+			    _exp--;
+			}
+		}
+	}
+
+    if(_digits == 0)
+	return _thornifix_parse_slow(buff, end, next, val);
+
+    /* exponent */
+    if(_p < end && (*_p == 'e' || *_p == 'E'))
+	{
+	    _p++;
+	    if(_p < end && (*_p == '-' || *_p == '+'))
+		_eneg = *_p++ == '-';
+	    if(_p >= end || (unsigned int) (*_p - '0') > 9)
+		return -1;
+	    for(; _p < end && (unsigned int) (*_p - '0') <= 9; _p++)
+		{
+		    if(_e < 10000)
+			_e = _e * 10 + (*_p - '0');
+		}
+	    _exp += _eneg? -_e : _e;
+	}
+
+    /* field must end here */
+    if(_p < end && *_p != '|' && *_p != '\n' && *_p != '\r')
+	return _thornifix_parse_slow(buff, end, next, val);
+
+    if(_mant == 0)
+	*val = 0.0;
+    else if(_sig <= THORNIFIX_MANT_DIGITS && _mant <= THORNIFIX_MANT_EXACT &&
+	    _exp >= -THORNIFIX_POW10_MAX && _exp <= THORNIFIX_POW10_MAX)
+	*val = _exp < 0? (double) _mant / _thornifix_pow10[-_exp] : (double) _mant * _thornifix_pow10[_exp];
+    else
+	return _thornifix_parse_slow(buff, end, next, val);
+
+    if(_neg)
+	*val = -*val;
+    *next = _p;
+    return 0;
+}
+
+/* Convert field with strtod, used for values the fast path can not convert exactly */
+static int _thornifix_parse_slow(const char* buff, const char* end, const char** next, double* val)
+{
+    char _t_buff[THORNIFIX_NUM_BUFF_SZ];
+    const char* _p;
+    char* _tail;
+    size_t _len;
+
+    for(_p = buff; _p < end && *_p != '|'; _p++);
+    _len = (size_t) (_p - buff);
+    if(_len == 0 || _len >= THORNIFIX_NUM_BUFF_SZ)
+	return -1;
+
+    memcpy(_t_buff, buff, _len);
+    _t_buff[_len] = '\0';
+    *val = strtod(_t_buff, &_tail);
+    if(_tail == _t_buff)
+	return -1;
+
+    /* only line endings may follow the value */
+    for(; *_tail == '\n' || *_tail == '\r'; _tail++);
+    if(*_tail != '\0')
+	return -1;
+
+    *next = _p;
+    return 0;
+}
+
+/* Write unsigned integer in decimal */
+static size_t _thornifix_put_uint(char* buff, unsigned long long val)
+{
+    char _tmp[20];
+    size_t _i, _cnt = 0;
+
+    do
+	{
+	    _tmp[_cnt++] = (char) ('0' + val % 10);
+	    val /= 10;
+	} while(val);
+
+    for(_i=0; _i<_cnt; _i++)
+	buff[_i] = _tmp[_cnt - _i - 1];
+
+    return _cnt;
+}
+
+/*
+ * Write value with two decimal places. Values are rounded to the nearest
+ * hundredth with ties to even, which matches printf. Integral part
+ * beyond the range of the integer formatter is left to printf.
+ */
+static int _thornifix_put_f64(char* buff, size_t size, double val)
+{
+    int _len;
+    char* _p = buff;
+    unsigned int _ival;
+    double _abs, _int, _prod, _cents, _err;
+
+    if(size < THORNIFIX_FIXED_SZ)
+	return -1;
+
+    /* negative zero is written with the sign */
+    if(signbit(val))
+	*_p++ = '-';
+
+    _abs = fabs(val);
+    if(isnan(val))
+	{
+	    memcpy(_p, "nan", 3);
+	    return (int) (_p - buff) + 3;
+	}
+    if(isinf(val))
+	{
+	    memcpy(_p, "inf", 3);
+	    return (int) (_p - buff) + 3;
+	}
+
+    /* fraction is exact, hundredths of it are rounded on their own */
+    _int = trunc(_abs);
+    _prod = (_abs - _int) * 100.0;
+    _cents = rint(_prod);
+
+    /*
+     * product was rounded onto a tie, error of the product is exact
+     * and tells which side the value is on
+     */
+    if(fabs(_prod - _cents) == 0.5)
+	{
+	    _err = fma(_abs - _int, 100.0, -_prod);
+	    if(_err > 0.0)
+		_cents = floor(_prod) + 1.0;
+	    else if(_err < 0.0)
+		_cents = floor(_prod);
+	}
+
+    if(_cents >= 100.0)
+	{
+	    _int += 1.0;
+	    _cents -= 100.0;
+	}
+
+    if(_int < THORNIFIX_FIXED_MAX)
+	_p += _thornifix_put_uint(_p, (unsigned long long) _int);
+    else
+	{
+	    /* integral value has no radix character */
+	    _len = snprintf(_p, size - (size_t) (_p - buff) - 3, "%.0f", _int);
+	    if(_len < 0 || (size_t) _len >= size - (size_t) (_p - buff) - 3)
+		return -1;
+	    _p += _len;
+	}
+
+    _ival = (unsigned int) _cents;
+    *_p++ = '.';
+    *_p++ = (char) ('0' + _ival / 10);
+    *_p++ = (char) ('0' + _ival % 10);
+    return (int) (_p - buff);
+}
+
+/* Collect address of message values in wire order */
+static void _thornifix_msg_val_addr(const struct thor_msg* msg, const double** vals)
+{
+    vals[0] = &msg->_ao0_val;
+    vals[1] = &msg->_ao1_val;
+    vals[2] = &msg->_ai0_val;
+    vals[3] = &msg->_ai1_val;
+    vals[4] = &msg->_ai2_val;
+    vals[5] = &msg->_ai3_val;
+    vals[6] = &msg->_ai4_val;
+    vals[7] = &msg->_ai5_val;
+    vals[8] = &msg->_ai6_val;
+    vals[9] = &msg->_ai7_val;
+    vals[10] = &msg->_ai8_val;
+    vals[11] = &msg->_ai9_val;
+    vals[12] = &msg->_ai10_val;
+    vals[13] = &msg->_ai11_val;
+    vals[14] = &msg->_ai12_val;
+    vals[15] = &msg->_ai13_val;
+    vals[16] = &msg->_di0_val;
+    vals[17] = &msg->_di1_val;
+    return;
+}
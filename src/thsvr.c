@@ -1,6 +1,7 @@
 /*
  * Implementation of the server object.
  */
+#include <time.h>
 #include "thornifix.h"
 #include "thsvr.h"
 
@@ -14,6 +15,31 @@
 #define THSVR_COM_PORT "main_con_port"
 #define THSVR_DEF_COM_PORT "11000"
 #define THSVR_DEF_TIMEOUT "def_time_out"
+#define THSVR_RECV_BUFF_SZ "con_recv_buff_sz"
+#define THSVR_SEND_QUEUE_LEN "con_send_queue_len"
+#define THSVR_SEND_POLICY "con_send_policy"
+#define THSVR_REACTORS "con_reactors"
+#define THSVR_HISTORY_LEN "con_history_len"
+#define THSVR_BATCH_COUNT "con_batch_count"
+#define THSVR_BATCH_TIME "con_batch_time"
+#define THSVR_MCAST_GROUP "multic_con_group"
+#define THSVR_MCAST_PORT "multic_con_port"
+#define THSVR_UNIX_PATH "con_unix_path"
+#define THSVR_SHM_NAME "con_shm_name"
+#define THSVR_DELTA_KEY_IVAL "con_delta_key_ival"
+#define THSVR_DELTA_DEADBAND "con_delta_deadband"
+#define THSVR_DELTA_DECIMALS "con_delta_decimals"
+#define THSVR_SYS_RATE "sys_sample_rate"
+#define THSVR_SYS_BLOCK_SZ "sys_block_size"
+#define THSVR_SYS_DEVICE "sys_device"
+#define THSVR_SYS_SIM "sys_sim"
+#define THSVR_SYS_REPLAY "sys_replay"
+#define THSVR_SYS_CAPTURE "sys_capture"
+#define THSVR_CAPTURE_NAME_SZ 256
+#define THSVR_SYS_RT_POLICY "sys_rt_policy"
+#define THSVR_SYS_RT_PRIO "sys_rt_priority"
+#define THSVR_SYS_RT_CPU "sys_rt_cpu"
+#define THSVR_SYS_MEM_LOCK "sys_mem_lock"
 
 #define THSVR_SYS_SAMPLE_RATE 1.0
 
@@ -32,8 +58,13 @@
 static int _thsvr_sys_interupt_callback(thsys* obj, void* self);
 static int _thsvy_sys_update_callback(thsys* obj, void* self, const float64* buff, const int sz);
 static int _thsvr_con_recv_callback(void* obj, void* msg, size_t sz);
+static int _thsvr_sys_write_callback(thsys* obj, void* self, thsys_req req, unsigned int id, int tag, int status, unsigned long long tstamp);
 static int _thsvr_con_made_callback(void* obj, void* con);
 static int _thsvr_con_closed_callback(void* obj, void* con, int fd);
+/* Handle command record and acknowledge it */
+static int _thsvr_cmd_handler(thsvr* obj, const char* msg, size_t sz);
+static int _thsvr_cmd_ack(thsvr* obj, int fd, struct thor_cmd* cmd, int status);
+
 /*
  * Initialise the server component and get configuration settings
  * for the admin url etc.
@@ -46,6 +77,7 @@ int thsvr_init(thsvr* obj, const config_t* config)
 
     /* set and initialise internal variables */
     obj->_var_config = config;
+    obj->_var_capture = NULL;
 
     /* Initialise buffers */
     memset((void*) obj->var_admin1_url, 0, THCON_URL_BUFF_SZ);
@@ -70,6 +102,7 @@ int thsvr_init(thsvr* obj, const config_t* config)
 
     /* Set callback methods */
     obj->_var_sys.var_callback_update = _thsvy_sys_update_callback;
+    obj->_var_sys.var_callback_write = _thsvr_sys_write_callback;
     obj->_var_con._thcon_recv_callback = _thsvr_con_recv_callback;
     obj->_var_con._thcon_conn_made = _thsvr_con_made_callback;
     obj->_var_con._thcon_conn_closed = _thsvr_con_closed_callback;    
@@ -98,6 +131,11 @@ void thsvr_delete(thsvr* obj)
     /* Delete both connection and the system object */
     thcon_delete(&obj->_var_con);
     thsys_delete(&obj->_var_sys);
+
+    /* Close capture after the last sample was written */
+    if(obj->_var_capture)
+	fclose(obj->_var_capture);
+    obj->_var_capture = NULL;
     return;
 }
 
@@ -107,9 +145,15 @@ void thsvr_delete(thsvr* obj)
  */
 int thsvr_start(thsvr* obj)
 {
-    int _time_out = 0;
+    int _time_out = 0, _i;
+    unsigned int _dec;
+    double _band;
     const char* _t_buff;    
+    char _capture_name[THSVR_CAPTURE_NAME_SZ];
+    time_t _t;
     struct config_setting_t* _setting;
+    struct config_setting_t* _setting2;
+    thdaq* _daq;
     
     /* check for object */
     if(obj == NULL || obj->var_init_flg != 1)
@@ -159,6 +203,186 @@ int thsvr_start(thsvr* obj)
     if(_setting)
 	_time_out = config_setting_get_int(_setting);
     thcon_set_timeout(&obj->_var_con, _time_out);
+
+    /* Get size of the receive buffer of each client connection */
+    _setting = config_lookup(obj->_var_config, THSVR_RECV_BUFF_SZ);
+    if(_setting)
+	thcon_set_recv_buff_sz(&obj->_var_con, (unsigned int) config_setting_get_int(_setting));
+
+    /* Get send queue length and the policy for slow clients */
+    _setting = config_lookup(obj->_var_config, THSVR_SEND_QUEUE_LEN);
+    if(_setting)
+	thcon_set_send_queue_len(&obj->_var_con, (unsigned int) config_setting_get_int(_setting));
+
+    _setting = config_lookup(obj->_var_config, THSVR_SEND_POLICY);
+    if(_setting)
+	{
+	    _t_buff = config_setting_get_string(_setting);
+	    if(_t_buff && strcmp(_t_buff, "drop_newest") == 0)
+		thcon_set_bp_policy(&obj->_var_con, thcon_bp_drop_newest);
+	    else if(_t_buff && strcmp(_t_buff, "coalesce") == 0)
+		thcon_set_bp_policy(&obj->_var_con, thcon_bp_coalesce);
+	    else if(_t_buff && strcmp(_t_buff, "disconnect") == 0)
+		thcon_set_bp_policy(&obj->_var_con, thcon_bp_disconnect);
+	    else
+		thcon_set_bp_policy(&obj->_var_con, thcon_bp_drop_oldest);
+	}
+
+    /* Get number of reactor threads handling the clients */
+    _setting = config_lookup(obj->_var_config, THSVR_REACTORS);
+    if(_setting)
+	thcon_set_reactors(&obj->_var_con, (unsigned int) config_setting_get_int(_setting));
+
+    /* Get number of messages replayed to reconnecting clients */
+    _setting = config_lookup(obj->_var_config, THSVR_HISTORY_LEN);
+    if(_setting)
+	thcon_set_history_len(&obj->_var_con, (unsigned int) config_setting_get_int(_setting));
+
+    /* Get batching of samples, number of samples and the window in micro seconds */
+    _setting = config_lookup(obj->_var_config, THSVR_BATCH_COUNT);
+    if(_setting)
+	obj->_var_con.var_batch_cnt = (unsigned int) config_setting_get_int(_setting);
+    _setting = config_lookup(obj->_var_config, THSVR_BATCH_TIME);
+    if(_setting)
+	obj->_var_con.var_batch_time = (unsigned int) config_setting_get_int(_setting);
+
+    /* Get multicast group the samples are published to, empty disables it */
+    _setting = config_lookup(obj->_var_config, THSVR_MCAST_GROUP);
+    _t_buff = _setting? config_setting_get_string(_setting) : NULL;
+    _setting = config_lookup(obj->_var_config, THSVR_MCAST_PORT);
+    if(_t_buff && _t_buff[0] != '\0' && _setting && config_setting_get_string(_setting))
+	{
+	    thcon_set_mcast(&obj->_var_con, _t_buff, config_setting_get_string(_setting));
+	}
+
+    /* Get unix domain socket and shared memory for clients on the same host */
+    _setting = config_lookup(obj->_var_config, THSVR_UNIX_PATH);
+    if(_setting)
+	{
+	    _t_buff = config_setting_get_string(_setting);
+	    if(_t_buff)
+		thcon_set_unix_path(&obj->_var_con, _t_buff);
+	}
+
+    _setting = config_lookup(obj->_var_config, THSVR_SHM_NAME);
+    if(_setting)
+	{
+	    _t_buff = config_setting_get_string(_setting);
+	    if(_t_buff)
+		thcon_set_shm_name(&obj->_var_con, _t_buff);
+	}
+
+    /*
+     * Serve the delta protocol if a keyframe interval is set, deadbands
+     * and decimal places are given in the order of the channels.
+     */
+    _setting = config_lookup(obj->_var_config, THSVR_DELTA_KEY_IVAL);
+    if(_setting && config_setting_get_int(_setting) > 0)
+	{
+	    thcon_set_delta(&obj->_var_con, (unsigned int) config_setting_get_int(_setting));
+
+	    _setting = config_lookup(obj->_var_config, THSVR_DELTA_DEADBAND);
+	    _setting2 = config_lookup(obj->_var_config, THSVR_DELTA_DECIMALS);
+	    for(_i=0; _i<THORNIFIX_BIN_VAL_NUM; _i++)
+		{
+		    _band = 0.0;
+		    _dec = THORNIFIX_DELTA_DEC_DEF;
+		    if(_setting && _i < config_setting_length(_setting))
+			_band = config_setting_get_float_elem(_setting, _i);
+		    if(_setting2 && _i < config_setting_length(_setting2) &&
+		       config_setting_get_int_elem(_setting2, _i) >= 0)
+			_dec = (unsigned int) config_setting_get_int_elem(_setting2, _i);
+
+		    thornifix_delta_set_chan(thcon_get_delta(&obj->_var_con), _i, _band, _dec);
+		}
+	}
+
+    /*
+     * Get sample rate and the number of scans read in a block, blocks
+     * are paced by the sample clock of the device. Size of 0 reads
+     * single scans. Each scan of a block is multicast as a message,
+     * blocks are limited to the messages the connection queues at once.
+     */
+    _setting = config_lookup(obj->_var_config, THSVR_SYS_RATE);
+    if(_setting && config_setting_get_float(_setting) > 0.0)
+	thsys_set_sample_rate(&obj->_var_sys, config_setting_get_float(_setting));
+    _setting = config_lookup(obj->_var_config, THSVR_SYS_BLOCK_SZ);
+    if(_setting && config_setting_get_int(_setting) > THCON_MAX_BURST)
+	{
+	    THOR_LOG_ERROR("block size exceeds the messages queued at once, limited");
+	    thsys_set_block_size(&obj->_var_sys, THCON_MAX_BURST);
+	}
+    else if(_setting && config_setting_get_int(_setting) >= 0)
+	thsys_set_block_size(&obj->_var_sys, (unsigned int) config_setting_get_int(_setting));
+
+    /* Get real time settings of the acquisition thread */
+    _setting = config_lookup(obj->_var_config, THSVR_SYS_RT_POLICY);
+    _t_buff = _setting? config_setting_get_string(_setting) : NULL;
+    if(_t_buff)
+	{
+	    _i = SCHED_OTHER;
+	    if(strcmp(_t_buff, "fifo") == 0)
+		_i = SCHED_FIFO;
+	    else if(strcmp(_t_buff, "rr") == 0)
+		_i = SCHED_RR;
+
+	    _setting = config_lookup(obj->_var_config, THSVR_SYS_RT_PRIO);
+	    thsys_set_rt_sched(&obj->_var_sys, _i, _setting? config_setting_get_int(_setting) : 0);
+	}
+
+    _setting = config_lookup(obj->_var_config, THSVR_SYS_RT_CPU);
+    if(_setting)
+	thsys_set_rt_cpu(&obj->_var_sys, config_setting_get_int(_setting));
+    _setting = config_lookup(obj->_var_config, THSVR_SYS_MEM_LOCK);
+    if(_setting)
+	thsys_set_rt_mem_lock(&obj->_var_sys, config_setting_get_bool(_setting)? 1 : 0);
+
+    /*
+     * Use the simulated device or replay a capture if requested,
+     * otherwise the device the server was built with.
+     */
+    _setting = config_lookup(obj->_var_config, THSVR_SYS_DEVICE);
+    _t_buff = _setting? config_setting_get_string(_setting) : NULL;
+    _daq = NULL;
+    if(_t_buff && strcmp(_t_buff, "sim") == 0)
+	{
+	    _daq = thdaq_sim_new();
+	    _setting = config_lookup(obj->_var_config, THSVR_SYS_SIM);
+	}
+    else if(_t_buff && strcmp(_t_buff, "replay") == 0)
+	{
+	    _daq = thdaq_replay_new();
+	    _setting = config_lookup(obj->_var_config, THSVR_SYS_REPLAY);
+	}
+    else
+	_t_buff = NULL;
+
+    if(_t_buff)
+	{
+	    if(_daq == NULL)
+		return -1;
+	    thdaq_set_config(_daq, _setting);
+	    if(thsys_set_daq(&obj->_var_sys, _daq))
+		{
+		    THOR_LOG_ERROR("unable to use the requested device");
+		    return -1;
+		}
+	}
+
+    /*
+     * Capture samples to a file named by the time format given, the
+     * capture can be replayed. Empty disables capturing.
+     */
+    _setting = config_lookup(obj->_var_config, THSVR_SYS_CAPTURE);
+    _t_buff = _setting? config_setting_get_string(_setting) : NULL;
+    if(_t_buff && _t_buff[0] != '\0' && obj->_var_capture == NULL)
+	{
+	    _t = time(NULL);
+	    if(strftime(_capture_name, THSVR_CAPTURE_NAME_SZ, _t_buff, localtime(&_t)) > 0)
+		obj->_var_capture = fopen(_capture_name, "wb");
+	    if(obj->_var_capture == NULL)
+		THOR_LOG_ERROR("unable to open capture file");
+	}
     
     /*
      * Reset connection info struct.
@@ -213,8 +437,9 @@ int thsvr_stop(thsvr* obj)
 static int _thsvy_sys_update_callback(thsys* obj, void* self, const float64* buff, const int sz)
 {
     struct thor_msg _msg;
-    char _msg_buff[THORINIFIX_MSG_SZ];
     thsvr* _obj;
+    int _i;
+    char _rec[THORNIFIX_BIN_MSG_SZ];
 
     if(self == NULL || buff == NULL || sz <= 0)
 	return -1;
@@ -224,37 +449,51 @@ static int _thsvy_sys_update_callback(thsys* obj, void* self, const float64* buf
     
     /* initialise message buffer size */
     thorinifix_init_msg(&_msg);
-    thorinifix_init_msg(_msg_buff);
     
     /*
      * Using common message struct, copy ray message to the struct and encode it
-     * before multi casting.
+     * before multi casting. Blocks of scans are sent as one message per scan.
      */
-    _msg._cmd = 0;
-    _msg._ao0_val = thsys_get_out_buff_val(obj, 0);
-    _msg._ao1_val = thsys_get_out_buff_val(obj, 1);
-    _msg._ai0_val = (double) buff[0];
-    _msg._ai1_val = (double) buff[1];
-    _msg._ai2_val = (double) buff[2];
-    _msg._ai3_val = (double) buff[3];
-    _msg._ai4_val = (double) buff[4];
-    _msg._ai5_val = (double) buff[5];
-    _msg._ai6_val = (double) buff[6];
-    _msg._ai7_val = (double) buff[7];
-    _msg._ai8_val = (double) buff[8];
-    _msg._ai9_val = (double) buff[9];
-    _msg._ai10_val = (double) buff[10];
-    _msg._ai11_val = (double) buff[11];
-    _msg._ai12_val = (double) buff[12];
-    _msg._ai13_val = (double) buff[13];
-
-    /* Digital read set to zero */
-    _msg._di0_val = 0.0;
-    _msg._di1_val = 0.0;
-
-    /* encode message to string and multi cast */
-    thornifix_encode_msg(&_msg, _msg_buff, THORINIFIX_MSG_SZ);
-    thcon_multicast(&_obj->_var_con, _msg_buff, THORINIFIX_MSG_SZ);
+    for(_i=0; _i+THSYS_NUM_AI_CHANNELS<=sz; _i+=THSYS_NUM_AI_CHANNELS, buff+=THSYS_NUM_AI_CHANNELS)
+	{
+	    _msg._cmd = 0;
+	    _msg._ao0_val = thsys_get_out_buff_val(obj, 0);
+	    _msg._ao1_val = thsys_get_out_buff_val(obj, 1);
+	    _msg._ai0_val = (double) buff[0];
+	    _msg._ai1_val = (double) buff[1];
+	    _msg._ai2_val = (double) buff[2];
+	    _msg._ai3_val = (double) buff[3];
+	    _msg._ai4_val = (double) buff[4];
+	    _msg._ai5_val = (double) buff[5];
+	    _msg._ai6_val = (double) buff[6];
+	    _msg._ai7_val = (double) buff[7];
+	    _msg._ai8_val = (double) buff[8];
+	    _msg._ai9_val = (double) buff[9];
+	    _msg._ai10_val = (double) buff[10];
+	    _msg._ai11_val = (double) buff[11];
+	    _msg._ai12_val = (double) buff[12];
+	    _msg._ai13_val = (double) buff[13];
+
+	    /* Digital read set to zero */
+	    _msg._di0_val = 0.0;
+	    _msg._di1_val = 0.0;
+
+	    /* Scan sequence number and acquisition time */
+	    _msg._seq = thsys_get_scan_seq(obj) + (unsigned long long) (_i / THSYS_NUM_AI_CHANNELS);
+	    _msg._tstamp = thsys_get_scan_tstamp(obj) +
+		    (unsigned long long) (_i / THSYS_NUM_AI_CHANNELS) * thsys_get_scan_period(obj);
+
+	    /*
+	     * Multi cast the message, connection object encodes the message
+	     * in the format each client has requested. Sequence numbers start
+	     * at one so that every message is kept for resuming clients.
+	     */
+	    thcon_multicast_msg(&_obj->_var_con, &_msg);
+
+	    /* Record sample in the capture */
+	    if(_obj->_var_capture && thornifix_encode_msg_bin(&_msg, _rec, THORNIFIX_BIN_MSG_SZ) > 0)
+		fwrite(_rec, 1, THORNIFIX_BIN_MSG_SZ, _obj->_var_capture);
+	}
 
     return 0;
 }
@@ -286,6 +525,10 @@ static int _thsvr_con_recv_callback(void* obj, void* msg, size_t sz)
 
     _obj = (thsvr*) obj;
 
+    /* Typed commands are acknowledged, other messages are output writes */
+    if(thornifix_is_cmd(msg, sz))
+	return _thsvr_cmd_handler(_obj, (const char*) msg, sz);
+
     _ao_buff[0] = 0.0;
     _ao_buff[1] = 0.0;
 
@@ -293,7 +536,12 @@ static int _thsvr_con_recv_callback(void* obj, void* msg, size_t sz)
     thorinifix_init_msg(&_msg);
     
     /* Decode the message */
-    if(thornifix_decode_msg((const char*) msg, sz, &_msg))
+    if(thornifix_is_bin_msg(msg, sz))
+	{
+	    if(thornifix_decode_msg_bin((const char*) msg, sz, &_msg))
+		return -1;
+	}
+    else if(thornifix_decode_msg((const char*) msg, sz, &_msg))
 	return -1;
 
     /* Check command here */
@@ -357,3 +605,109 @@ static int _thsvr_con_closed_callback(void* obj, void* con, int fd)
 
     return 0;
 }
+
+/*
+ * Handle command record of the active connection. Output writes and
+ * sample rate changes are acknowledged by the system thread once
+ * applied, other commands are
+ * acknowledged when applied.
+ */
+static int _thsvr_cmd_handler(thsvr* obj, const char* msg, size_t sz)
+{
+    float64 _ao_buff[THSYS_NUM_AO_CHANNELS];
+    struct thor_cmd _cmd;
+    int _fd;
+
+    if(thornifix_decode_cmd(msg, sz, &_cmd))
+	return -1;
+
+    /* recv callback is called with the socket of the sender active */
+    _fd = THCON_GET_ACTIVE_SOCK(&obj->_var_con);
+
+    switch(_cmd._type)
+	{
+	case thor_cmd_set_ao:
+	    _ao_buff[0] = (float64) _cmd._args[0];
+	    _ao_buff[1] = (float64) _cmd._args[1];
+	    if(_cmd._id == 0 || thsys_set_write_cmd(&obj->_var_sys, _ao_buff, THSYS_NUM_AO_CHANNELS, _cmd._id, _fd))
+		return _thsvr_cmd_ack(obj, _fd, &_cmd, -1);
+	    return 0;
+	case thor_cmd_queue_ao:
+	    _ao_buff[0] = (float64) _cmd._args[0];
+	    _ao_buff[1] = (float64) _cmd._args[1];
+	    if(_cmd._id == 0 || thsys_queue_write_cmd(&obj->_var_sys, _ao_buff, THSYS_NUM_AO_CHANNELS, _cmd._id, _fd))
+		return _thsvr_cmd_ack(obj, _fd, &_cmd, -1);
+	    return 0;
+	case thor_cmd_set_rate:
+	    if(_cmd._id == 0 || thsys_set_rate_cmd(&obj->_var_sys, (float64) _cmd._args[0], _cmd._id, _fd))
+		return _thsvr_cmd_ack(obj, _fd, &_cmd, -1);
+	    return 0;
+	case thor_cmd_ping:
+	    return _thsvr_cmd_ack(obj, _fd, &_cmd, 0);
+	case thor_cmd_subscribe:
+	    return _thsvr_cmd_ack(obj, _fd, &_cmd,
+				  thcon_set_peer_sub(&obj->_var_con, _fd, (unsigned int) _cmd._args[0],
+						     _cmd._args[1] > 0.0? (unsigned int) (1000000.0 / _cmd._args[1]) : 0));
+	default:
+	    return _thsvr_cmd_ack(obj, _fd, &_cmd, -1);
+	}
+}
+
+/* Send acknowledgement of the command to the requester */
+static int _thsvr_cmd_ack(thsvr* obj, int fd, struct thor_cmd* cmd, int status)
+{
+    char _buff[THORNIFIX_CMD_SZ];
+    struct timespec _tm;
+
+    clock_gettime(CLOCK_MONOTONIC, &_tm);
+    cmd->_type |= THORNIFIX_CMD_ACK;
+    cmd->_status = status;
+    cmd->_tstamp = (unsigned long long) _tm.tv_sec * 1000000000ULL + _tm.tv_nsec;
+
+    if(thornifix_encode_cmd(cmd, _buff, THORNIFIX_CMD_SZ) < 0)
+	return -1;
+    return thcon_send_to(&obj->_var_con, fd, _buff, THORNIFIX_CMD_SZ);
+}
+
+/*
+ * Request of the system was applied, acknowledge with the type of the
+ * command, the time applied and the output values or sample rate.
+ */
+static int _thsvr_sys_write_callback(thsys* obj, void* self, thsys_req req, unsigned int id, int tag, int status, unsigned long long tstamp)
+{
+    char _buff[THORNIFIX_CMD_SZ];
+    struct thor_cmd _cmd;
+    thsvr* _obj;
+
+    if(self == NULL)
+	return -1;
+
+    _obj = (thsvr*) self;
+
+    memset(&_cmd, 0, sizeof(struct thor_cmd));
+    _cmd._id = id;
+    _cmd._status = status;
+    _cmd._tstamp = tstamp;
+    switch(req)
+	{
+	case thsys_req_rate:
+	    _cmd._type = thor_cmd_set_rate | THORNIFIX_CMD_ACK;
+	    _cmd._args[0] = (double) obj->var_sample_rate;
+	    break;
+	case thsys_req_queue:
+	    _cmd._type = thor_cmd_queue_ao | THORNIFIX_CMD_ACK;
+	    _cmd._args[0] = thsys_get_out_buff_val(obj, 0);
+	    _cmd._args[1] = thsys_get_out_buff_val(obj, 1);
+	    break;
+	default:
+	    _cmd._type = thor_cmd_set_ao | THORNIFIX_CMD_ACK;
+	    _cmd._args[0] = thsys_get_out_buff_val(obj, 0);
+	    _cmd._args[1] = thsys_get_out_buff_val(obj, 1);
+	    break;
+	}
+
+    /* called on the acquisition thread, the writer thread sends the acknowledgement */
+    if(thornifix_encode_cmd(&_cmd, _buff, THORNIFIX_CMD_SZ) < 0)
+	return -1;
+    return thcon_post_to(&_obj->_var_con, tag, _buff, THORNIFIX_CMD_SZ);
+}
@@ -1,33 +1,73 @@
 /* Implementation of the system class */
+#define _GNU_SOURCE
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include "thsys.h"
 
 #define THSYS_USEC_CONV 1000000
+#define THSYS_NSEC_CONV 1000000000ULL
 #define THSYS_UPDATE_RATE (THSYS_USEC_CONV / 2)
 
+/* Output write and the request it acknowledges */
+struct _thsys_out
+{
+    float64 var_buff[THSYS_NUM_AO_CHANNELS];
+    float64 var_rate;					/* sample rate of rate requests */
+    thsys_req var_req;
+    unsigned int var_id;				/* request id, zero if not acknowledged */
+    int var_tag;					/* requester */
+};
+
+/*
+ * Bounded ring of output writes, producers and consumers claim slots
+ * with compare and swap on the positions and the sequence number of
+ * each slot publishes the entry. Same as the message ring of thcon.
+ */
+struct _thsys_ring_slot
+{
+    unsigned long _seq;
+    struct _thsys_out* _out;
+};
+
+struct _thsys_ring
+{
+    unsigned long _enq;					/* enqueue position */
+    char _pad0[64 - sizeof(unsigned long)];
+    unsigned long _deq;					/* dequeue position */
+    char _pad1[64 - sizeof(unsigned long)];
+    unsigned long _mask;
+    struct _thsys_ring_slot _slots[];
+};
+
 /* thread function */
 static void* _thsys_start_async(void* para);
+static void _thsys_read_block(thsys* obj);
+static void _thsys_cfg_clock(thsys* obj);
+static int _thsys_create_thread(thsys* obj);
+static void _thsys_jitter_add(thsys* obj, long long err);
+static void _thsys_jitter_report(thsys* obj);
 static void _thsys_thread_cleanup(void* para);
-static void _thsys_queue_del_helper(void* data);
+static int _thsys_write(thsys* obj, float64* buff, size_t sz, unsigned int id, int tag, int fifo_flg);
+static void _thsys_write_out(thsys* obj);
+static struct _thsys_out* _thsys_out_get(thsys* obj);
+static void _thsys_out_drain(thsys* obj);
+static void _thsys_out_release(thsys* obj, struct _thsys_out* out, int status);
+static struct _thsys_ring* _thsys_ring_new(unsigned long sz);
+static int _thsys_ring_push(struct _thsys_ring* ring, struct _thsys_out* out);
+static struct _thsys_out* _thsys_ring_pop(struct _thsys_ring* ring);
 
 /*
- * Helper macros for configuring the channels.
+ * Helper macros for configuring the channels of the device.
  */
 #define THSYS_CLEAR_TASKS(sys_obj)		\
-    NIClearTask((sys_obj)->var_a_outask);	\
-    NIClearTask((sys_obj)->var_a_intask)
-
+    thdaq_clear((sys_obj)->var_daq)
 
 #define THSYS_CREATE_TASKS(sys_obj)					\
-    if(ERR_CHECK(NICreateTask(THSYS_EMPTY_STR, &(sys_obj)->var_a_outask))) \
-	(sys_obj)->var_g_panic_flg = 1;					\
-    if(ERR_CHECK(NICreateTask(THSYS_EMPTY_STR, &(sys_obj)->var_a_intask))) \
-	(sys_obj)->var_g_panic_flg = 1
-
-#define THSYS_CONFIG_CHANNELS(sys_obj)					\
-    if(ERR_CHECK(NICreateAOVoltageChan((sys_obj)->var_a_outask, THSYS_A0_CHANNELS, THSYS_EMPTY_STR, THSYS_MIN_VAL, THSYS_MAX_VAL, DAQmx_Val_Volts , NULL))) \
-	(sys_obj)->var_g_panic_flg = 1;					\
-    if(ERR_CHECK(NICreateAIVoltageChan((sys_obj)->var_a_intask, THSYS_AI_CHANNELS, THSYS_EMPTY_STR,  DAQmx_Val_NRSE, THSYS_MIN_VAL, THSYS_MAX_VAL, DAQmx_Val_Volts, NULL))) \
+    thdaq_set_channels((sys_obj)->var_daq, THSYS_AI_CHANNELS, THSYS_NUM_AI_CHANNELS, \
+		       THSYS_A0_CHANNELS, THSYS_NUM_AO_CHANNELS, THSYS_MIN_VAL, THSYS_MAX_VAL); \
+    if(thdaq_create((sys_obj)->var_daq))				\
 	(sys_obj)->var_g_panic_flg = 1
 
 /* Initialise method */
@@ -43,22 +83,27 @@ int thsys_init(thsys* obj, int (*callback) (thsys*, void*))
     obj->var_run_flg = 0;
     obj->var_g_panic_flg = 0;
 
-    /* create tasks */
-    THSYS_CREATE_TASKS(obj);
-    if(obj->var_g_panic_flg)
+    /* default device */
+#ifdef THOR_INC_NI
+    obj->var_daq = thdaq_ni_new();
+#else
+    obj->var_daq = thdaq_sim_new();
+#endif
+    if(obj->var_daq == NULL)
 	{
-	    THOR_LOG_ERROR("thor unable to create tasks");
+	    THOR_LOG_ERROR("thor unable to create device");
 	    return -1;
 	}
 
     /*
-     * Create channels in order. If it failed at this point
-     * clear the task and exit.
+     * Create tasks and channels. If it failed at this point
+     * delete the device and exit.
      */
-    THSYS_CONFIG_CHANNELS(obj);
+    THSYS_CREATE_TASKS(obj);
     if(obj->var_g_panic_flg)
 	{
-	    THSYS_CLEAR_TASKS(obj);
+	    thdaq_delete(obj->var_daq);
+	    obj->var_daq = NULL;
 	    THOR_LOG_ERROR("thor system failed to initialised");
 	    return -1;
 	}
@@ -70,16 +115,46 @@ int thsys_init(thsys* obj, int (*callback) (thsys*, void*))
 	obj->var_outbuff[i] = 0.0;
 
     obj->var_sample_rate = THSYS_DEFAULT_SAMPLE_RATE;
+    obj->_var_clock_rate = 0.0;
+    obj->var_scan_seq = 0;
+    obj->var_scan_tstamp = 0;
+    obj->var_scan_period = 0;
+    obj->var_block_sz = 0;
+    obj->_var_block = NULL;
+    obj->var_rt_policy = SCHED_OTHER;
+    obj->var_rt_prio = 0;
+    obj->var_rt_cpu = -1;
+    obj->var_rt_mem_lock = 0;
+    memset(&obj->var_jitter, 0, sizeof(struct thsys_jitter));
+    obj->_var_jitter_last = 0;
     obj->var_callback_intrupt = callback;
     obj->var_callback_update = NULL;
+    obj->var_callback_write = NULL;
     obj->var_ext_obj = NULL;
+
+    /* Preallocate output writes, all entries start in the free ring */
+    obj->_var_out_mbox = NULL;
+    obj->_var_rate_mbox = NULL;
+    obj->_var_out_pool = (struct _thsys_out*) calloc(THSYS_OUT_POOL_SZ, sizeof(struct _thsys_out));
+    obj->_var_out_free = _thsys_ring_new(THSYS_OUT_POOL_SZ);
+    obj->_var_out_fifo = _thsys_ring_new(THSYS_OUT_FIFO_LEN);
+    if(obj->_var_out_pool == NULL || obj->_var_out_free == NULL || obj->_var_out_fifo == NULL)
+	{
+	    free(obj->_var_out_pool);
+	    free(obj->_var_out_free);
+	    free(obj->_var_out_fifo);
+	    THSYS_CLEAR_TASKS(obj);
+	    thdaq_delete(obj->var_daq);
+	    obj->var_daq = NULL;
+	    THOR_LOG_ERROR("thor unable to allocate output writes");
+	    return -1;
+	}
+    for(i=0; i<THSYS_OUT_POOL_SZ; i++)
+	_thsys_ring_push(obj->_var_out_free, &obj->_var_out_pool[i]);
+
     obj->var_flg = 1;
     sem_init(&obj->var_sem, 0, 0);
 
-    pthread_mutex_init(&obj->_var_mutex, NULL);
-    /* Initialise the output message queue */
-    gqueue_new(&obj->_var_out_queue, _thsys_queue_del_helper);
-
     THOR_LOG_ERROR("thor system initialised");
 
     return 0;
@@ -104,19 +179,32 @@ void thsys_delete(thsys* obj)
 
       }
     THSYS_CLEAR_TASKS(obj);
+    thdaq_delete(obj->var_daq);
+    obj->var_daq = NULL;
 
     obj->var_flg = 0;
     obj->var_client_count = 0;
     obj->var_run_flg = 0;
     obj->var_callback_intrupt = NULL;
     obj->var_callback_update = NULL;
+    obj->var_callback_write = NULL;
     obj->var_ext_obj = NULL;
 
-    /* Delete queue */
-    gqueue_delete(&obj->_var_out_queue);
+    /* Entries left in the rings are part of the pool */
+    free(obj->_var_out_fifo);
+    free(obj->_var_out_free);
+    free(obj->_var_out_pool);
+    obj->_var_out_fifo = NULL;
+    obj->_var_out_free = NULL;
+    obj->_var_out_pool = NULL;
+    obj->_var_out_mbox = NULL;
+    obj->_var_rate_mbox = NULL;
+
+    if(obj->_var_block)
+	free(obj->_var_block);
+    obj->_var_block = NULL;
 
     sem_destroy(&obj->var_sem);
-    pthread_mutex_destroy(&obj->_var_mutex);
     THOR_LOG_ERROR("thor system cleaned up");
     return;
 }
@@ -134,13 +222,49 @@ int thsys_start(thsys* obj)
     if(obj->var_run_flg)
 	return 0;
 
-    /* configure timing and start tasks */
-    ERR_CHECK(NICfgSampClkTiming(obj->var_a_intask, THSYS_CLOCK_SOURCE, obj->var_sample_rate, DAQmx_Val_Rising, DAQmx_Val_ContSamps, 1));
+    /*
+     * Requests which raced with the last stop are still in the mailboxes,
+     * they are failed rather than applied to the new run.
+     */
+    _thsys_out_drain(obj);
+
+    /*
+     * configure timing and start tasks, in block mode the device buffer
+     * holds several blocks so that a late read does not lose scans
+     */
+    if(obj->var_block_sz > 1)
+	{
+	    free(obj->_var_block);
+	    obj->_var_block = (float64*) malloc(sizeof(float64) * THSYS_NUM_AI_CHANNELS * obj->var_block_sz);
+	    if(obj->_var_block == NULL)
+		{
+		    THOR_LOG_ERROR("unable to allocate block buffer");
+		    obj->var_client_count--;
+		    return -1;
+		}
+
+	    thdaq_cfg_clock(obj->var_daq, obj->var_sample_rate, obj->var_block_sz * THSYS_BLOCK_BUFF_NUM);
+	}
+    else
+	thdaq_cfg_clock(obj->var_daq, obj->var_sample_rate, 1);
+    obj->_var_clock_rate = obj->var_sample_rate;
 
     THOR_LOG_ERROR("thor timer configure complete");
 
+    /* lock memory so that the acquisition thread does not page fault */
+    if(obj->var_rt_mem_lock && mlockall(MCL_CURRENT | MCL_FUTURE))
+	THOR_LOG_ERROR("unable to lock memory");
+
+    memset(&obj->var_jitter, 0, sizeof(struct thsys_jitter));
+    obj->_var_jitter_last = 0;
+
     /* creat thread */
-    pthread_create(&obj->var_thread, NULL, _thsys_start_async, (void*) obj);
+    if(_thsys_create_thread(obj))
+	{
+	    THOR_LOG_ERROR("unable to create acquisition thread");
+	    obj->var_client_count--;
+	    return -1;
+	}
 
     obj->var_run_flg = 1;
     return 0;
@@ -166,6 +290,9 @@ int thsys_stop(thsys* obj)
     pthread_cancel(obj->var_thread);
     pthread_join(obj->var_thread, NULL);
 
+    if(obj->var_rt_mem_lock)
+	munlockall();
+
     /*
      * Reconfigure the tasks for the next start.
      * Set init flag to 0.
@@ -173,12 +300,35 @@ int thsys_stop(thsys* obj)
     obj->var_flg = 0;
     THSYS_CLEAR_TASKS(obj);
     THSYS_CREATE_TASKS(obj);
-
-    THSYS_CONFIG_CHANNELS(obj);
     obj->var_flg = 1;
     return 0;
 }
 
+/* Replace the device */
+int thsys_set_daq(thsys* obj, thdaq* daq)
+{
+    if(obj == NULL || daq == NULL)
+	return -1;
+
+    /* Tasks can only be replaced while stopped */
+    if(!obj->var_flg || obj->var_run_flg)
+	return -1;
+
+    THSYS_CLEAR_TASKS(obj);
+    thdaq_delete(obj->var_daq);
+    obj->var_daq = daq;
+
+    obj->var_g_panic_flg = 0;
+    THSYS_CREATE_TASKS(obj);
+    if(obj->var_g_panic_flg)
+	{
+	    THOR_LOG_ERROR("thor unable to create tasks on the device");
+	    return -1;
+	}
+
+    return 0;
+}
+
 int thsys_e_stop(thsys* obj)
 {
     /* Check for object pointer */
@@ -192,9 +342,64 @@ int thsys_e_stop(thsys* obj)
 
 /* set write buffer */
 int thsys_set_write_buff(thsys* obj, float64* buff, size_t sz)
+{
+    return thsys_set_write_cmd(obj, buff, sz, 0, 0);
+}
+
+/* set write buffer of a request */
+int thsys_set_write_cmd(thsys* obj, float64* buff, size_t sz, unsigned int id, int tag)
+{
+    return _thsys_write(obj, buff, sz, id, tag, 0);
+}
+
+/* queue write buffer of a request */
+int thsys_queue_write_cmd(thsys* obj, float64* buff, size_t sz, unsigned int id, int tag)
+{
+    return _thsys_write(obj, buff, sz, id, tag, 1);
+}
+
+/*
+ * Request a new sample rate. The request is swapped in to the rate
+ * mailbox, the request it replaced is acknowledged as superseded.
+ */
+int thsys_set_rate_cmd(thsys* obj, float64 rate, unsigned int id, int tag)
+{
+    struct _thsys_out* _out;
+
+    if(obj == NULL || rate <= 0.0)
+	return -1;
+
+    if((_out = _thsys_out_get(obj)) == NULL)
+	return -1;
+    _out->var_rate = rate;
+    _out->var_req = thsys_req_rate;
+    _out->var_id = id;
+    _out->var_tag = tag;
+
+    /* the clock is configured with the rate on start */
+    if(!obj->var_run_flg)
+	{
+	    obj->var_sample_rate = rate;
+	    _thsys_out_release(obj, _out, 0);
+	    return 0;
+	}
+
+    _out = __atomic_exchange_n(&obj->_var_rate_mbox, _out, __ATOMIC_ACQ_REL);
+    if(_out)
+	_thsys_out_release(obj, _out, THORNIFIX_CMD_SUPERSEDED);
+
+    return 0;
+}
+
+/*
+ * Pass output values to the scan loop. Values are copied to a free
+ * entry which is either queued or swapped in to the mailbox, the
+ * setpoint it replaced is acknowledged as superseded.
+ */
+static int _thsys_write(thsys* obj, float64* buff, size_t sz, unsigned int id, int tag, int fifo_flg)
 {
     int i;
-    float64* _buff;
+    struct _thsys_out* _out;
 
     /* check for object and buffer */
     if(obj == NULL || !buff || !obj->var_run_flg)
@@ -204,46 +409,215 @@ int thsys_set_write_buff(thsys* obj, float64* buff, size_t sz)
     if(sz != THSYS_NUM_AO_CHANNELS)
 	return 1;
 
-    /* allocate buffer */
-    _buff = (float64*) calloc(sz, sizeof(float64));
+    if((_out = _thsys_out_get(obj)) == NULL)
+	return -1;
     for(i=0; i<sz; i++)
-	_buff[i] = buff[i];
+	_out->var_buff[i] = buff[i];
+    _out->var_req = fifo_flg? thsys_req_queue : thsys_req_set;
+    _out->var_id = id;
+    _out->var_tag = tag;
 
-    /* Queue the values */
-    pthread_mutex_lock(&obj->_var_mutex);
-    gqueue_in(&obj->_var_out_queue, (void*) _buff);
-    pthread_mutex_unlock(&obj->_var_mutex);
+    if(fifo_flg)
+	{
+	    if(!_thsys_ring_push(obj->_var_out_fifo, _out))
+		return 0;
+	    while(_thsys_ring_push(obj->_var_out_free, _out))
+		;
+	    return -1;
+	}
+
+    _out = __atomic_exchange_n(&obj->_var_out_mbox, _out, __ATOMIC_ACQ_REL);
+    if(_out)
+	_thsys_out_release(obj, _out, THORNIFIX_CMD_SUPERSEDED);
 
     return 0;
 }
 
+/*
+ * Write the newest setpoint to the device, queued writes are replaced
+ * by it. Without a setpoint the next queued write is written.
+ */
+static void _thsys_write_out(thsys* obj)
+{
+    int _err;
+    struct _thsys_out* _out, *_old;
+
+    _out = __atomic_exchange_n(&obj->_var_out_mbox, NULL, __ATOMIC_ACQ_REL);
+    if(_out)
+	{
+	    while((_old = _thsys_ring_pop(obj->_var_out_fifo)) != NULL)
+		_thsys_out_release(obj, _old, THORNIFIX_CMD_SUPERSEDED);
+	}
+    else if((_out = _thsys_ring_pop(obj->_var_out_fifo)) == NULL)
+	return;
+
+    _err = thdaq_write(obj->var_daq, _out->var_buff, THSYS_NUM_AO_CHANNELS);
+    if(!_err)
+	memcpy(obj->var_outbuff, _out->var_buff, sizeof(float64) * THSYS_NUM_AO_CHANNELS);
+
+    _thsys_out_release(obj, _out, _err? -1 : 0);
+    return;
+}
+
+/*
+ * Take a free entry. Entries released by other threads may not be
+ * published yet, all entries are only in use if the ramp queue is full.
+ */
+static struct _thsys_out* _thsys_out_get(thsys* obj)
+{
+    struct _thsys_out* _out;
+
+    while((_out = _thsys_ring_pop(obj->_var_out_free)) == NULL)
+	{
+	    if(__atomic_load_n(&obj->_var_out_free->_enq, __ATOMIC_ACQUIRE) ==
+	       __atomic_load_n(&obj->_var_out_free->_deq, __ATOMIC_ACQUIRE))
+		return NULL;
+	}
+    return _out;
+}
+
+/* Fail the requests which were not applied */
+static void _thsys_out_drain(thsys* obj)
+{
+    struct _thsys_out* _out;
+
+    if((_out = __atomic_exchange_n(&obj->_var_out_mbox, NULL, __ATOMIC_ACQ_REL)) != NULL)
+	_thsys_out_release(obj, _out, -1);
+    if((_out = __atomic_exchange_n(&obj->_var_rate_mbox, NULL, __ATOMIC_ACQ_REL)) != NULL)
+	_thsys_out_release(obj, _out, -1);
+    while((_out = _thsys_ring_pop(obj->_var_out_fifo)) != NULL)
+	_thsys_out_release(obj, _out, -1);
+    return;
+}
+
+/* Acknowledge the request with the current time and free the entry */
+static void _thsys_out_release(thsys* obj, struct _thsys_out* out, int status)
+{
+    struct timespec _ts;
+
+    if(out->var_id && obj->var_callback_write)
+	{
+	    clock_gettime(CLOCK_MONOTONIC, &_ts);
+	    obj->var_callback_write(obj, obj->var_ext_obj, out->var_req, out->var_id, out->var_tag, status,
+				    (unsigned long long) _ts.tv_sec * THSYS_NSEC_CONV + _ts.tv_nsec);
+	}
+
+    /*
+     * The free ring has room for all entries, a push only fails while
+     * another thread has not released the slot it took.
+     */
+    while(_thsys_ring_push(obj->_var_out_free, out))
+	;
+    return;
+}
+
+/*
+ * Create a ring of sz slots, sz is rounded up to a power of two.
+ * The sequence of a slot tells whether it is free or holds an entry.
+ */
+static struct _thsys_ring* _thsys_ring_new(unsigned long sz)
+{
+    unsigned long i, _cap = 1;
+    struct _thsys_ring* _ring;
+
+    while(_cap < sz)
+	_cap <<= 1;
+
+    _ring = (struct _thsys_ring*) calloc(1, sizeof(struct _thsys_ring) + _cap * sizeof(struct _thsys_ring_slot));
+    if(_ring == NULL)
+	return NULL;
+
+    _ring->_mask = _cap - 1;
+    for(i = 0; i < _cap; i++)
+	_ring->_slots[i]._seq = i;
+
+    return _ring;
+}
+
+/* Add entry to the ring without locking, returns -1 if the ring is full */
+static int _thsys_ring_push(struct _thsys_ring* ring, struct _thsys_out* out)
+{
+    unsigned long _pos, _seq;
+    long _diff;
+    struct _thsys_ring_slot* _slot;
+
+    _pos = __atomic_load_n(&ring->_enq, __ATOMIC_RELAXED);
+    while(1)
+	{
+	    _slot = &ring->_slots[_pos & ring->_mask];
+	    _seq = __atomic_load_n(&_slot->_seq, __ATOMIC_ACQUIRE);
+	    _diff = (long) _seq - (long) _pos;
+	    if(_diff == 0)
+		{
+		    if(__atomic_compare_exchange_n(&ring->_enq, &_pos, _pos + 1, 1,
+						   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+		}
+	    else if(_diff < 0)
+		return -1;
+	    else
+		_pos = __atomic_load_n(&ring->_enq, __ATOMIC_RELAXED);
+	}
+
+    _slot->_out = out;
+    __atomic_store_n(&_slot->_seq, _pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Take the oldest entry from the ring, returns NULL if its empty */
+static struct _thsys_out* _thsys_ring_pop(struct _thsys_ring* ring)
+{
+    unsigned long _pos, _seq;
+    long _diff;
+    struct _thsys_ring_slot* _slot;
+    struct _thsys_out* _out;
+
+    _pos = __atomic_load_n(&ring->_deq, __ATOMIC_RELAXED);
+    while(1)
+	{
+	    _slot = &ring->_slots[_pos & ring->_mask];
+	    _seq = __atomic_load_n(&_slot->_seq, __ATOMIC_ACQUIRE);
+	    _diff = (long) _seq - (long) (_pos + 1);
+	    if(_diff == 0)
+		{
+		    if(__atomic_compare_exchange_n(&ring->_deq, &_pos, _pos + 1, 1,
+						   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+		}
+	    else if(_diff < 0)
+		return NULL;
+	    else
+		_pos = __atomic_load_n(&ring->_deq, __ATOMIC_RELAXED);
+	}
+
+    _out = _slot->_out;
+    __atomic_store_n(&_slot->_seq, _pos + ring->_mask + 1, __ATOMIC_RELEASE);
+    return _out;
+}
+
 /* thread cleanup handler */
 static void _thsys_thread_cleanup(void* para)
 {
-    int32 _samples;
     float64 _buff[THSYS_NUM_AO_CHANNELS];
     thsys* _obj;
-    char _err_msg[THOR_BUFF_SZ];
 
     if(para == NULL)
 	return;
     _obj = (thsys*) para;
 
+    /* Requests not applied are failed */
+    _thsys_out_drain(_obj);
+
     _buff[0] = 0.0;
     _buff[1] = 0.0;
-    ERR_CHECK(NIWriteAnalogArrayF64(_obj->var_a_outask, 1, 0, THSYS_DEF_TIMEOUT, DAQmx_Val_GroupByScanNumber, _buff, &_samples, NULL));
 
     /* Log messsage to indicate output channels have been reset */
-    if(_samples > 0)
-	{
-	    memset((void*) _err_msg, 0, THOR_BUFF_SZ);
-	    sprintf(_err_msg, "Output channels reset %d", (int) _samples);
-	    THOR_LOG_ERROR(_err_msg);
-	}
+    if(!thdaq_write(_obj->var_daq, _buff, THSYS_NUM_AO_CHANNELS))
+	THOR_LOG_ERROR("Output channels reset");
 
     /* stop tasks */
-    NIStopTask(_obj->var_a_outask);
-    NIStopTask(_obj->var_a_intask);
+    thdaq_stop(_obj->var_daq);
+    _thsys_jitter_report(_obj);
     _obj->var_run_flg = 0;
     sem_post(&_obj->var_sem);
 
@@ -254,12 +628,12 @@ static void _thsys_thread_cleanup(void* para)
 /* Thread function */
 static void* _thsys_start_async(void* para)
 {
-    int32 _samples;
     int _old_state;
     thsys* _obj;
     int32 _samples_read = 0;
-    float64* _buff;
-    int _rate = 0, _cnt = 0;
+    struct timespec _ts;
+    int _rate = 0, _cnt = 0, _err;
+    unsigned long long _deadline, _now, _report;
 
     /* push cleanup handler */
     pthread_cleanup_push(_thsys_thread_cleanup, para);
@@ -272,21 +646,25 @@ static void* _thsys_start_async(void* para)
     _obj = (thsys*) para;
     THOR_LOG_ERROR("thor system started");
 
-    ERR_CHECK(NIStartTask(_obj->var_a_intask));
-    ERR_CHECK(NIStartTask(_obj->var_a_outask));
+    thdaq_start(_obj->var_daq);
 
-    /*
-     * Determin rate at wich needs updating.
-     * A counter is used to count time increments and only
-     * update on second intervals.
-     */
-    _rate = (THSYS_USEC_CONV /(_obj->var_sample_rate*THSYS_READ_WRITE_FACTOR));
     _cnt = 0;
+    clock_gettime(CLOCK_MONOTONIC, &_ts);
+    _report = (unsigned long long) _ts.tv_sec * THSYS_NSEC_CONV + _ts.tv_nsec;
+    _deadline = _report;
     while(1)
     	{
     	    /* test for cancel state */
     	    pthread_testcancel();
 
+	    /*
+	     * Determin rate at wich needs updating.
+	     * A counter is used to count time increments and only
+	     * update on second intervals. Sample rate may be changed
+	     * by clients while running.
+	     */
+	    _rate = (THSYS_USEC_CONV /(_obj->var_sample_rate*THSYS_READ_WRITE_FACTOR));
+
     	    /* if callback was set exec */
     	    if(_obj->var_callback_intrupt)
 	        _obj->var_callback_intrupt(_obj, (_obj->var_ext_obj? _obj->var_ext_obj : NULL));
@@ -294,33 +672,73 @@ static void* _thsys_start_async(void* para)
 	    _samples_read = 0;
 	    /* change cancel state to protect read */
 	    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &_old_state);
-    	    ERR_CHECK(NIReadAnalogF64(_obj->var_a_intask, 1, THSYS_DEF_TIMEOUT, DAQmx_Val_GroupByScanNumber, _obj->var_inbuff, THSYS_NUM_AI_CHANNELS, &_samples_read, NULL));
-
-	    /* if a callback for update is hooked, this shall call the callback function */
-	    if(_obj->var_callback_update && !_cnt)
-	      _obj->var_callback_update(_obj, _obj->var_ext_obj, _obj->var_inbuff, THSYS_NUM_AI_CHANNELS);
-
-	    /* If write values are available write to the device */
-	    _buff = NULL;
-	    if(gqueue_count(&_obj->_var_out_queue) > 0)
+	    _thsys_cfg_clock(_obj);
+	    if(_obj->var_block_sz > 1)
+		_thsys_read_block(_obj);
+	    else
 		{
-	    	    pthread_mutex_lock(&_obj->_var_mutex);
-		    gqueue_out(&_obj->_var_out_queue, (void**) &_buff);
-		    pthread_mutex_unlock(&_obj->_var_mutex);
+		    _err = thdaq_read(_obj->var_daq, 1, THSYS_DEF_TIMEOUT, _obj->var_inbuff, THSYS_NUM_AI_CHANNELS, &_samples_read);
+		    clock_gettime(CLOCK_MONOTONIC, &_ts);
+		    _deadline = (unsigned long long) _ts.tv_sec * THSYS_NSEC_CONV + _ts.tv_nsec;
 
-		    /* Write buffer to the device */
-		    if(_buff)
+		    /* scans shall be read a sample period apart, unless paced by the device */
+		    if(!_err && _samples_read > 0 && !_obj->var_daq->var_paced)
 			{
-			    _samples = 0;
-			    ERR_CHECK(NIWriteAnalogArrayF64(_obj->var_a_outask, 1, 0, THSYS_DEF_TIMEOUT, DAQmx_Val_GroupByScanNumber, _buff, &_samples, NULL));
-			    free(_buff);
+			    if(_obj->_var_jitter_last)
+				_thsys_jitter_add(_obj, (long long) (_deadline - _obj->_var_jitter_last) -
+						  (long long) (THSYS_NSEC_CONV / _obj->var_sample_rate));
+			    _obj->_var_jitter_last = _deadline;
+			}
+		    else
+			_obj->_var_jitter_last = 0;
+
+		    /*
+		     * If a callback for update is hooked, this shall call the callback function.
+		     * Only scans read and passed on are numbered, clients detect drops from gaps.
+		     * Each scan of a paced device is passed on.
+		     */
+		    if(_obj->var_callback_update && (!_cnt || _obj->var_daq->var_paced) && !_err && _samples_read > 0)
+			{
+			    _obj->var_scan_seq++;
+			    _obj->var_scan_tstamp = _deadline;
+			    _obj->var_scan_period = 0;
+			    _obj->var_callback_update(_obj, _obj->var_ext_obj, _obj->var_inbuff, THSYS_NUM_AI_CHANNELS);
 			}
 		}
 
+	    /* If write values are available write to the device */
+	    _thsys_write_out(_obj);
+
 	    pthread_setcancelstate(_old_state, NULL);
 
     	    pthread_testcancel();
-    	    usleep((int) ((THSYS_USEC_CONV /(_obj->var_sample_rate*THSYS_READ_WRITE_FACTOR))));
+
+	    clock_gettime(CLOCK_MONOTONIC, &_ts);
+	    _now = (unsigned long long) _ts.tv_sec * THSYS_NSEC_CONV + _ts.tv_nsec;
+	    if(_now - _report >= THSYS_JITTER_REPORT * THSYS_NSEC_CONV)
+		{
+		    _thsys_jitter_report(_obj);
+		    _report = _now;
+		}
+
+	    /* block reads are paced by the sample clock, paced devices by their reads */
+	    if(_obj->var_block_sz > 1 || _obj->var_daq->var_paced)
+		continue;
+
+	    /*
+	     * Sleep until the deadline a fixed period after the scan was
+	     * read, so that the time taken to pass on the scan and write
+	     * the outputs does not add up. Deadlines missed are counted.
+	     */
+	    _deadline += (unsigned long long) (THSYS_NSEC_CONV / (_obj->var_sample_rate * THSYS_READ_WRITE_FACTOR));
+	    if(_now >= _deadline)
+		_obj->var_jitter.var_overrun++;
+	    else
+		{
+		    _ts.tv_sec = _deadline / THSYS_NSEC_CONV;
+		    _ts.tv_nsec = _deadline % THSYS_NSEC_CONV;
+		    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &_ts, NULL) == EINTR);
+		}
 
 	    /*
 	     * When update rate has exceeded, results shall sent to
@@ -335,12 +753,147 @@ static void* _thsys_start_async(void* para)
     return NULL;
 }
 
-/* Delete helper method */
-static void _thsys_queue_del_helper(void* data)
+/*
+ * Reconfigure the sample clock if the sample rate was changed, in both
+ * single scan and block mode. A pending rate request is applied first
+ * and acknowledged once the clock runs at the new rate.
+ */
+static void _thsys_cfg_clock(thsys* obj)
+{
+    int _err = 0;
+    struct _thsys_out* _req;
+
+    _req = __atomic_exchange_n(&obj->_var_rate_mbox, NULL, __ATOMIC_ACQ_REL);
+    if(_req)
+	obj->var_sample_rate = _req->var_rate;
+
+    if(obj->var_sample_rate != obj->_var_clock_rate)
+	{
+	    thdaq_stop(obj->var_daq);
+	    _err = thdaq_cfg_clock(obj->var_daq, obj->var_sample_rate,
+				   obj->var_block_sz > 1? obj->var_block_sz * THSYS_BLOCK_BUFF_NUM : 1);
+	    thdaq_start(obj->var_daq);
+	    obj->_var_clock_rate = obj->var_sample_rate;
+	    obj->_var_jitter_last = 0;
+	}
+
+    if(_req)
+	_thsys_out_release(obj, _req, _err? -1 : 0);
+    return;
+}
+
+/*
+ * Read a block of scans and pass it to the update callback. Read waits
+ * until the device acquired the block. If the read failed (the device
+ * buffer overflowed) acquisition is restarted and the scans in the
+ * buffer are lost.
+ */
+static void _thsys_read_block(thsys* obj)
+{
+    int32 _read = 0;
+    struct timespec _ts;
+    unsigned long long _now;
+
+    if(thdaq_read(obj->var_daq, obj->var_block_sz, THSYS_DEF_TIMEOUT + obj->var_block_sz / obj->var_sample_rate,
+		  obj->_var_block, obj->var_block_sz * THSYS_NUM_AI_CHANNELS, &_read) || _read <= 0)
+	{
+	    thdaq_stop(obj->var_daq);
+	    thdaq_start(obj->var_daq);
+	    obj->_var_jitter_last = 0;
+	    return;
+	}
+    clock_gettime(CLOCK_MONOTONIC, &_ts);
+    _now = (unsigned long long) _ts.tv_sec * 1000000000ULL + _ts.tv_nsec;
+
+    /* blocks shall be read as far apart as they took to acquire */
+    if(obj->_var_jitter_last)
+	_thsys_jitter_add(obj, (long long) (_now - obj->_var_jitter_last) - (long long) (_read * (1e9 / obj->var_sample_rate)));
+    obj->_var_jitter_last = _now;
+
+    /* last scan of the block is the current input */
+    memcpy(obj->var_inbuff, obj->_var_block + (_read - 1) * THSYS_NUM_AI_CHANNELS, sizeof(float64) * THSYS_NUM_AI_CHANNELS);
+
+    /* last scan was acquired when the read returned, first scan is stamped */
+    obj->var_scan_period = (unsigned long long) (1e9 / obj->var_sample_rate);
+    obj->var_scan_seq++;
+    obj->var_scan_tstamp = _now - (unsigned long long) (_read - 1) * obj->var_scan_period;
+    if(obj->var_callback_update)
+	obj->var_callback_update(obj, obj->var_ext_obj, obj->_var_block, (int) _read * THSYS_NUM_AI_CHANNELS);
+
+    obj->var_scan_seq += (unsigned long long) (_read - 1);
+    return;
+}
+
+/*
+ * Create the acquisition thread with the real time settings. If the
+ * process is not permitted to use them, it is created with defaults.
+ */
+static int _thsys_create_thread(thsys* obj)
+{
+    int _err;
+    pthread_attr_t _attr;
+    struct sched_param _param;
+    cpu_set_t _cpus;
+
+    pthread_attr_init(&_attr);
+    if(obj->var_rt_policy != SCHED_OTHER)
+	{
+	    _param.sched_priority = obj->var_rt_prio;
+	    pthread_attr_setinheritsched(&_attr, PTHREAD_EXPLICIT_SCHED);
+	    pthread_attr_setschedpolicy(&_attr, obj->var_rt_policy);
+	    pthread_attr_setschedparam(&_attr, &_param);
+	}
+
+    if(obj->var_rt_cpu >= 0 && obj->var_rt_cpu < CPU_SETSIZE)
+	{
+	    CPU_ZERO(&_cpus);
+	    CPU_SET(obj->var_rt_cpu, &_cpus);
+	    pthread_attr_setaffinity_np(&_attr, sizeof(cpu_set_t), &_cpus);
+	}
+
+    _err = pthread_create(&obj->var_thread, &_attr, _thsys_start_async, (void*) obj);
+    pthread_attr_destroy(&_attr);
+
+    if(_err == EPERM || _err == EINVAL)
+	{
+	    THOR_LOG_ERROR("real time settings of the acquisition thread not permitted");
+	    _err = pthread_create(&obj->var_thread, NULL, _thsys_start_async, (void*) obj);
+	}
+
+    return _err? -1 : 0;
+}
+
+/* Add timing error of the loop to the jitter statistics */
+static void _thsys_jitter_add(thsys* obj, long long err)
 {
-    /* Check for argument */
-    if(data)
-	free(data);
+    double _d;
+    struct thsys_jitter* _jit = &obj->var_jitter;
+
+    if(_jit->var_cnt == 0 || err < _jit->var_min)
+	_jit->var_min = err;
+    if(_jit->var_cnt == 0 || err > _jit->var_max)
+	_jit->var_max = err;
+
+    _jit->var_cnt++;
+    _d = err - _jit->var_mean;
+    _jit->var_mean += _d / _jit->var_cnt;
+    _jit->_var_m2 += _d * (err - _jit->var_mean);
+    return;
+}
+
+/* Log jitter statistics */
+static void _thsys_jitter_report(thsys* obj)
+{
+    char _err_msg[THOR_BUFF_SZ];
+    struct thsys_jitter* _jit = &obj->var_jitter;
+
+    if(_jit->var_cnt == 0 && _jit->var_overrun == 0)
+	return;
 
+    snprintf(_err_msg, THOR_BUFF_SZ, "thor scan jitter n %llu mean %.1f us sd %.1f us min %.1f us max %.1f us overruns %llu",
+	     _jit->var_cnt, _jit->var_mean / 1e3,
+	     _jit->var_cnt > 1? sqrt(_jit->_var_m2 / (_jit->var_cnt - 1)) / 1e3 : 0.0,
+	     _jit->var_min / 1e3, _jit->var_max / 1e3, _jit->var_overrun);
+    THOR_LOG_ERROR(_err_msg);
     return;
 }
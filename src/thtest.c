@@ -51,17 +51,17 @@ static void _sig_handler(int signo)
 
 static int _recv_callback(void* obj, void* msg, size_t sz)
 {
-    char _msg[THORINIFIX_MSG_SZ];
+    const char* _end;
 
     if(msg == NULL || sz <= 0)
 	return 0;
     
-    /* Print messages */
-    memset(_msg, 0, THORINIFIX_MSG_SZ);
-    strncpy(_msg, msg, THORINIFIX_MSG_SZ-1);
-    _msg[THORINIFIX_MSG_SZ-1] = '\0';
+    /* Print messages, up to the null character if sent */
+    _end = memchr(msg, '\0', sz);
+    if(_end != NULL)
+	sz = (size_t) (_end - (const char*) msg);
 
-    fprintf(stdout, "%s\r", _msg);
+    fprintf(stdout, "%.*s\r", (int) sz, (const char*) msg);
     fflush(stdout);
     return 0;
 }
@@ -71,6 +71,7 @@ static int _write_to_svr(void)
 {
     struct thor_msg _msg;						/* message */
     char _msg_buff[THORNIFIX_MSG_BUFF_SZ];
+    int _len;
 
     /* Initialise struct */
     thorinifix_init_msg(&_msg);
@@ -82,10 +83,12 @@ static int _write_to_svr(void)
     _msg._ao1_val = _msg._ao1_val > 10.0? 9.99 : _msg._ao1_val;
     
     /* Encode message buffer */
-    thornifix_encode_msg(&_msg, _msg_buff, THORNIFIX_MSG_BUFF_SZ);
+    _len = thornifix_encode_msg(&_msg, _msg_buff, THORNIFIX_MSG_BUFF_SZ);
+    if(_len < 0)
+	return -1;
 
-    /* Send to the server */
-    thcon_send_info(&_con, (void*) &_msg_buff, THORNIFIX_MSG_BUFF_SZ);
+    /* Send to the server with the null character */
+    thcon_send_info(&_con, (void*) &_msg_buff, (size_t) _len + 1);
     
     return 0;
 }